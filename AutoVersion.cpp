@@ -19,24 +19,100 @@
 #define _CRT_SECURE_NO_WARNINGS
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdarg.h>
-#include <conio.h>
+#include <time.h>
 
 #include <iostream>
 #include <ostream>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <list>
 #include <unordered_set>
 #include <unordered_map>
 #include <algorithm>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <exception>
+#include <memory>
+#include <chrono>
 using namespace std;
 
 #ifdef WIN32
 	#include <windows.h>
+	#include <conio.h>
+	#include <direct.h>
+	#include <psapi.h>
+
+	#define PATH_SEPARATOR	"\\"
+	#define fseek64			_fseeki64
+#else
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <termios.h>
+	#include <sys/mman.h>
+	#include <sys/resource.h>
+	#include <dirent.h>
+	#include <spawn.h>
+	#include <sys/wait.h>
+
+	extern char **environ;
+
+	#define PATH_SEPARATOR	"/"
+	#define _unlink			unlink
+	#define _mkdir(dir)		mkdir(dir, 0777)
+	#define fseek64			fseeko
+#endif
+
+#ifdef __linux__
+	#include <sys/syscall.h>
+	#include <sys/sysmacros.h>
+
+	// daemon mode, see class CDaemon
+	#include <sys/inotify.h>
+	#include <sys/socket.h>
+	#include <sys/un.h>
+	#include <poll.h>
+	#include <signal.h>
+
+	// io_uring for reading many small files, see class CBatchReader
+	#if defined(__has_include)
+		#if __has_include(<linux/io_uring.h>)
+			#include <linux/io_uring.h>
+			#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_NODROP)
+				#define AV_IO_URING
+			#endif
+		#endif
+	#endif
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	#define AV_X86
+	#include <immintrin.h>
+
+	#ifdef _MSC_VER
+		#include <intrin.h>
+		#define AV_TARGET(isa)
+	#else
+		#include <cpuid.h>
+		#define AV_TARGET(isa)	__attribute__((target(isa)))
+	#endif
+#endif
+
+// operator delete must not be inlined, otherwise gcc warns about free() on memory from operator new
+#ifdef _MSC_VER
+	#define AV_NOINLINE		__declspec(noinline)
+#else
+	#define AV_NOINLINE		__attribute__((noinline))
 #endif
 
 #include "AutoVersion.h"
@@ -47,943 +123,8220 @@ using namespace std;
 // ========================================================================
 bool g_bVerbose;	// program is verbose
 
+static const char Version[] = "2.00";
+
+// counters for the statistics report, see --stats. They are only updated if g_bStats is set.
+bool g_bStats;
+static atomic<unsigned long long> g_nBytesRead(0);
+static atomic<unsigned long long> g_nBytesWritten(0);
+static atomic<unsigned long long> g_nFilesOpened(0);
+static atomic<unsigned long long> g_nAllocations(0);
+
+static inline void CountAllocation()
+{
+	if (g_bStats)
+		g_nAllocations.fetch_add(1, memory_order_relaxed);
+}
+
+static inline void CountOpen()
+{
+	if (g_bStats)
+		g_nFilesOpened.fetch_add(1, memory_order_relaxed);
+}
+
+static inline void CountRead(unsigned long long bytes)
+{
+	if (g_bStats)
+		g_nBytesRead.fetch_add(bytes, memory_order_relaxed);
+}
+
+static inline void CountWritten(unsigned long long bytes)
+{
+	if (g_bStats)
+		g_nBytesWritten.fetch_add(bytes, memory_order_relaxed);
+}
+
+
+// ========================================================================
+//                            operator new
+//
+// replaces the global operator new to count the allocations for the
+// statistics report. The buffers allocated with malloc and realloc are
+// counted where they are allocated.
+// ========================================================================
+void *operator new(size_t size)
+{
+	CountAllocation();
+
+	void *p = malloc(size ? size : 1);
+	if (!p)
+		throw bad_alloc();
+	return p;
+}
+
+AV_NOINLINE void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+AV_NOINLINE void operator delete(void *p, size_t) noexcept
+{
+	free(p);
+}
+
+static thread_local string *t_pOutput = NULL;	// collects the console output of a task of CThreadPool
+
+
+#ifndef WIN32
+// ========================================================================
+//                            _getch
+//
+// reads a single key without echo, like _getch() of the Windows CRT
+// ========================================================================
+static int _getch()
+{
+	struct termios old_attr;
+	if (tcgetattr(STDIN_FILENO, &old_attr) != 0)
+		return getchar();
+
+	struct termios new_attr = old_attr;
+	new_attr.c_lflag &= ~(ICANON | ECHO);
+	tcsetattr(STDIN_FILENO, TCSANOW, &new_attr);
+
+	int c = getchar();
+
+	tcsetattr(STDIN_FILENO, TCSANOW, &old_attr);
+	return c;
+}
+#endif
+
 
 // ========================================================================
-//                            FindReplace
+//                            Print
 //
-// This seems to be non-optimal at the first glance, but it is recursion
-// safe, i.e. "a" can be safely replaced with "aa".
+// printf replacement for everything that may run on a worker thread.
+// Inside a CThreadPool task, the output is collected and printed later
+// in the order of the tasks.
 // ========================================================================
-string FindReplace(const string &source, const string &pattern, const string &replace)
+void Print(const char *format, ...)
 {
-	size_t j = 0;
-	string newstr;
+	va_list args;
+	va_start(args, format);
 
-	while (j + pattern.length() <= source.length())
+	if (!t_pOutput)
+		vprintf(format, args);
+	else
 	{
-		if (source.substr(j, pattern.length()) == pattern)
+		char buf[1024];
+		va_list copy;
+		va_copy(copy, args);
+		int len = vsnprintf(buf, sizeof(buf), format, copy);
+		va_end(copy);
+
+		if (len < (int)sizeof(buf))
+			t_pOutput->append(buf, len > 0 ? len : 0);
+		else
 		{
-			newstr += replace;
-			j += pattern.length();
+			vector<char> big(len + 1);
+			vsnprintf(big.data(), big.size(), format, args);
+			t_pOutput->append(big.data(), len);
 		}
-		else
-			newstr += source[j++];
 	}
 
-	return newstr;
+	va_end(args);
 }
 
 
 // ===============================================================================
-//										Backup
+//							CThreadPool::Run
+//
+// Every worker owns a queue with a contiguous block of task indices. It takes
+// tasks from the front of its own queue and, when that is empty, steals from
+// the back of the other queues.
 //
-// Creates .avbak rollback file
+// If a task throws, all tasks behind it are cancelled, but the tasks in front
+// of it are completed. So the outcome and the console output are the same as
+// when running the tasks one after another.
 // ===============================================================================
-void Backup(const string &file_name)
+void CThreadPool::Run(size_t count, const function<void(size_t)> &task)
 {
-	string new_name = file_name + ".avbak";
+	size_t threads = min((size_t)m_nThreads, count);
+	if (threads <= 1)
+	{
+		for (size_t i = 0; i < count; i++)
+			task(i);
+		return;
+	}
 
-	if (!CopyFile(file_name.c_str(), new_name.c_str(), FALSE))
-		throw CException("can not create rollback file " + new_name);
-}
+	struct SSlot
+	{
+		string			output;
+		exception_ptr	error;
+		bool			done = false;
+	};
 
+	vector<SSlot>				slots(count);
+	vector<deque<size_t>>		queues(threads);
+	unique_ptr<mutex[]>			queue_locks(new mutex[threads]);
+	atomic<size_t>				first_failed(count);
+	mutex						done_lock;
+	condition_variable			done_cond;
 
-// ===============================================================================
-//										CanRollback
-//
-// tests, if a rollback is possible, i.e. if an .avbak file exists for the
-// given file name
-// ===============================================================================
-bool CanRollback(const string &file_name)
-{
-	string bak = file_name + ".avbak";
+	for (size_t w = 0; w < threads; w++)
+	{
+		for (size_t i = w * count / threads; i < (w + 1) * count / threads; i++)
+			queues[w].push_back(i);
+	}
 
-	struct stat st;
-	if (stat(bak.c_str(), &st) != 0)
+	auto next_task = [&](size_t w, size_t &i)
+	{
+		for (size_t n = 0; n < threads; n++)
+		{
+			size_t victim = (w + n) % threads;
+			lock_guard<mutex> guard(queue_locks[victim]);
+			deque<size_t> &queue = queues[victim];
+			if (queue.empty())
+				continue;
+
+			if (n == 0)
+			{
+				i = queue.front();
+				queue.pop_front();
+			}
+			else
+			{
+				i = queue.back();
+				queue.pop_back();
+			}
+			return true;
+		}
 		return false;
-	
-	return true;
+	};
+
+	auto worker = [&](size_t w)
+	{
+		size_t i;
+		while (next_task(w, i))
+		{
+			if (i < first_failed)
+			{
+				t_pOutput = &slots[i].output;
+				try
+				{
+					task(i);
+				}
+				catch (...)
+				{
+					slots[i].error = current_exception();
+
+					size_t failed = first_failed;
+					while (i < failed && !first_failed.compare_exchange_weak(failed, i))
+						;
+				}
+				t_pOutput = NULL;
+			}
+
+			lock_guard<mutex> guard(done_lock);
+			slots[i].done = true;
+			done_cond.notify_all();
+		}
+	};
+
+	vector<thread> workers;
+	for (size_t w = 0; w < threads; w++)
+		workers.push_back(thread(worker, w));
+
+	// print the output in the order of the tasks, up to the first failed one
+	exception_ptr error;
+	for (size_t i = 0; i < count && !error; i++)
+	{
+		unique_lock<mutex> lock(done_lock);
+		done_cond.wait(lock, [&] { return slots[i].done; });
+		lock.unlock();
+
+		fputs(slots[i].output.c_str(), stdout);
+		error = slots[i].error;
+	}
+
+	for (auto &it : workers)
+		it.join();
+
+	if (error)
+		rethrow_exception(error);
 }
 
 
 // ===============================================================================
-//										Rollback
+//							CFileBuffer::Open
 //
-// performs a rollback
+// Regular files are mapped into memory, everything else (pipes, devices),
+// small files and files which can not be mapped are read into a malloc'd
+// buffer.
 // ===============================================================================
-void Rollback(const string &file_name)
+void CFileBuffer::Open(const string &file_name)
 {
-	string bak = file_name + ".avbak";
+	Close();
+	CountOpen();
 
-	if (g_bVerbose)
-		printf("rolling back %s\n", bak.c_str());
+	size_t initial = 65536;		// the first buffer size for the buffered read
+
+#ifdef WIN32
+	HANDLE file = CreateFileA(file_name.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file != INVALID_HANDLE_VALUE)
+	{
+		LARGE_INTEGER size;
+		if (GetFileType(file) == FILE_TYPE_DISK && GetFileSizeEx(file, &size))
+		{
+			if (size.QuadPart == 0)
+			{
+				CloseHandle(file);
+				return;
+			}
+
+			HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (mapping)
+			{
+				m_pData = (char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+				CloseHandle(mapping);		// the view keeps the mapping alive
+			}
+
+			if (m_pData)
+			{
+				m_nSize		= (size_t)size.QuadPart;
+				m_bMapped	= true;
+			}
+		}
+
+		CloseHandle(file);
+		if (m_bMapped)
+		{
+			CountRead(m_nSize);
+			return;
+		}
+	}
+
+	FILE *fh = fopen(file_name.c_str(), "rb");
+	if (!fh)
+		throw CException("reading file " + file_name + " failed!");
+#else
+	int fd = open(file_name.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw CException("reading file " + file_name + " failed!");
 
 	struct stat st;
-	if (stat(bak.c_str(), &st) != 0)
-		printf("ERROR: file %s does not exist! Rollback for this file not performed!\n", bak.c_str());
-	else
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
 	{
-		if (_unlink(file_name.c_str()) != 0)
-			printf("ERROR: can not delete file %s! Rollback for this file not performed!\n", file_name.c_str());
-		else
+		if (st.st_size == 0)
+		{
+			close(fd);
+			return;
+		}
+
+		// one more byte, so the end of the file is seen without growing the buffer
+		if (st.st_size <= SmallFileSize)
+			initial = st.st_size + 1;
+
+		void *data = st.st_size > SmallFileSize ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+		if (data != MAP_FAILED)
+		{
+			madvise(data, st.st_size, MADV_SEQUENTIAL);
+			m_pData		= (char *)data;
+			m_nSize		= st.st_size;
+			m_bMapped	= true;
+			close(fd);
+			CountRead(m_nSize);
+			return;
+		}
+	}
+#endif
+
+	// buffered read from the same descriptor (a pipe can not be opened twice),
+	// the size is not known in advance
+	size_t capacity = 0;
+	bool failed = false;
+	for (;;)
+	{
+		if (m_nSize == capacity)
+		{
+			capacity = capacity ? capacity * 2 : initial;
+			CountAllocation();
+			char *data = (char *)realloc(m_pData, capacity);
+			if (!data)
+			{
+				failed = true;
+				break;
+			}
+			m_pData = data;
+		}
+
+#ifdef WIN32
+		size_t len = fread(m_pData + m_nSize, 1, capacity - m_nSize, fh);
+		long long ret = ferror(fh) ? -1 : (long long)len;
+#else
+		long long ret = read(fd, m_pData + m_nSize, capacity - m_nSize);
+#endif
+		if (ret <= 0)
 		{
-			if (rename(bak.c_str(), file_name.c_str()) != 0)
-				printf("ERROR: can not rename file %s! Rollback for this file not performed!\n", bak.c_str());
+			failed = ret < 0;
+			break;
 		}
+		m_nSize += ret;
+	}
+
+#ifdef WIN32
+	fclose(fh);
+#else
+	close(fd);
+#endif
+	if (failed)
+		throw CException("reading file " + file_name + " failed!");
+
+	CountRead(m_nSize);
+}
+
+
+// ===============================================================================
+//							CFileBuffer::Close
+// ===============================================================================
+void CFileBuffer::Close()
+{
+	if (m_bMapped)
+	{
+#ifdef WIN32
+		UnmapViewOfFile(m_pData);
+#else
+		munmap(m_pData, m_nSize);
+#endif
 	}
+	else
+		free(m_pData);
+
+	m_pData		= NULL;
+	m_nSize		= 0;
+	m_bMapped	= false;
 }
 
 
 // ===============================================================================
-//							CReplace::CheckReplace
+//							CFileBuffer::Attach
+// ===============================================================================
+void CFileBuffer::Attach(char *data, size_t size)
+{
+	Close();
+	m_pData	= data;
+	m_nSize	= size;
+}
+
+
+// ===============================================================================
+//							CBatchReader::CBatchReader
 //
-// checks, if a replacement will occur
+// sets up the io_uring, if the kernel (and a seccomp filter) allows it
 // ===============================================================================
-bool CReplace::CheckReplace(const string &file_name, char *buf, size_t size)
+CBatchReader::CBatchReader()
 {
-	size_t pos = 0;
-	size_t what_len = m_strWhat.length();
+	m_nRing			= -1;
+	m_pSqRing		= NULL;
+	m_nSqRingSize	= 0;
+	m_pCqRing		= NULL;
+	m_nCqRingSize	= 0;
+	m_pSqes			= NULL;
+	m_nSqesSize		= 0;
+	m_pSqHead = m_pSqTail = m_pSqMask = m_pSqArray = NULL;
+	m_pCqHead = m_pCqTail = m_pCqMask = NULL;
+	m_pCqes			= NULL;
+
+#ifdef AV_IO_URING
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	int ring = (int)syscall(__NR_io_uring_setup, QueueDepth, &params);
+	if (ring < 0)
+		return;
 
-	while (pos + what_len <= size)
+	// the kernel must support the single mmap of both rings (5.4) and the
+	// asynchronous open, stat and close (5.6, announced by IORING_FEAT_NODROP)
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
 	{
-		if (strncmp(buf + pos, m_strWhat.c_str(), what_len) == 0)
-		{
-			if (m_strWhat == m_strWith)
-				return false;
+		close(ring);
+		return;
+	}
 
-			m_bMustReplace = true;
-			if (g_bVerbose)
-				printf("%s: found '%s' (to be replaced with '%s')\n", file_name.c_str(), m_strWhat.c_str(), m_strWith.c_str());
-			return true;
-		}
+	m_nSqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	m_nCqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	m_nSqRingSize = m_nCqRingSize = max(m_nSqRingSize, m_nCqRingSize);
 
-		pos++;
+	void *rings = mmap(NULL, m_nSqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+	if (rings == MAP_FAILED)
+	{
+		close(ring);
+		return;
 	}
 
-	// Der what-string MUSS gefunden werden, sonst stimmt etwas im Control File nicht
-	throw CException(file_name + ": the string '" + m_strWhat + "' was not found!");
+	m_nSqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	void *sqes = mmap(NULL, m_nSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+	{
+		munmap(rings, m_nSqRingSize);
+		close(ring);
+		return;
+	}
+
+	char *sq = (char *)rings;
+	m_pSqRing	= rings;
+	m_pCqRing	= rings;		// the same mapping, see IORING_FEAT_SINGLE_MMAP
+	m_pSqes		= sqes;
+	m_pSqHead	= (unsigned *)(sq + params.sq_off.head);
+	m_pSqTail	= (unsigned *)(sq + params.sq_off.tail);
+	m_pSqMask	= (unsigned *)(sq + params.sq_off.ring_mask);
+	m_pSqArray	= (unsigned *)(sq + params.sq_off.array);
+	m_pCqHead	= (unsigned *)(sq + params.cq_off.head);
+	m_pCqTail	= (unsigned *)(sq + params.cq_off.tail);
+	m_pCqMask	= (unsigned *)(sq + params.cq_off.ring_mask);
+	m_pCqes		= sq + params.cq_off.cqes;
+	m_nRing		= ring;
+#endif
 }
 
 
 // ===============================================================================
-//							CReplace::DoReplace
+//							CBatchReader::~CBatchReader
+// ===============================================================================
+CBatchReader::~CBatchReader()
+{
+#ifdef AV_IO_URING
+	if (m_nRing >= 0)
+	{
+		munmap(m_pSqes, m_nSqesSize);
+		munmap(m_pSqRing, m_nSqRingSize);
+		close(m_nRing);
+	}
+#endif
+}
+
+
+// ===============================================================================
+//							CBatchReader::Read
 //
-// performs a replacement for a file
+// Each file goes through the steps open, statx on the descriptor, read and
+// close. The requests of all files are submitted together, at most
+// QueueDepth of them in flight. If a step fails, e.g. the file is not a
+// regular file or too large, the file is left to the usual way of reading,
+// which also reports the errors.
 // ===============================================================================
-char *CReplace::DoReplace(char *buf, size_t &size)
+void CBatchReader::Read(vector<SFile> &files)
 {
-	if (m_bMustReplace)
+#ifdef AV_IO_URING
+	enum { enOpen, enStat, enRead, enClose };	// the step of a request, in the low bits of user_data
+
+	struct SState
 	{
-		m_bDidReplace = true;
+		int				m_nFd;
+		struct statx	m_Statx;
+		char			*m_pData;
+	};
 
-		size_t pos = 0;
-		size_t what_len = m_strWhat.length();
-		size_t with_len = m_strWith.length();
+	static const char empty_path[] = "";
 
-		while (pos + what_len <= size)
+	vector<SState> state(files.size());
+	deque<pair<size_t, int>> ready;		// the requests to submit: file, step
+	size_t next_file = 0;
+	size_t done = 0;
+	unsigned in_flight = 0;
+
+	for (auto &it : state)
+	{
+		it.m_nFd	= -1;
+		it.m_pData	= NULL;
+	}
+
+	struct io_uring_sqe *sqes = (struct io_uring_sqe *)m_pSqes;
+	struct io_uring_cqe *cqes = (struct io_uring_cqe *)m_pCqes;
+
+	while (done < files.size())
+	{
+		// fill the submission queue
+		unsigned tail = *m_pSqTail;
+		unsigned to_submit = 0;
+		while (in_flight < QueueDepth && (!ready.empty() || next_file < files.size()))
 		{
-			if (strncmp(buf + pos, m_strWhat.c_str(), what_len) == 0)
+			pair<size_t, int> request;
+			if (!ready.empty())
+			{
+				request = ready.front();
+				ready.pop_front();
+			}
+			else
+				request = make_pair(next_file++, (int)enOpen);
+
+			size_t i = request.first;
+			SState &st = state[i];
+			struct io_uring_sqe *sqe = &sqes[tail & *m_pSqMask];
+			memset(sqe, 0, sizeof(*sqe));
+
+			switch (request.second)
 			{
-				// found a replacement
-				if (g_bVerbose)
-					printf("replacing '%s' with '%s'\n", m_strWhat.c_str(), m_strWith.c_str());
+			case enOpen:
+				sqe->opcode		= IORING_OP_OPENAT;
+				sqe->fd			= AT_FDCWD;
+				sqe->addr		= (unsigned long long)(uintptr_t)files[i].m_strFileName.c_str();
+				sqe->open_flags	= O_RDONLY | O_CLOEXEC;
+				break;
 
-				size_t newsize = size - what_len + with_len;
-				char *newbuf = (char *)malloc(newsize);
-				if (!newbuf)
-					throw CException("out of memory");
+			case enStat:
+				sqe->opcode		= IORING_OP_STATX;
+				sqe->fd			= st.m_nFd;
+				sqe->addr		= (unsigned long long)(uintptr_t)empty_path;
+				sqe->len		= STATX_BASIC_STATS;
+				sqe->statx_flags = AT_EMPTY_PATH;
+				sqe->off		= (unsigned long long)(uintptr_t)&st.m_Statx;
+				break;
 
-				memcpy(newbuf, buf, pos);
-				memcpy(newbuf + pos, m_strWith.c_str(), with_len);
-				memcpy(newbuf + pos + with_len, buf + pos + what_len, size - pos - what_len);
+			case enRead:
+				sqe->opcode		= IORING_OP_READ;
+				sqe->fd			= st.m_nFd;
+				sqe->addr		= (unsigned long long)(uintptr_t)st.m_pData;
+				sqe->len		= (unsigned)st.m_Statx.stx_size;
+				sqe->off		= 0;
+				break;
 
-				free(buf);
-				buf = newbuf;
-				size = newsize;
-				pos += with_len;
+			case enClose:
+				sqe->opcode		= IORING_OP_CLOSE;
+				sqe->fd			= st.m_nFd;
+				break;
+			}
+
+			sqe->user_data = ((unsigned long long)i << 2) | (unsigned)request.second;
+			m_pSqArray[tail & *m_pSqMask] = tail & *m_pSqMask;
+			tail++;
+			to_submit++;
+			in_flight++;
+		}
+		__atomic_store_n(m_pSqTail, tail, __ATOMIC_RELEASE);
+
+		// submit and wait for at least one completion
+		for (;;)
+		{
+			long ret = syscall(__NR_io_uring_enter, m_nRing, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+			if (ret >= 0)
+				break;
+			if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+				throw CException("io_uring_enter failed: " + string(strerror(errno)));
+			to_submit = 0;
+			if (__atomic_load_n(m_pSqHead, __ATOMIC_ACQUIRE) != tail)
+				to_submit = tail - *m_pSqHead;
+		}
+
+		// process the completions
+		unsigned head = *m_pCqHead;
+		while (head != __atomic_load_n(m_pCqTail, __ATOMIC_ACQUIRE))
+		{
+			const struct io_uring_cqe *cqe = &cqes[head & *m_pCqMask];
+			size_t i = (size_t)(cqe->user_data >> 2);
+			int step = (int)(cqe->user_data & 3);
+			int res = cqe->res;
+			head++;
+			in_flight--;
+
+			SState &st = state[i];
+			SFile &file = files[i];
+
+			switch (step)
+			{
+			case enOpen:
+				if (res < 0)
+					done++;
+				else
+				{
+					CountOpen();
+					st.m_nFd = res;
+					ready.push_back(make_pair(i, (int)enStat));
+				}
+				break;
+
+			case enStat:
+				if (res == 0 && S_ISREG(st.m_Statx.stx_mode) && st.m_Statx.stx_size <= MaxFileSize)
+				{
+					struct stat &s = file.m_Stat;
+					memset(&s, 0, sizeof(s));
+					s.st_mode			= st.m_Statx.stx_mode;
+					s.st_size			= (off_t)st.m_Statx.stx_size;
+					s.st_ino			= st.m_Statx.stx_ino;
+					s.st_nlink			= st.m_Statx.stx_nlink;
+					s.st_uid			= st.m_Statx.stx_uid;
+					s.st_gid			= st.m_Statx.stx_gid;
+					s.st_dev			= makedev(st.m_Statx.stx_dev_major, st.m_Statx.stx_dev_minor);
+					s.st_atim.tv_sec	= st.m_Statx.stx_atime.tv_sec;
+					s.st_atim.tv_nsec	= st.m_Statx.stx_atime.tv_nsec;
+					s.st_mtim.tv_sec	= st.m_Statx.stx_mtime.tv_sec;
+					s.st_mtim.tv_nsec	= st.m_Statx.stx_mtime.tv_nsec;
+					s.st_ctim.tv_sec	= st.m_Statx.stx_ctime.tv_sec;
+					s.st_ctim.tv_nsec	= st.m_Statx.stx_ctime.tv_nsec;
+
+					if (st.m_Statx.stx_size > 0)
+					{
+						CountAllocation();
+						st.m_pData = (char *)malloc((size_t)st.m_Statx.stx_size);
+						if (st.m_pData)
+						{
+							ready.push_back(make_pair(i, (int)enRead));
+							break;
+						}
+					}
+					else
+						file.m_bRead = true;
+				}
+				ready.push_back(make_pair(i, (int)enClose));
+				break;
+
+			case enRead:
+				if (res >= 0 && (unsigned long long)res == st.m_Statx.stx_size)
+				{
+					CountRead(res);
+					file.m_pBuffer = make_shared<CFileBuffer>();
+					file.m_pBuffer->Attach(st.m_pData, res);
+					file.m_bRead = true;
+				}
+				else
+					free(st.m_pData);		// changed meanwhile, or failed
+				st.m_pData = NULL;
+				ready.push_back(make_pair(i, (int)enClose));
+				break;
+
+			case enClose:
+				if (file.m_bRead && !file.m_pBuffer)
+					file.m_pBuffer = make_shared<CFileBuffer>();	// empty file
+				done++;
+				break;
 			}
-			else
-				pos++;
 		}
+		__atomic_store_n(m_pCqHead, head, __ATOMIC_RELEASE);
+	}
+#else
+	(void)files;
+#endif
+}
+
+
+// ========================================================================
+//                            HashBuffer
+//
+// 64 bit FNV-1a hash, used to detect modified files. To hash data piece by
+// piece, the hash of the previous pieces is passed in "hash".
+// ========================================================================
+unsigned long long HashBuffer(const char *buf, size_t size, unsigned long long hash = 14695981039346656037ULL)
+{
+
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= (unsigned char)buf[i];
+		hash *= 1099511628211ULL;
 	}
 
-	return buf;
+	return hash;
+}
+
+
+// ========================================================================
+//                            FindPattern
+//
+// Substring search. The vectorized variants compare the first and the
+// last byte of the pattern at 16, 32 or 64 positions at once and only
+// compare the whole pattern, where both match. The variant is selected
+// once at startup by the features of the CPU.
+// ========================================================================
+typedef const char *(*FindPatternFunc)(const char *buf, size_t size, const char *pattern, size_t len);
+
+static const char *FindPatternScalar(const char *buf, size_t size, const char *pattern, size_t len)
+{
+	if (len == 0)
+		return buf;
+
+	const char *end = buf + size;
+	while ((size_t)(end - buf) >= len)
+	{
+		buf = (const char *)memchr(buf, pattern[0], end - buf - len + 1);
+		if (!buf)
+			return NULL;
+
+		if (memcmp(buf + 1, pattern + 1, len - 1) == 0)
+			return buf;
+		buf++;
+	}
+
+	return NULL;
+}
+
+#ifdef AV_X86
+static inline int CountTrailingZeros(unsigned long long mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	#ifdef _M_X64
+		_BitScanForward64(&index, mask);
+	#else
+		if (!_BitScanForward(&index, (unsigned long)mask))
+		{
+			_BitScanForward(&index, (unsigned long)(mask >> 32));
+			index += 32;
+		}
+	#endif
+	return (int)index;
+#else
+	return __builtin_ctzll(mask);
+#endif
+}
+
+// checks the candidates in "mask" (bit n set: candidate at pos + n), the first and the last byte match already
+static inline const char *VerifyCandidates(const char *pos, unsigned long long mask, const char *pattern, size_t len)
+{
+	while (mask)
+	{
+		const char *candidate = pos + CountTrailingZeros(mask);
+		if (memcmp(candidate + 1, pattern + 1, len - 2) == 0)
+			return candidate;
+		mask &= mask - 1;
+	}
+
+	return NULL;
+}
+
+AV_TARGET("sse2")
+static const char *FindPatternSSE2(const char *buf, size_t size, const char *pattern, size_t len)
+{
+	if (len < 2)
+		return FindPatternScalar(buf, size, pattern, len);
+
+	const __m128i first = _mm_set1_epi8(pattern[0]);
+	const __m128i last = _mm_set1_epi8(pattern[len - 1]);
+
+	size_t i = 0;
+	for (; i + len - 1 + 16 <= size; i += 16)
+	{
+		__m128i block_first = _mm_loadu_si128((const __m128i *)(buf + i));
+		__m128i block_last = _mm_loadu_si128((const __m128i *)(buf + i + len - 1));
+		unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+
+		const char *found = VerifyCandidates(buf + i, mask, pattern, len);
+		if (found)
+			return found;
+	}
+
+	return FindPatternScalar(buf + i, size - i, pattern, len);
+}
+
+AV_TARGET("avx2")
+static const char *FindPatternAVX2(const char *buf, size_t size, const char *pattern, size_t len)
+{
+	if (len < 2)
+		return FindPatternScalar(buf, size, pattern, len);
+
+	const __m256i first = _mm256_set1_epi8(pattern[0]);
+	const __m256i last = _mm256_set1_epi8(pattern[len - 1]);
+
+	size_t i = 0;
+	for (; i + len - 1 + 32 <= size; i += 32)
+	{
+		__m256i block_first = _mm256_loadu_si256((const __m256i *)(buf + i));
+		__m256i block_last = _mm256_loadu_si256((const __m256i *)(buf + i + len - 1));
+		unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last)));
+
+		const char *found = VerifyCandidates(buf + i, mask, pattern, len);
+		if (found)
+			return found;
+	}
+
+	return FindPatternScalar(buf + i, size - i, pattern, len);
+}
+
+AV_TARGET("avx512f,avx512bw")
+static const char *FindPatternAVX512(const char *buf, size_t size, const char *pattern, size_t len)
+{
+	if (len < 2)
+		return FindPatternScalar(buf, size, pattern, len);
+
+	const __m512i first = _mm512_set1_epi8(pattern[0]);
+	const __m512i last = _mm512_set1_epi8(pattern[len - 1]);
+
+	size_t i = 0;
+	for (; i + len - 1 + 64 <= size; i += 64)
+	{
+		__m512i block_first = _mm512_loadu_si512((const void *)(buf + i));
+		__m512i block_last = _mm512_loadu_si512((const void *)(buf + i + len - 1));
+		unsigned long long mask = _mm512_cmpeq_epi8_mask(block_first, first) & _mm512_cmpeq_epi8_mask(block_last, last);
+
+		const char *found = VerifyCandidates(buf + i, mask, pattern, len);
+		if (found)
+			return found;
+	}
+
+	return FindPatternScalar(buf + i, size - i, pattern, len);
+}
+
+static void CpuId(int leaf, unsigned regs[4])
+{
+#ifdef _MSC_VER
+	__cpuidex((int *)regs, leaf, 0);
+#else
+	__cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static unsigned long long GetXCR0()
+{
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	unsigned eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((unsigned long long)edx << 32) | eax;
+#endif
+}
+#endif	// AV_X86
+
+struct SFindPatternVariant
+{
+	const char		*m_pName;
+	FindPatternFunc	m_pFunc;
+};
+
+// the variants the CPU supports, the preferred one first
+static vector<SFindPatternVariant> GetFindPatternVariants()
+{
+	vector<SFindPatternVariant> variants;
+
+#ifdef AV_X86
+	unsigned regs[4];
+	CpuId(0, regs);
+	unsigned max_leaf = regs[0];
+
+	CpuId(1, regs);
+	bool sse2		= (regs[3] & (1 << 26)) != 0;
+	bool osxsave	= (regs[2] & (1 << 27)) != 0;
+	bool avx		= (regs[2] & (1 << 28)) != 0;
+
+	unsigned long long xcr0 = osxsave ? GetXCR0() : 0;
+	bool ymm_state = (xcr0 & 0x06) == 0x06;		// SSE and AVX state saved by the OS
+	bool zmm_state = (xcr0 & 0xe6) == 0xe6;		// ... and the AVX-512 state
+
+	unsigned ebx7 = 0;
+	if (max_leaf >= 7)
+	{
+		CpuId(7, regs);
+		ebx7 = regs[1];
+	}
+
+	if (avx && zmm_state && (ebx7 & (1 << 16)) && (ebx7 & (1u << 30)))
+		variants.push_back({ "avx512", FindPatternAVX512 });
+
+	if (avx && ymm_state && (ebx7 & (1 << 5)))
+		variants.push_back({ "avx2", FindPatternAVX2 });
+
+	if (sse2)
+		variants.push_back({ "sse2", FindPatternSSE2 });
+#endif
+
+	variants.push_back({ "scalar", FindPatternScalar });
+	return variants;
+}
+
+static const SFindPatternVariant g_FindPattern = GetFindPatternVariants().front();
+
+// returns a pointer to the first occurrence of pattern in buf, NULL if none
+const char *FindPattern(const char *buf, size_t size, const string &pattern)
+{
+	return g_FindPattern.m_pFunc(buf, size, pattern.c_str(), pattern.length());
+}
+
+const char *GetFindPatternName()
+{
+	return g_FindPattern.m_pName;
+}
+
+
+// ========================================================================
+//                            ForPrefixes
+//
+// "sorted" holds the indices of "strings" in the order of the strings.
+// Calls on_found(index) for each string which is a prefix of "text" or has
+// "text" as its prefix. Returns false, if more than "limit" strings have
+// "text" as their prefix; on_found is not called for these then.
+// ========================================================================
+template<class F>
+static bool ForPrefixes(const vector<const string *> &strings, const vector<int> &sorted, const char *text, size_t len, size_t limit, F on_found)
+{
+	// all strings in [lo, hi) start with the first n bytes of text, the ones
+	// which end there come first
+	size_t lo = 0;
+	size_t hi = sorted.size();
+	for (size_t n = 0; n < len && lo < hi; n++)
+	{
+		for (; lo < hi && strings[sorted[lo]]->length() == n; lo++)
+			on_found(sorted[lo]);
+
+		unsigned char c = (unsigned char)text[n];
+		auto byte = [&](int i) { return (unsigned char)(*strings[i])[n]; };
+		lo = partition_point(sorted.begin() + lo, sorted.begin() + hi, [&](int i) { return byte(i) < c; }) - sorted.begin();
+		hi = partition_point(sorted.begin() + lo, sorted.begin() + hi, [&](int i) { return byte(i) == c; }) - sorted.begin();
+	}
+
+	if (hi - lo > limit)
+		return false;
+
+	for (; lo < hi; lo++)
+		on_found(sorted[lo]);
+	return true;
+}
+
+
+// ========================================================================
+//                            CRuleOverlaps::Build
+//
+// "what" can match overlapping "with", if it starts at some byte of "with"
+// and one of them is a prefix of the other from there, or if "with" starts at
+// some byte of "what" after its first one, and one is a prefix of the other.
+// Both are found with ForPrefixes, for each suffix of the strings.
+// ========================================================================
+void CRuleOverlaps::Build(const vector<const string *> &what, const vector<const string *> &with)
+{
+	size_t count = what.size();
+	m_vecAllLater.assign(count, 0);
+	m_vecAllEarlier.assign(count, 0);
+
+	vector<int> sorted_what, sorted_with;
+	for (size_t i = 0; i < count; i++)
+	{
+		// an empty "with" overlaps any "what", an empty "what" any "with" of 2 bytes or more
+		if (with[i]->empty())
+			m_vecAllLater[i] = 1;
+		else
+			sorted_with.push_back((int)i);
+
+		if (what[i]->empty())
+			m_vecAllEarlier[i] = 1;
+		else
+			sorted_what.push_back((int)i);
+	}
+
+	sort(sorted_what.begin(), sorted_what.end(), [&](int a, int b) { return *what[a] < *what[b]; });
+	sort(sorted_with.begin(), sorted_with.end(), [&](int a, int b) { return *with[a] < *with[b]; });
+
+	vector<pair<int, int>> pairs;		// (rule, later rule)
+	for (auto i : sorted_with)
+	{
+		const string &w = *with[i];
+		for (size_t start = 0; start < w.length() && !m_vecAllLater[i]; start++)
+		{
+			if (!ForPrefixes(what, sorted_what, w.c_str() + start, w.length() - start, MaxListed, [&](int k)
+				{
+					if (k > i)
+						pairs.push_back(make_pair(i, k));
+				}))
+				m_vecAllLater[i] = 1;
+		}
+	}
+
+	for (auto k : sorted_what)
+	{
+		const string &p = *what[k];
+		for (size_t start = 1; start < p.length() && !m_vecAllEarlier[k]; start++)
+		{
+			if (!ForPrefixes(with, sorted_with, p.c_str() + start, p.length() - start, MaxListed, [&](int i)
+				{
+					if (i < k)
+						pairs.push_back(make_pair(i, k));
+				}))
+				m_vecAllEarlier[k] = 1;
+		}
+	}
+
+	sort(pairs.begin(), pairs.end());
+	pairs.erase(unique(pairs.begin(), pairs.end()), pairs.end());
+
+	m_vecFirst.assign(count + 1, 0);
+	m_vecLater.clear();
+	m_vecLater.reserve(pairs.size());
+	size_t next = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		m_vecFirst[i] = (int)m_vecLater.size();
+		for (; next < pairs.size() && pairs[next].first == (int)i; next++)
+			m_vecLater.push_back(pairs[next].second);
+	}
+	m_vecFirst[count] = (int)m_vecLater.size();
+}
+
+
+// ========================================================================
+//                            CRuleOverlaps::Overlap
+//
+// Thread safe, the table is built by the first call.
+// ========================================================================
+bool CRuleOverlaps::Overlap(const vector<const string *> &what, const vector<const string *> &with, const vector<char> &must)
+{
+	call_once(m_Built, [&] { Build(what, with); });
+
+	bool any_earlier = false;		// a rule with "must" set came before
+	bool all_later = false;			// it overlaps all later rules
+	for (size_t i = 0; i < must.size(); i++)
+	{
+		if (!must[i])
+			continue;
+
+		if (all_later || (any_earlier && m_vecAllEarlier[i]))
+			return true;
+
+		for (int n = m_vecFirst[i]; n < m_vecFirst[i + 1]; n++)
+		{
+			if (must[m_vecLater[n]])
+				return true;
+		}
+
+		any_earlier = true;
+		all_later = all_later || m_vecAllLater[i];
+	}
+
+	return false;
+}
+
+
+// ===============================================================================
+//										CommitFile
+//
+// Replaces a file by a temporary file. The attributes of the file are kept.
+// ===============================================================================
+void CommitFile(const string &tmp_name, const string &file_name)
+{
+#ifdef WIN32
+	if (!ReplaceFileA(file_name.c_str(), tmp_name.c_str(), NULL, REPLACEFILE_IGNORE_MERGE_ERRORS, NULL, NULL) &&
+		!MoveFileExA(tmp_name.c_str(), file_name.c_str(), MOVEFILE_REPLACE_EXISTING))
+#else
+	struct stat st;
+	if (stat(file_name.c_str(), &st) == 0)
+		chmod(tmp_name.c_str(), st.st_mode & 07777);
+
+	if (rename(tmp_name.c_str(), file_name.c_str()) != 0)
+#endif
+	{
+		_unlink(tmp_name.c_str());
+		throw CException("writing file " + file_name + " failed!");
+	}
+}
+
+
+// ===============================================================================
+//							CFileStream::Open
+// ===============================================================================
+void CFileStream::Open(const string &file_name)
+{
+	Discard();
+
+	m_strFileName	= file_name;
+	m_strTempName	= file_name + ".avtmp";
+	m_bFailed		= false;
+	m_nSize			= 0;
+	m_nHash			= HashBuffer(NULL, 0);
+
+	CountOpen();
+	m_pFile = fopen(m_strTempName.c_str(), "wb");
+	if (!m_pFile)
+		throw CException("fopen for writing file " + m_strTempName + " failed! " + strerror(errno));
+}
+
+
+// ===============================================================================
+//							CFileStream::Write
+// ===============================================================================
+void CFileStream::Write(const char *buf, size_t size)
+{
+	if (size == 0)
+		return;
+
+	if (!m_pFile || fwrite(buf, 1, size, m_pFile) != size)
+		m_bFailed = true;
+
+	m_nSize += size;
+	CountWritten(size);
+	m_nHash = HashBuffer(buf, size, m_nHash);
+}
+
+
+// ===============================================================================
+//							CFileStream::Commit
+// ===============================================================================
+void CFileStream::Commit()
+{
+	if (!m_pFile)
+		throw CException("writing file " + m_strFileName + " failed!");
+
+	bool failed = fclose(m_pFile) != 0 || m_bFailed;
+	m_pFile = NULL;
+	if (failed)
+	{
+		_unlink(m_strTempName.c_str());
+		throw CException("writing file " + m_strFileName + " failed!");
+	}
+
+	CommitFile(m_strTempName, m_strFileName);
+}
+
+
+// ===============================================================================
+//							CFileStream::Discard
+// ===============================================================================
+void CFileStream::Discard()
+{
+	if (m_pFile)
+	{
+		fclose(m_pFile);
+		m_pFile = NULL;
+		_unlink(m_strTempName.c_str());
+	}
+}
+
+
+// ===============================================================================
+//										WriteFileContents
+//
+// Replaces the contents of a file. The new contents are written to a temporary
+// file first, which then replaces the file, so the file is never left
+// half-written.
+// ===============================================================================
+void WriteFileContents(const string &file_name, const char *buf, size_t size)
+{
+	CFileStream out;
+	out.Open(file_name);
+	out.Write(buf, size);
+	out.Commit();
+}
+
+
+// ===============================================================================
+//										CreateParentDirectories
+//
+// creates the directory of "file_name" including all missing parents
+// ===============================================================================
+void CreateParentDirectories(const string &file_name)
+{
+	size_t pos = file_name.find_last_of("/\\");
+	if (pos == string::npos || pos == 0)
+		return;
+
+	string dir = file_name.substr(0, pos);
+
+	struct stat st;
+	if (stat(dir.c_str(), &st) == 0)
+		return;
+
+	CreateParentDirectories(dir);
+	if (_mkdir(dir.c_str()) != 0 && errno != EEXIST)
+		throw CException("creating directory " + dir + " failed! " + strerror(errno));
+}
+
+
+// ===============================================================================
+//										MatchWildcard
+//
+// matches a name against a pattern with * and ?, case insensitive on Windows
+// ===============================================================================
+static bool MatchWildcard(const char *pattern, const char *name)
+{
+	const char *star = NULL;	// behind the last * in the pattern
+	const char *retry = NULL;	// where the last * continues in the name
+
+	while (*name)
+	{
+#ifdef WIN32
+		bool same = tolower((unsigned char)*pattern) == tolower((unsigned char)*name);
+#else
+		bool same = *pattern == *name;
+#endif
+		if (*pattern == '*')
+		{
+			star = ++pattern;
+			retry = name;
+		}
+		else if (*pattern == '?' || same)
+		{
+			pattern++;
+			name++;
+		}
+		else if (star)
+		{
+			pattern = star;
+			name = ++retry;
+		}
+		else
+			return false;
+	}
+
+	while (*pattern == '*')
+		pattern++;
+
+	return *pattern == '\0';
+}
+
+
+// ===============================================================================
+//							CGlob::AddState
+//
+// adds a segment to the states of a directory, a ** segment also adds the
+// segment behind it, as it can match no directory at all
+// ===============================================================================
+void CGlob::AddState(vector<size_t> &states, size_t segment) const
+{
+	for (;;)
+	{
+		if (find(states.begin(), states.end(), segment) == states.end())
+			states.push_back(segment);
+
+		if (segment + 1 >= m_vecSegments.size() || m_vecSegments[segment] != "**")
+			break;
+		segment++;
+	}
+}
+
+
+// ===============================================================================
+//							CGlob::List
+//
+// Lists the directory "dir", which is open as "fd" (POSIX only, Windows works
+// with the path). The matching files are appended to "files", the
+// subdirectories which can contain matches to "subdirs". Symbolic links to
+// directories are not followed.
+// ===============================================================================
+void CGlob::List(const SDir &dir, int fd, vector<string> &files, vector<SDir> &subdirs) const
+{
+	// the entries of the directory: name, 'd' directory or 'f' file
+	vector<pair<string, char>> entries;
+
+#ifdef WIN32
+	WIN32_FIND_DATAA data;
+	HANDLE find = FindFirstFileExA((m_strBasePath + PATH_SEPARATOR + dir.m_strPath + "*").c_str(), FindExInfoBasic, &data,
+								   FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+	if (find == INVALID_HANDLE_VALUE)
+	{
+		Print("WARNING: can not read directory %s\n", (m_strBasePath + PATH_SEPARATOR + dir.m_strPath).c_str());
+		return;
+	}
+
+	do
+	{
+		if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		{
+			if (!(data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+				entries.push_back(make_pair(string(data.cFileName), 'd'));
+		}
+		else
+			entries.push_back(make_pair(string(data.cFileName), 'f'));
+	}
+	while (FindNextFileA(find, &data));
+
+	FindClose(find);
+#else
+	bool failed = false;
+
+#ifdef __linux__
+	// getdents64 reads the entries in large blocks, without the allocations of opendir
+	struct SDirent64
+	{
+		unsigned long long	d_ino;
+		long long			d_off;
+		unsigned short		d_reclen;
+		unsigned char		d_type;
+		char				d_name[1];
+	};
+
+	vector<char> buf(65536);
+	long len;
+	while ((len = syscall(SYS_getdents64, fd, buf.data(), buf.size())) > 0)
+	{
+		for (long pos = 0; pos < len; )
+		{
+			const SDirent64 *ent = (const SDirent64 *)(buf.data() + pos);
+			entries.push_back(make_pair(string(ent->d_name), (char)ent->d_type));
+			pos += ent->d_reclen;
+		}
+	}
+	failed = len < 0;
+#else
+	// readdir closes the descriptor, which is still needed for the subdirectories
+	int dup_fd = dup(fd);
+	DIR *d = dup_fd >= 0 ? fdopendir(dup_fd) : NULL;
+	if (d)
+	{
+		struct dirent *ent;
+		while ((ent = readdir(d)) != NULL)
+			entries.push_back(make_pair(string(ent->d_name), (char)ent->d_type));
+		closedir(d);
+	}
+	else
+	{
+		if (dup_fd >= 0)
+			close(dup_fd);
+		failed = true;
+	}
+#endif
+
+	if (failed)
+	{
+		Print("WARNING: can not read directory %s\n", (m_strBasePath + PATH_SEPARATOR + dir.m_strPath).c_str());
+		return;
+	}
+
+	for (auto &it : entries)
+	{
+		unsigned char type = (unsigned char)it.second;
+		struct stat st;
+
+		if (type == DT_UNKNOWN && fstatat(fd, it.first.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0)
+			type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+
+		// links to files are followed, links to directories not
+		if (type == DT_LNK && fstatat(fd, it.first.c_str(), &st, 0) == 0 && S_ISREG(st.st_mode))
+			type = DT_REG;
+
+		it.second = type == DT_DIR ? 'd' : type == DT_REG ? 'f' : '\0';
+	}
+#endif
+
+	size_t last = m_vecSegments.size() - 1;
+	for (auto &it : entries)
+	{
+		const string &name = it.first;
+		if (name == "." || name == ".." || !it.second)
+			continue;
+
+		if (it.second == 'f')
+		{
+			for (auto state : dir.m_vecStates)
+			{
+				const string &segment = m_vecSegments[state];
+				if (state == last && (name[0] != '.' || segment[0] == '.') && (segment == "**" || MatchWildcard(segment.c_str(), name.c_str())))
+				{
+					files.push_back(dir.m_strPath + name);
+					break;
+				}
+			}
+			continue;
+		}
+
+		SDir sub;
+		for (auto state : dir.m_vecStates)
+		{
+			const string &segment = m_vecSegments[state];
+			if (name[0] == '.' && segment[0] != '.')
+				continue;
+
+			if (segment == "**")
+				AddState(sub.m_vecStates, state);
+			else if (state < last && MatchWildcard(segment.c_str(), name.c_str()))
+				AddState(sub.m_vecStates, state + 1);
+		}
+
+		if (!sub.m_vecStates.empty())
+		{
+			sub.m_strPath = dir.m_strPath + name + PATH_SEPARATOR;
+			sub.m_strName = name;
+			subdirs.push_back(std::move(sub));
+		}
+	}
+}
+
+
+// ===============================================================================
+//							CGlob::Walk
+//
+// walks the tree below "dir" depth first, the directories are opened relative
+// to their parent
+// ===============================================================================
+void CGlob::Walk(const SDir &dir, int fd, vector<string> &files, vector<string> *dirs) const
+{
+	if (dirs)
+		dirs->push_back(dir.m_strPath);
+
+	vector<SDir> subdirs;
+	List(dir, fd, files, subdirs);
+
+	for (auto &it : subdirs)
+	{
+#ifdef WIN32
+		Walk(it, -1, files, dirs);
+#else
+		int sub_fd = openat(fd, it.m_strName.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (sub_fd < 0)
+		{
+			Print("WARNING: can not read directory %s\n", (m_strBasePath + PATH_SEPARATOR + it.m_strPath).c_str());
+			continue;
+		}
+
+		Walk(it, sub_fd, files, dirs);
+		close(sub_fd);
+#endif
+	}
+}
+
+
+// ===============================================================================
+//							CGlob::Expand
+//
+// Returns the files below "base_path" matching "pattern" in "files", relative
+// to "base_path" and sorted. The first levels of the tree are listed level
+// by level, a level in parallel, until there are enough directories to keep
+// the threads busy. Then each of them is walked by a single task.
+// ===============================================================================
+void CGlob::Expand(const string &base_path, const string &pattern, int threads, vector<string> &files, vector<string> *dirs)
+{
+	m_strBasePath = base_path;
+	m_vecSegments.clear();
+
+	size_t start = 0;
+	for (;;)
+	{
+		size_t end = pattern.find_first_of("/\\", start);
+		string segment = pattern.substr(start, end == string::npos ? string::npos : end - start);
+		if (!segment.empty() && segment != ".")
+			m_vecSegments.push_back(segment);
+		if (end == string::npos)
+			break;
+		start = end + 1;
+	}
+
+	files.clear();
+	if (m_vecSegments.empty())
+		return;
+
+	// the leading segments without wildcards are the root of the walk
+	SDir root;
+	size_t first = 0;
+	while (first + 1 < m_vecSegments.size() && !IsPattern(m_vecSegments[first]) && m_vecSegments[first] != "**")
+	{
+		root.m_strPath += m_vecSegments[first] + PATH_SEPARATOR;
+		first++;
+	}
+	AddState(root.m_vecStates, first);
+
+	auto open_dir = [&](const SDir &dir)
+	{
+#ifdef WIN32
+		return 0;
+#else
+		int fd = open((m_strBasePath + PATH_SEPARATOR + dir.m_strPath).c_str(), O_RDONLY | O_DIRECTORY);
+		if (fd < 0)
+			Print("WARNING: can not read directory %s\n", (m_strBasePath + PATH_SEPARATOR + dir.m_strPath).c_str());
+		return fd;
+#endif
+	};
+
+	auto close_dir = [](int fd)
+	{
+#ifndef WIN32
+		close(fd);
+#endif
+	};
+
+	CThreadPool pool(threads);
+	vector<SDir> level(1, root);
+	while (!level.empty() && level.size() < 16 * (size_t)threads)
+	{
+		vector<vector<string>> level_files(level.size());
+		vector<vector<SDir>> level_subdirs(level.size());
+
+		pool.Run(level.size(), [&](size_t i)
+		{
+			int fd = open_dir(level[i]);
+			if (fd >= 0)
+			{
+				List(level[i], fd, level_files[i], level_subdirs[i]);
+				close_dir(fd);
+			}
+		});
+
+		vector<SDir> next;
+		for (size_t i = 0; i < level.size(); i++)
+		{
+			if (dirs)
+				dirs->push_back(level[i].m_strPath);
+			files.insert(files.end(), level_files[i].begin(), level_files[i].end());
+			for (auto &it : level_subdirs[i])
+				next.push_back(std::move(it));
+		}
+		level.swap(next);
+	}
+
+	vector<vector<string>> tree_files(level.size());
+	vector<vector<string>> tree_dirs(dirs ? level.size() : 0);
+	pool.Run(level.size(), [&](size_t i)
+	{
+		int fd = open_dir(level[i]);
+		if (fd >= 0)
+		{
+			Walk(level[i], fd, tree_files[i], dirs ? &tree_dirs[i] : NULL);
+			close_dir(fd);
+		}
+	});
+
+	for (auto &it : tree_files)
+		files.insert(files.end(), it.begin(), it.end());
+	for (auto &it : tree_dirs)
+		dirs->insert(dirs->end(), it.begin(), it.end());
+
+	sort(files.begin(), files.end());
+}
+
+
+// ===============================================================================
+//										StreamFile
+//
+// Passes the contents of a file to "stream" in pieces of "window" bytes, if
+// "stream" is not NULL. Returns the hash of the contents, their size in "size".
+// ===============================================================================
+unsigned long long StreamFile(const string &file_name, size_t window, CStream *stream, size_t &size)
+{
+	CountOpen();
+	FILE *fh = fopen(file_name.c_str(), "rb");
+	if (!fh)
+		throw CException("can not open file " + file_name);
+
+	vector<char> buf(window);
+	unsigned long long hash = HashBuffer(NULL, 0);
+	size = 0;
+
+	size_t len;
+	while ((len = fread(buf.data(), 1, window, fh)) > 0)
+	{
+		CountRead(len);
+		hash = HashBuffer(buf.data(), len, hash);
+		size += len;
+		if (stream)
+			stream->Write(buf.data(), len);
+	}
+
+	bool failed = ferror(fh) != 0;
+	fclose(fh);
+	if (failed)
+		throw CException("reading file " + file_name + " failed!");
+
+	return hash;
+}
+
+
+// ===============================================================================
+//							CUndoStream::Write
+// ===============================================================================
+void CUndoStream::Write(const char *buf, size_t size)
+{
+	size_t spans = m_Pass.m_vecOffset.size();
+
+	while (size > 0)
+	{
+		if (m_nSpan < spans && m_nPos >= m_Pass.m_vecOffset[m_nSpan])
+		{
+			// within a span: the new bytes are dropped
+			size_t span_end = m_Pass.m_vecOffset[m_nSpan] + m_Pass.m_vecNewLength[m_nSpan];
+			if (m_nPos > span_end)
+			{
+				m_bFailed = true;
+				return;
+			}
+
+			size_t len = min(size, span_end - m_nPos);
+			buf		+= len;
+			size	-= len;
+			m_nPos	+= len;
+
+			if (m_nPos == span_end)
+				EndSpan();
+		}
+		else
+		{
+			size_t len = size;
+			if (m_nSpan < spans)
+				len = min(len, m_Pass.m_vecOffset[m_nSpan] - m_nPos);
+
+			m_Next.Write(buf, len);
+			buf		+= len;
+			size	-= len;
+			m_nPos	+= len;
+		}
+	}
+}
+
+
+// ===============================================================================
+//							CUndoStream::EndSpan
+//
+// the new bytes of the current span are dropped, the old ones are passed on
+// ===============================================================================
+void CUndoStream::EndSpan()
+{
+	size_t old_len = m_Pass.m_vecOldLength[m_nSpan];
+	if (m_nOld + old_len > m_Pass.m_strOld.length())
+	{
+		m_bFailed = true;
+		m_nSpan = m_Pass.m_vecOffset.size();
+		return;
+	}
+
+	m_Next.Write(m_Pass.m_strOld.c_str() + m_nOld, old_len);
+	m_nOld += old_len;
+	m_nSpan++;
+}
+
+
+// ===============================================================================
+//							CUndoStream::Finish
+// ===============================================================================
+void CUndoStream::Finish()
+{
+	// spans which were empty in the output of the pass, at its end
+	while (m_nSpan < m_Pass.m_vecOffset.size() && m_Pass.m_vecOffset[m_nSpan] == m_nPos && m_Pass.m_vecNewLength[m_nSpan] == 0)
+		EndSpan();
+
+	if (m_nSpan < m_Pass.m_vecOffset.size())
+		m_bFailed = true;
+
+	m_Next.Finish();
+}
+
+
+// ===============================================================================
+//							CPatchStream::Open
+// ===============================================================================
+void CPatchStream::Open(const string &file_name)
+{
+	CountOpen();
+	m_pFile = fopen(file_name.c_str(), "rb");
+	if (!m_pFile)
+		throw CException("can not open file " + file_name);
+
+	m_nHash = HashBuffer(NULL, 0);
+}
+
+
+// ===============================================================================
+//							CPatchStream::Write
+// ===============================================================================
+void CPatchStream::Write(const char *buf, size_t size)
+{
+	if (size == 0 || m_bFailed)
+		return;
+
+	m_nHash = HashBuffer(buf, size, m_nHash);
+
+	if (m_vecOld.size() < size)
+		m_vecOld.resize(size);
+
+	const char *old = m_vecOld.data();
+	if (!m_pFile || fread(m_vecOld.data(), 1, size, m_pFile) != size)
+	{
+		m_bFailed = true;
+		return;
+	}
+	CountRead(size);
+
+	// equal blocks are skipped with memcmp
+	const size_t block = 4096;
+	size_t i = 0;
+	while (i < size)
+	{
+		size_t len = min(block, size - i);
+		if (memcmp(buf + i, old + i, len) == 0)
+		{
+			i += len;
+			continue;
+		}
+
+		for (size_t end = i + len; i < end; )
+		{
+			if (buf[i] == old[i])
+			{
+				i++;
+				continue;
+			}
+
+			size_t start = i;
+			while (i < end && buf[i] != old[i])
+				i++;
+
+			AddSpan(m_nPos + start, old + start, buf + start, i - start);
+		}
+	}
+
+	m_nPos += size;
+}
+
+
+// ===============================================================================
+//							CPatchStream::AddSpan
+//
+// adds a changed span, a span adjacent to the last one is merged with it
+// ===============================================================================
+void CPatchStream::AddSpan(size_t offset, const char *old, const char *data, size_t len)
+{
+	size_t spans = m_Pass.m_vecOffset.size();
+	if (spans > 0 && m_Pass.m_vecOffset[spans - 1] + m_Pass.m_vecNewLength[spans - 1] == offset)
+	{
+		m_Pass.m_vecNewLength[spans - 1] += len;
+		m_Pass.m_vecOldLength[spans - 1] += len;
+		m_Pass.m_strOld.append(old, len);
+	}
+	else
+		m_Pass.Add(offset, len, old, len);
+
+	m_strNew.append(data, len);
+}
+
+
+// ===============================================================================
+//							CPatchStream::Finish
+// ===============================================================================
+void CPatchStream::Finish()
+{
+	// the old contents must not be longer than the new ones
+	if (!m_pFile || fgetc(m_pFile) != EOF)
+		m_bFailed = true;
+}
+
+
+// ===============================================================================
+//										PatchFile
+//
+// Writes the spans of "pass" into a file in place. "data" holds the bytes of
+// all spans, concatenated.
+// ===============================================================================
+void PatchFile(const string &file_name, const CEditPass &pass, const string &data)
+{
+	CountOpen();
+#ifdef WIN32
+	HANDLE file = CreateFileA(file_name.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		throw CException("fopen for writing file " + file_name + " failed!");
+#else
+	int fd = open(file_name.c_str(), O_WRONLY);
+	if (fd < 0)
+		throw CException("fopen for writing file " + file_name + " failed! " + strerror(errno));
+#endif
+
+	const char *p = data.c_str();
+	bool failed = false;
+	for (size_t i = 0; i < pass.m_vecOffset.size() && !failed; i++)
+	{
+		unsigned long long offset = pass.m_vecOffset[i];
+		size_t len = pass.m_vecNewLength[i];
+
+		while (len > 0)
+		{
+#ifdef WIN32
+			OVERLAPPED ov = {};
+			ov.Offset		= (DWORD)offset;
+			ov.OffsetHigh	= (DWORD)(offset >> 32);
+
+			DWORD written = 0;
+			if (!WriteFile(file, p, (DWORD)min(len, (size_t)0x40000000), &written, &ov) || written == 0)
+#else
+			ssize_t written = pwrite(fd, p, len, (off_t)offset);
+			if (written <= 0)
+#endif
+			{
+				failed = true;
+				break;
+			}
+
+			CountWritten(written);
+			p		+= written;
+			offset	+= written;
+			len		-= written;
+		}
+	}
+
+#ifdef WIN32
+	failed = !CloseHandle(file) || failed;
+#else
+	failed = close(fd) != 0 || failed;
+#endif
+
+	if (failed)
+		throw CException("writing file " + file_name + " failed!");
+}
+
+
+// ===============================================================================
+//										SpanMatches
+//
+// true, if the file contains "data" at "offset"
+// ===============================================================================
+bool SpanMatches(FILE *fh, size_t offset, const char *data, size_t len)
+{
+	vector<char> buf(len);
+	CountRead(len);
+	return fseek64(fh, offset, SEEK_SET) == 0 && fread(buf.data(), 1, len, fh) == len && memcmp(buf.data(), data, len) == 0;
+}
+
+
+#ifndef WIN32
+// ===============================================================================
+//										SplitCommand
+//
+// Splits a %shell command into its words. Returns false if the command uses
+// anything the shell has to interpret: operators, quotes, expansions, comments
+// or an assignment in front of the program. "words" is empty in that case.
+// ===============================================================================
+static bool SplitCommand(const string &cmd, vector<string> &words)
+{
+	if (cmd.find_first_of("|&;<>()$`\\\"'*?[]{}~#!\012\015") != string::npos)
+		return false;
+
+	istringstream in(cmd);
+	string word;
+	while (in >> word)
+		words.push_back(word);
+
+	if (words.empty() || words[0].find('=') != string::npos)
+	{
+		words.clear();
+		return false;
+	}
+	return true;
+}
+
+
+// ===============================================================================
+//										SpawnProcess
+//
+// starts a program and waits until it has finished. If "output" is set, the
+// stdout and stderr of the program are collected there. Returns the status
+// of waitpid, or -1 with errno set if the program could not be started.
+// ===============================================================================
+static int SpawnProcess(const vector<string> &words, bool search_path, string *output)
+{
+	vector<char *> argv;
+	for (auto &it : words)
+		argv.push_back(const_cast<char *>(it.c_str()));
+	argv.push_back(NULL);
+
+	// the pipe must not be inherited by the commands running concurrently
+	int fds[2] = { -1, -1 };
+#ifdef __linux__
+	if (output && pipe2(fds, O_CLOEXEC) != 0)
+		return -1;
+#else
+	// without pipe2, no other command may be started before FD_CLOEXEC is set
+	static mutex spawn_lock;
+	unique_lock<mutex> guard(spawn_lock);
+	if (output && (pipe(fds) != 0 || fcntl(fds[0], F_SETFD, FD_CLOEXEC) != 0 || fcntl(fds[1], F_SETFD, FD_CLOEXEC) != 0))
+		return -1;
+#endif
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	if (output)
+	{
+		posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+		posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO);
+	}
+
+	pid_t pid;
+	int err = search_path ? posix_spawnp(&pid, argv[0], &actions, NULL, argv.data(), environ) :
+		posix_spawn(&pid, argv[0], &actions, NULL, argv.data(), environ);
+	posix_spawn_file_actions_destroy(&actions);
+#ifndef __linux__
+	guard.unlock();
+#endif
+
+	if (output)
+	{
+		close(fds[1]);
+		if (err == 0)
+		{
+			char buf[4096];
+			ssize_t len;
+			while ((len = read(fds[0], buf, sizeof(buf))) != 0)
+			{
+				if (len > 0)
+					output->append(buf, len);
+				else if (errno != EINTR)
+					break;
+			}
+		}
+		close(fds[0]);
+	}
+
+	if (err != 0)
+	{
+		errno = err;
+		return -1;
+	}
+
+	int status;
+	while (waitpid(pid, &status, 0) < 0)
+	{
+		if (errno != EINTR)
+			return -1;
+	}
+	return status;
+}
+#endif
+
+
+// ===============================================================================
+//							CCommandShell::Execute
+//
+// Inside a CThreadPool task, the output of the command is collected and
+// printed later, like the output of Print. Returns false, if the command
+// failed.
+// ===============================================================================
+bool CCommandShell::Execute()
+{
+	const string &cmd = m_listArgs.front();
+
+	if (g_bVerbose)
+		Print("shell: %s\n", cmd.c_str());
+
+#ifdef WIN32
+	// the output of the commands is not collected here
+	int ret = system(cmd.c_str());
+	return ret == 0;
+#else
+	// the output printed so far must appear before the output of the command
+	if (!t_pOutput)
+		fflush(stdout);
+
+	// a program which is not found may be a builtin of the shell, a file
+	// which can not be executed may be a script without #! line
+	vector<string> words;
+	bool use_shell = !SplitCommand(cmd, words);
+	int status = -1;
+	if (!use_shell)
+	{
+		status = SpawnProcess(words, true, t_pOutput);
+		use_shell = status == -1 && (errno == ENOENT || errno == ENOEXEC);
+	}
+
+	if (use_shell)
+	{
+		words = { "/bin/sh", "-c", cmd };
+		status = SpawnProcess(words, false, t_pOutput);
+	}
+
+	if (status == -1)
+		Print("can not start %s: %s\n", words[0].c_str(), strerror(errno));
+
+	return status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#endif
+}
+
+
+// ===============================================================================
+//							Journal serialization
+//
+// All numbers are stored as 64 bit little endian, strings with their length
+// in front.
+// ===============================================================================
+static void PutNumber(string &out, unsigned long long val)
+{
+	for (int i = 0; i < 8; i++)
+		out += (char)(val >> (i * 8));
+}
+
+static void PutString(string &out, const string &s)
+{
+	PutNumber(out, s.length());
+	out += s;
+}
+
+static bool GetNumber(const char *&p, const char *end, unsigned long long &val)
+{
+	if (end - p < 8)
+		return false;
+
+	val = 0;
+	for (int i = 0; i < 8; i++)
+		val |= (unsigned long long)(unsigned char)p[i] << (i * 8);
+	p += 8;
+	return true;
+}
+
+static bool GetNumber(const char *&p, const char *end, size_t &val)
+{
+	unsigned long long v;
+	if (!GetNumber(p, end, v))
+		return false;
+
+	val = (size_t)v;
+	return true;
+}
+
+static bool GetString(const char *&p, const char *end, string &s)
+{
+	size_t len;
+	if (!GetNumber(p, end, len) || (size_t)(end - p) < len)
+		return false;
+
+	s.assign(p, len);
+	p += len;
+	return true;
+}
+
+static const char JournalMagic[] = "AVJOURNAL1\n";
+static const char PlanMagic[] = "AVPLAN1\n";
+
+enum EJournalRecord
+{
+	enJrCommands	= 'C',		// the delayed commands of the run
+	enJrGroups		= 'G',		// the %group blocks of the delayed commands, if there are any
+	enJrFile		= 'F',		// a CJournalEntry
+	enJrPatch		= 'P',		// a CJournalEntry of a file patched in place
+	enJrMessages	= 'M',		// plan: the messages of the Control File
+	enJrPlanned		= 'N',		// plan: a CJournalEntry with the new bytes
+	enJrEnd			= 'E',		// plan: the number of entries, the last record
+};
+
+
+// ===============================================================================
+//							CJournal::Create
+//
+// creates the journal for a run, "commands" are the delayed commands, which are
+// executed again after a rollback
+// ===============================================================================
+void CJournal::Create(const string &file_name, const list<CCommandShell> &commands)
+{
+	if (Exists(file_name))
+		throw CException("the journal " + file_name + " already exists. Please perform a clean or a rollback first.");
+
+	Open(file_name, JournalMagic, sizeof(JournalMagic) - 1, commands);
+}
+
+
+// ===============================================================================
+//							CJournal::CreatePlan
+//
+// creates a plan, an existing one is replaced
+// ===============================================================================
+void CJournal::CreatePlan(const string &file_name, const list<CCommandShell> &commands, const list<string> &messages)
+{
+	m_bPlan = true;
+	Open(file_name, PlanMagic, sizeof(PlanMagic) - 1, commands);
+
+	string record;
+	PutNumber(record, messages.size());
+	for (auto &it : messages)
+		PutString(record, it);
+	Write(enJrMessages, record);
+}
+
+
+// ===============================================================================
+//							CJournal::Open
+//
+// creates the file and writes the magic and the delayed commands
+// ===============================================================================
+void CJournal::Open(const string &file_name, const char *magic, size_t magic_len, const list<CCommandShell> &commands)
+{
+	m_strFileName = file_name;
+	m_nEntries = 0;
+	CountOpen();
+	m_pFile = fopen(file_name.c_str(), "wb");
+	if (!m_pFile)
+		throw CException("can not create " + string(m_bPlan ? "plan " : "journal ") + file_name);
+
+	string record;
+	PutNumber(record, commands.size());
+	for (auto &it : commands)
+	{
+		PutNumber(record, it.GetArgs().size());
+		for (auto &arg : it.GetArgs())
+			PutString(record, arg);
+	}
+
+	if (fwrite(magic, 1, magic_len, m_pFile) != magic_len)
+		throw CException("writing " + file_name + " failed!");
+
+	Write(enJrCommands, record);
+
+	// a separate record, so the journals of older versions can be read as well
+	bool grouped = false;
+	record.clear();
+	PutNumber(record, commands.size());
+	for (auto &it : commands)
+	{
+		PutNumber(record, it.m_nGroup);
+		PutNumber(record, it.m_nParallel);
+		grouped |= it.m_nGroup != 0;
+	}
+
+	if (grouped)
+		Write(enJrGroups, record);
+}
+
+
+// ===============================================================================
+//							CJournal::Append
+//
+// Appends an entry. This must be done before the file is written. Thread safe.
+// ===============================================================================
+void CJournal::Append(const CJournalEntry &entry)
+{
+	string record;
+	PutString(record, entry.m_strFileName);
+	PutNumber(record, entry.m_nOldSize);
+	PutNumber(record, entry.m_nOldHash);
+	PutNumber(record, entry.m_nNewSize);
+	PutNumber(record, entry.m_nNewHash);
+
+	PutNumber(record, entry.m_vecPasses.size());
+	for (auto &pass : entry.m_vecPasses)
+	{
+		PutNumber(record, pass.m_vecOffset.size());
+		for (size_t i = 0; i < pass.m_vecOffset.size(); i++)
+		{
+			PutNumber(record, pass.m_vecOffset[i]);
+			PutNumber(record, pass.m_vecNewLength[i]);
+			PutNumber(record, pass.m_vecOldLength[i]);
+		}
+		PutString(record, pass.m_strOld);
+	}
+
+	if (entry.m_bInPlace || m_bPlan)
+		PutString(record, entry.m_strNew);
+
+	lock_guard<mutex> guard(m_Lock);
+	Write(m_bPlan ? enJrPlanned : entry.m_bInPlace ? enJrPatch : enJrFile, record);
+	m_nEntries++;
+}
+
+
+// ===============================================================================
+//							CJournal::EndPlan
+//
+// writes the end record of a plan, after all entries
+// ===============================================================================
+void CJournal::EndPlan()
+{
+	string record;
+	PutNumber(record, m_nEntries);
+	Write(enJrEnd, record);
+}
+
+
+// ===============================================================================
+//							CJournal::Write
+//
+// writes a record: type, length, contents, hash of the contents. A record
+// which was not written completely is ignored by Load.
+// ===============================================================================
+void CJournal::Write(char type, const string &record)
+{
+	string header(1, type);
+	PutNumber(header, record.length());
+
+	string trailer;
+	PutNumber(trailer, HashBuffer(record.c_str(), record.length()));
+
+	if (!m_pFile ||
+		fwrite(header.c_str(), 1, header.length(), m_pFile) != header.length() ||
+		fwrite(record.c_str(), 1, record.length(), m_pFile) != record.length() ||
+		fwrite(trailer.c_str(), 1, trailer.length(), m_pFile) != trailer.length() ||
+		fflush(m_pFile) != 0)
+		throw CException("writing " + m_strFileName + " failed!");
+
+	CountWritten(header.length() + record.length() + trailer.length());
+}
+
+
+// ===============================================================================
+//							CJournal::Close
+// ===============================================================================
+void CJournal::Close()
+{
+	if (m_pFile)
+		fclose(m_pFile);
+	m_pFile = NULL;
+}
+
+
+// ===============================================================================
+//							CJournal::Exists
+// ===============================================================================
+bool CJournal::Exists(const string &file_name)
+{
+	struct stat st;
+	return stat(file_name.c_str(), &st) == 0;
+}
+
+
+// ===============================================================================
+//							CJournal::Load
+//
+// reads all complete records of a journal. A plan must be complete, the
+// messages are only kept in a plan.
+// ===============================================================================
+void CJournal::Load(const string &file_name, bool plan, list<CCommandShell> &commands, list<string> *messages, vector<CJournalEntry> &entries)
+{
+	CFileBuffer file;
+	file.Open(file_name);
+
+	const char *p = file.GetData();
+	const char *end = p + file.GetSize();
+
+	// the program may have been aborted, before the header was written completely
+	const char *magic = plan ? PlanMagic : JournalMagic;
+	size_t magic_len = plan ? sizeof(PlanMagic) - 1 : min(file.GetSize(), sizeof(JournalMagic) - 1);
+	if (file.GetSize() < magic_len || memcmp(p, magic, magic_len) != 0)
+		throw CException(file_name + " is not a " + (plan ? "plan" : "journal") + " of autoversion!");
+	p += magic_len;
+
+	bool complete = false;
+
+	while (end - p > 9)
+	{
+		char type = *p++;
+		size_t len = 0;
+		GetNumber(p, end, len);
+		if ((size_t)(end - p) < 8 || len > (size_t)(end - p) - 8)
+			break;		// incomplete record
+
+		const char *rec = p;
+		const char *rec_end = p + len;
+		p = rec_end;
+
+		unsigned long long hash = 0;
+		GetNumber(p, end, hash);
+		if (hash != HashBuffer(rec, len))
+			break;		// incomplete record
+
+		bool ok = true;
+		if (type == enJrCommands)
+		{
+			size_t count;
+			ok = GetNumber(rec, rec_end, count);
+			for (size_t i = 0; ok && i < count; i++)
+			{
+				CCommandShell cmd;
+				size_t args;
+				ok = GetNumber(rec, rec_end, args);
+				for (size_t k = 0; ok && k < args; k++)
+				{
+					string arg;
+					ok = GetString(rec, rec_end, arg);
+					cmd.AddArg(arg);
+				}
+				commands.push_back(cmd);
+			}
+		}
+		else if (type == enJrGroups)
+		{
+			size_t count;
+			ok = GetNumber(rec, rec_end, count) && count == commands.size();
+			for (auto it = commands.begin(); ok && it != commands.end(); ++it)
+			{
+				size_t group = 0, parallel = 0;
+				ok = GetNumber(rec, rec_end, group) && GetNumber(rec, rec_end, parallel);
+				it->m_nGroup = group;
+				it->m_nParallel = (int)parallel;
+			}
+		}
+		else if (type == enJrMessages && messages)
+		{
+			size_t count;
+			ok = GetNumber(rec, rec_end, count);
+			for (size_t i = 0; ok && i < count; i++)
+			{
+				string msg;
+				ok = GetString(rec, rec_end, msg);
+				messages->push_back(msg);
+			}
+		}
+		else if (type == enJrEnd && plan)
+		{
+			size_t count;
+			ok = GetNumber(rec, rec_end, count) && count == entries.size();
+			complete = ok;
+		}
+		else if (type == enJrFile || type == enJrPatch || (type == enJrPlanned && plan))
+		{
+			CJournalEntry entry;
+			size_t passes;
+			ok = GetString(rec, rec_end, entry.m_strFileName) &&
+				GetNumber(rec, rec_end, entry.m_nOldSize) &&
+				GetNumber(rec, rec_end, entry.m_nOldHash) &&
+				GetNumber(rec, rec_end, entry.m_nNewSize) &&
+				GetNumber(rec, rec_end, entry.m_nNewHash) &&
+				GetNumber(rec, rec_end, passes);
+
+			for (size_t i = 0; ok && i < passes; i++)
+			{
+				CEditPass pass;
+				size_t spans;
+				ok = GetNumber(rec, rec_end, spans);
+				for (size_t k = 0; ok && k < spans; k++)
+				{
+					size_t offset, new_len, old_len;
+					ok = GetNumber(rec, rec_end, offset) && GetNumber(rec, rec_end, new_len) && GetNumber(rec, rec_end, old_len);
+					pass.m_vecOffset.push_back(offset);
+					pass.m_vecNewLength.push_back(new_len);
+					pass.m_vecOldLength.push_back(old_len);
+				}
+				ok = ok && GetString(rec, rec_end, pass.m_strOld);
+				entry.m_vecPasses.push_back(pass);
+			}
+
+			entry.m_bInPlace = type == enJrPatch;
+			if (ok && type != enJrFile)
+				ok = GetString(rec, rec_end, entry.m_strNew) && entry.m_vecPasses.size() == 1;
+
+			if (ok)
+				entries.push_back(entry);
+		}
+
+		if (!ok)
+			throw CException("the " + string(plan ? "plan " : "journal ") + file_name + " is corrupt!");
+	}
+
+	if (plan && (!complete || p != end))
+		throw CException("the plan " + file_name + " is incomplete!");
+}
+
+
+// ===============================================================================
+//							CJournal::RollbackPatch
+//
+// Reverts a file patched in place. If the program was aborted while patching,
+// some spans may still hold the old bytes. Writing the old bytes again does no
+// harm then, so the file is reverted, if each span holds either the old or the
+// new bytes. "size" and "hash" belong to the current contents.
+// ===============================================================================
+bool CJournal::RollbackPatch(const CJournalEntry &entry, size_t size, unsigned long long hash)
+{
+	const string &file_name = entry.m_strFileName;
+	const CEditPass &pass = entry.m_vecPasses[0];
+
+	bool modified = size != entry.m_nNewSize;
+	if (!modified && hash != entry.m_nNewHash)
+	{
+		CountOpen();
+		FILE *fh = fopen(file_name.c_str(), "rb");
+		modified = !fh || pass.m_strOld.length() != entry.m_strNew.length();
+
+		size_t pos = 0;
+		for (size_t i = 0; i < pass.m_vecOffset.size() && !modified; i++)
+		{
+			size_t len = pass.m_vecNewLength[i];
+			if (pos + len > entry.m_strNew.length())
+				modified = true;
+			else
+				modified = !SpanMatches(fh, pass.m_vecOffset[i], pass.m_strOld.c_str() + pos, len) &&
+					!SpanMatches(fh, pass.m_vecOffset[i], entry.m_strNew.c_str() + pos, len);
+			pos += len;
+		}
+
+		if (fh)
+			fclose(fh);
+	}
+
+	if (modified)
+	{
+		printf("ERROR: file %s was modified after the replacement! Rollback for this file not performed!\n", file_name.c_str());
+		return false;
+	}
+
+	try
+	{
+		PatchFile(file_name, pass, pass.m_strOld);
+	}
+	catch (exception &)
+	{
+		printf("ERROR: can not write file %s! Rollback for this file not performed!\n", file_name.c_str());
+		return false;
+	}
+
+	hash = StreamFile(file_name, CStream::DefaultWindow, NULL, size);
+	if (size != entry.m_nOldSize || hash != entry.m_nOldHash)
+	{
+		printf("ERROR: the journal entry for file %s is invalid! Rollback for this file not performed!\n", file_name.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+
+// ===============================================================================
+//							CJournal::Rollback
+//
+// Reverts the entries of a journal, the last one first. A file is only
+// reverted, if it still has the contents written by autoversion. Returns
+// false, if any file could not be reverted.
+// ===============================================================================
+bool CJournal::Rollback(const vector<CJournalEntry> &entries)
+{
+	bool ok = true;
+	for (auto it = entries.rbegin(); it != entries.rend(); ++it)
+	{
+		const string &file_name = it->m_strFileName;
+
+		if (g_bVerbose)
+			printf("rolling back %s\n", file_name.c_str());
+
+		struct stat st;
+		if (stat(file_name.c_str(), &st) != 0)
+		{
+			printf("ERROR: file %s does not exist! Rollback for this file not performed!\n", file_name.c_str());
+			ok = false;
+			continue;
+		}
+
+		size_t size;
+		unsigned long long hash = StreamFile(file_name, CStream::DefaultWindow, NULL, size);
+
+		if (size == it->m_nOldSize && hash == it->m_nOldHash)
+			continue;	// the file was not written yet
+
+		if (it->m_bInPlace)
+		{
+			if (!RollbackPatch(*it, size, hash))
+				ok = false;
+			continue;
+		}
+
+		if (size != it->m_nNewSize || hash != it->m_nNewHash)
+		{
+			printf("ERROR: file %s was modified after the replacement! Rollback for this file not performed!\n", file_name.c_str());
+			ok = false;
+			continue;
+		}
+
+		try
+		{
+			// The passes are reverted in reverse order, the file is written to a
+			// temporary file while it is read.
+			CFileStream out;
+			out.Open(file_name);
+
+			vector<unique_ptr<CUndoStream>> chain;
+			CStream *next = &out;
+			for (auto &pass : it->m_vecPasses)
+			{
+				chain.push_back(unique_ptr<CUndoStream>(new CUndoStream(pass, *next)));
+				next = chain.back().get();
+			}
+
+			hash = StreamFile(file_name, CStream::DefaultWindow, next, size);
+			next->Finish();
+
+			bool failed = size != it->m_nNewSize || hash != it->m_nNewHash;
+			for (auto &undo : chain)
+				failed = failed || undo->Failed();
+
+			if (failed || out.GetSize() != it->m_nOldSize || out.GetHash() != it->m_nOldHash)
+			{
+				printf("ERROR: the journal entry for file %s is invalid! Rollback for this file not performed!\n", file_name.c_str());
+				ok = false;
+				continue;
+			}
+
+			out.Commit();
+		}
+		catch (exception &)
+		{
+			printf("ERROR: can not write file %s! Rollback for this file not performed!\n", file_name.c_str());
+			ok = false;
+		}
+	}
+
+	return ok;
+}
+
+
+// ===============================================================================
+//							CScanCache::Load
+//
+// Reads the cache of the last run. A missing or damaged cache is ignored,
+// all files are scanned then.
+// ===============================================================================
+static const char ScanCacheMagic[] = "AVCACHE1\n";
+
+void CScanCache::Load(const string &file_name)
+{
+	Clear();
+
+	struct stat st;
+	if (stat(file_name.c_str(), &st) != 0)
+		return;
+
+	CFileBuffer file;
+	try
+	{
+		file.Open(file_name);
+	}
+	catch (exception &)
+	{
+		return;
+	}
+
+	const char *p = file.GetData();
+	const char *end = p + file.GetSize();
+
+	if (file.GetSize() < sizeof(ScanCacheMagic) - 1 || memcmp(p, ScanCacheMagic, sizeof(ScanCacheMagic) - 1) != 0)
+		return;
+	p += sizeof(ScanCacheMagic) - 1;
+
+	// the hash of the entries is stored at the end
+	unsigned long long hash = 0;
+	const char *hash_pos = end - 8;
+	if (hash_pos < p || !GetNumber(hash_pos, end, hash) || hash != HashBuffer(p, end - 8 - p))
+		return;
+	end -= 8;
+
+	size_t count = 0;
+	if (!GetNumber(p, end, count))
+		return;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		string name;
+		CScanCacheEntry entry;
+		unsigned long long modified, changed;
+		if (!GetString(p, end, name) ||
+			!GetNumber(p, end, entry.m_nSize) ||
+			!GetNumber(p, end, modified) ||
+			!GetNumber(p, end, changed) ||
+			!GetNumber(p, end, entry.m_nInode) ||
+			!GetNumber(p, end, entry.m_nHash) ||
+			!GetNumber(p, end, entry.m_nRulesHash))
+		{
+			Clear();
+			return;
+		}
+
+		entry.m_tModified	= (long long)modified;
+		entry.m_tChanged	= (long long)changed;
+		entry.m_bValid		= true;
+		m_mapEntries[name]	= entry;
+	}
+}
+
+
+// ===============================================================================
+//							CScanCache::Save
+// ===============================================================================
+void CScanCache::Save(const string &file_name) const
+{
+	string data;
+	PutNumber(data, m_mapEntries.size());
+	for (auto &it : m_mapEntries)
+	{
+		PutString(data, it.first);
+		PutNumber(data, it.second.m_nSize);
+		PutNumber(data, (unsigned long long)it.second.m_tModified);
+		PutNumber(data, (unsigned long long)it.second.m_tChanged);
+		PutNumber(data, it.second.m_nInode);
+		PutNumber(data, it.second.m_nHash);
+		PutNumber(data, it.second.m_nRulesHash);
+	}
+	PutNumber(data, HashBuffer(data.c_str(), data.length()));
+
+	data.insert(0, ScanCacheMagic, sizeof(ScanCacheMagic) - 1);
+	WriteFileContents(file_name, data.c_str(), data.length());
+}
+
+
+// ===============================================================================
+//							CScanCache::EraseDirectory
+// ===============================================================================
+void CScanCache::EraseDirectory(const string &dir)
+{
+	for (auto it = m_mapEntries.begin(); it != m_mapEntries.end();)
+	{
+		const string &name = it->first;
+		if (name.compare(0, dir.length(), dir) == 0 && name.find_first_of("/\\", dir.length()) == string::npos)
+			it = m_mapEntries.erase(it);
+		else
+			++it;
+	}
+}
+
+
+// ===============================================================================
+//							CMultiMatcher::Build
+//
+// builds the automaton for the given patterns, the pattern index reported
+// by Scan() is the index into "patterns"
+// ===============================================================================
+void CMultiMatcher::Build(const vector<string> &patterns)
+{
+	// alphabet compression: all bytes not used in any pattern share class 0
+	memset(m_aClass, 0, sizeof(m_aClass));
+	m_nClasses = 1;
+	for (auto &it : patterns)
+	{
+		for (unsigned char c : it)
+		{
+			if (m_aClass[c] == 0)
+				m_aClass[c] = (unsigned char)m_nClasses++;
+		}
+	}
+
+	m_vecDelta.assign(m_nClasses, -1);
+	m_vecOutHead.assign(1, -1);
+	m_vecOutPattern.clear();
+	m_vecOutLink.clear();
+	m_vecLength.clear();
+
+	// build the trie, remember the last own output entry of each state
+	vector<int> out_tail(1, -1);
+	for (size_t i = 0; i < patterns.size(); i++)
+	{
+		int state = 0;
+		for (unsigned char c : patterns[i])
+		{
+			int &next = m_vecDelta[state * m_nClasses + m_aClass[c]];
+			if (next < 0)
+			{
+				next = (int)m_vecOutHead.size();
+				m_vecDelta.resize(m_vecDelta.size() + m_nClasses, -1);
+				m_vecOutHead.push_back(-1);
+				out_tail.push_back(-1);
+			}
+
+			state = m_vecDelta[state * m_nClasses + m_aClass[c]];
+		}
+
+		int entry = (int)m_vecOutPattern.size();
+		m_vecOutPattern.push_back((int)i);
+		m_vecOutLink.push_back(-1);
+		if (out_tail[state] < 0)
+			m_vecOutHead[state] = entry;
+		else
+			m_vecOutLink[out_tail[state]] = entry;
+		out_tail[state] = entry;
+
+		m_vecLength.push_back(patterns[i].length());
+	}
+
+	// breadth first: compute failure links and turn the trie into a DFA.
+	// The output chain of a state is its own outputs followed by the chain of its failure state.
+	vector<int> fail(m_vecOutHead.size(), 0);
+	vector<int> queue;
+	queue.reserve(m_vecOutHead.size());
+
+	for (int c = 0; c < m_nClasses; c++)
+	{
+		int &next = m_vecDelta[c];
+		if (next < 0)
+			next = 0;
+		else
+			queue.push_back(next);
+	}
+
+	for (size_t q = 0; q < queue.size(); q++)
+	{
+		int state = queue[q];
+
+		if (out_tail[state] < 0)
+			m_vecOutHead[state] = m_vecOutHead[fail[state]];
+		else
+			m_vecOutLink[out_tail[state]] = m_vecOutHead[fail[state]];
+
+		for (int c = 0; c < m_nClasses; c++)
+		{
+			int &next = m_vecDelta[state * m_nClasses + c];
+			int fallback = m_vecDelta[fail[state] * m_nClasses + c];
+			if (next < 0)
+				next = fallback;
+			else
+			{
+				fail[next] = fallback;
+				queue.push_back(next);
+			}
+		}
+	}
+}
+
+
+// ===============================================================================
+//										IsWordByte
+//
+// \w and \b, only ASCII letters count, the encoding of the file is not known
+// ===============================================================================
+static inline bool IsWordByte(int c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+
+// ===============================================================================
+//							CRegex::CRegex
+//
+// compiles "pattern", throws a CException if it is not valid
+// ===============================================================================
+CRegex::CRegex(const string &pattern)
+{
+	m_strPattern	= pattern;
+	m_nGroups		= 0;
+	m_pParse		= m_strPattern.c_str();
+
+	SNode root = ParseAlternative();
+	if (*m_pParse == ')')
+		throw CException("regular expression '" + pattern + "': unmatched )");
+	if ((size_t)(m_pParse - m_strPattern.c_str()) != m_strPattern.length())
+		throw CException("regular expression '" + pattern + "': \\0 is not supported");
+
+	Emit(enOpSave, 0);
+	Compile(root);
+	Emit(enOpSave, 1);
+	Emit(enOpMatch);
+
+	m_pParse = NULL;
+	ComputeFirst();
+}
+
+
+// ===============================================================================
+//							CRegex::AddSet
+// ===============================================================================
+int CRegex::AddSet(const unsigned char *set)
+{
+	m_vecSets.insert(m_vecSets.end(), set, set + 256);
+	return (int)(m_vecSets.size() / 256 - 1);
+}
+
+
+// ===============================================================================
+//							CRegex::ParseAlternative
+//
+// alternative := sequence ( '|' sequence )*
+// ===============================================================================
+CRegex::SNode CRegex::ParseAlternative()
+{
+	SNode first = ParseSequence();
+	if (*m_pParse != '|')
+		return first;
+
+	SNode node(SNode::enAlt);
+	node.m_vecChildren.push_back(std::move(first));
+	while (*m_pParse == '|')
+	{
+		m_pParse++;
+		node.m_vecChildren.push_back(ParseSequence());
+	}
+
+	return node;
+}
+
+
+// ===============================================================================
+//							CRegex::ParseSequence
+// ===============================================================================
+CRegex::SNode CRegex::ParseSequence()
+{
+	SNode node(SNode::enCat);
+	while (*m_pParse && *m_pParse != '|' && *m_pParse != ')')
+		node.m_vecChildren.push_back(ParseRepeat());
+
+	return node;
+}
+
+
+// ===============================================================================
+//							CRegex::ParseRepeat
+//
+// an atom with its quantifiers: * + ? {n} {n,} {n,m}, each optionally
+// followed by ? for the lazy variant
+// ===============================================================================
+CRegex::SNode CRegex::ParseRepeat()
+{
+	enum { MaxRepeat = 1000 };
+
+	if (*m_pParse == '*' || *m_pParse == '+' || *m_pParse == '?')
+		throw CException("regular expression '" + m_strPattern + "': nothing to repeat");
+
+	SNode atom = ParseAtom();
+
+	for (;;)
+	{
+		int min, max;
+		const char *p = m_pParse;
+
+		if (*p == '*')
+			min = 0, max = -1, p++;
+		else if (*p == '+')
+			min = 1, max = -1, p++;
+		else if (*p == '?')
+			min = 0, max = 1, p++;
+		else if (*p == '{' && isdigit((unsigned char)p[1]))
+		{
+			// {n}, {n,} or {n,m}, otherwise the { is a literal
+			char *end;
+			min = (int)strtol(p + 1, &end, 10);
+			max = min;
+			if (*end == ',')
+			{
+				end++;
+				max = isdigit((unsigned char)*end) ? (int)strtol(end, &end, 10) : -1;
+			}
+			if (*end != '}')
+				break;
+
+			if (min > MaxRepeat || max > MaxRepeat || (max >= 0 && max < min))
+				throw CException("regular expression '" + m_strPattern + "': invalid repeat count");
+			p = end + 1;
+		}
+		else
+			break;
+
+		if (atom.m_enType == SNode::enAssert)
+			throw CException("regular expression '" + m_strPattern + "': nothing to repeat");
+
+		SNode node(SNode::enRepeat);
+		node.m_nMin		= min;
+		node.m_nMax		= max;
+		node.m_bGreedy	= *p != '?';
+		if (*p == '?')
+			p++;
+
+		node.m_vecChildren.push_back(std::move(atom));
+		atom = std::move(node);
+		m_pParse = p;
+	}
+
+	return atom;
+}
+
+
+// ===============================================================================
+//							CRegex::ParseAtom
+// ===============================================================================
+CRegex::SNode CRegex::ParseAtom()
+{
+	unsigned char set[256];
+	memset(set, 0, sizeof(set));
+	char c = *m_pParse++;
+
+	switch (c)
+	{
+	case '(':
+	{
+		SNode node(SNode::enGroup);
+		if (m_pParse[0] == '?' && m_pParse[1] == ':')
+		{
+			m_pParse += 2;
+			node.m_nArg = -1;		// not capturing
+		}
+		else
+			node.m_nArg = ++m_nGroups;
+
+		node.m_vecChildren.push_back(ParseAlternative());
+		if (*m_pParse != ')')
+			throw CException("regular expression '" + m_strPattern + "': missing )");
+		m_pParse++;
+		return node;
+	}
+
+	case '[':
+		return ParseClass();
+
+	case '.':
+		memset(set, 1, sizeof(set));
+		set['\n'] = 0;
+		return SNode(SNode::enSet, AddSet(set));
+
+	case '^':
+		return SNode(SNode::enAssert, enOpLineStart);
+
+	case '$':
+		return SNode(SNode::enAssert, enOpLineEnd);
+
+	case '\\':
+	{
+		if (*m_pParse == 'b' || *m_pParse == 'B')
+			return SNode(SNode::enAssert, *m_pParse++ == 'b' ? enOpWordBoundary : enOpNotWordBoundary);
+
+		bool is_set;
+		int byte = ParseEscape(set, is_set);
+		if (!is_set)
+			set[byte] = 1;
+		return SNode(SNode::enSet, AddSet(set));
+	}
+
+	default:
+		set[(unsigned char)c] = 1;
+		return SNode(SNode::enSet, AddSet(set));
+	}
+}
+
+
+// ===============================================================================
+//							CRegex::ParseClass
+//
+// [...] or [^...], the [ is already read
+// ===============================================================================
+CRegex::SNode CRegex::ParseClass()
+{
+	unsigned char set[256];
+	memset(set, 0, sizeof(set));
+
+	bool negate = *m_pParse == '^';
+	if (negate)
+		m_pParse++;
+
+	bool first = true;
+	while (*m_pParse != ']' || first)
+	{
+		if (!*m_pParse)
+			throw CException("regular expression '" + m_strPattern + "': missing ]");
+		first = false;
+
+		int lo = (unsigned char)*m_pParse++;
+		if (lo == '\\')
+		{
+			bool is_set;
+			unsigned char escaped[256];
+			memset(escaped, 0, sizeof(escaped));
+			lo = ParseEscape(escaped, is_set);
+			if (is_set)
+			{
+				for (int i = 0; i < 256; i++)
+					set[i] |= escaped[i];
+				continue;
+			}
+		}
+
+		int hi = lo;
+		if (m_pParse[0] == '-' && m_pParse[1] && m_pParse[1] != ']')
+		{
+			m_pParse++;
+			hi = (unsigned char)*m_pParse++;
+			if (hi == '\\')
+			{
+				bool is_set;
+				unsigned char escaped[256];
+				hi = ParseEscape(escaped, is_set);
+				if (is_set)
+					throw CException("regular expression '" + m_strPattern + "': invalid range");
+			}
+			if (hi < lo)
+				throw CException("regular expression '" + m_strPattern + "': invalid range");
+		}
+
+		for (int i = lo; i <= hi; i++)
+			set[i] = 1;
+	}
+	m_pParse++;
+
+	if (negate)
+	{
+		for (int i = 0; i < 256; i++)
+			set[i] = !set[i];
+	}
+
+	return SNode(SNode::enSet, AddSet(set));
+}
+
+
+// ===============================================================================
+//							CRegex::ParseEscape
+//
+// the character behind a \. Returns the byte, or sets "is_set" and adds the
+// bytes of a class like \d to "set".
+// ===============================================================================
+int CRegex::ParseEscape(unsigned char *set, bool &is_set)
+{
+	is_set = false;
+	char c = *m_pParse;
+	if (!c)
+		throw CException("regular expression '" + m_strPattern + "': \\ at the end");
+	m_pParse++;
+
+	switch (c)
+	{
+	case 't':	return '\t';
+	case 'n':	return '\n';
+	case 'r':	return '\r';
+	case 'f':	return '\f';
+	case 'v':	return '\v';
+
+	case 'x':
+		if (isxdigit((unsigned char)m_pParse[0]) && isxdigit((unsigned char)m_pParse[1]))
+		{
+			char hex[3] = { m_pParse[0], m_pParse[1], 0 };
+			m_pParse += 2;
+			return (int)strtol(hex, NULL, 16);
+		}
+		throw CException("regular expression '" + m_strPattern + "': \\x needs two hex digits");
+
+	case 'd': case 'D': case 'w': case 'W': case 's': case 'S':
+	{
+		bool negate = isupper((unsigned char)c) != 0;
+		char lower = (char)tolower((unsigned char)c);
+		for (int i = 0; i < 256; i++)
+		{
+			bool in;
+			if (lower == 'd')
+				in = i >= '0' && i <= '9';
+			else if (lower == 'w')
+				in = IsWordByte(i);
+			else
+				in = i == ' ' || (i >= '\t' && i <= '\r');
+
+			if (in != negate)
+				set[i] = 1;
+		}
+		is_set = true;
+		return 0;
+	}
+
+	default:
+		if (isdigit((unsigned char)c))
+			throw CException("regular expression '" + m_strPattern + "': backreferences are not supported");
+		if (isalpha((unsigned char)c))
+			throw CException("regular expression '" + m_strPattern + "': unknown escape \\" + string(1, c));
+		return (unsigned char)c;
+	}
+}
+
+
+// ===============================================================================
+//							CRegex::Emit
+// ===============================================================================
+int CRegex::Emit(EOp op, int x, int y)
+{
+	enum { MaxProgram = 100000 };
+
+	if (m_vecProgram.size() >= MaxProgram)
+		throw CException("regular expression '" + m_strPattern + "' is too large");
+
+	SInst inst;
+	inst.m_enOp	= op;
+	inst.m_nX	= x;
+	inst.m_nY	= y;
+	m_vecProgram.push_back(inst);
+	return (int)m_vecProgram.size() - 1;
+}
+
+
+// ===============================================================================
+//							CRegex::Compile
+//
+// appends the instructions for "node" to m_vecProgram
+// ===============================================================================
+void CRegex::Compile(const SNode &node)
+{
+	switch (node.m_enType)
+	{
+	case SNode::enEmpty:
+		break;
+
+	case SNode::enSet:
+		Emit(enOpSet, node.m_nArg, (int)m_vecProgram.size() + 1);
+		break;
+
+	case SNode::enAssert:
+		Emit((EOp)node.m_nArg);
+		break;
+
+	case SNode::enCat:
+		for (auto &it : node.m_vecChildren)
+			Compile(it);
+		break;
+
+	case SNode::enAlt:
+	{
+		// split L1, L2; L1: a; jmp end; L2: split ...; the last alternative needs no split
+		vector<int> jumps;
+		for (size_t i = 0; i < node.m_vecChildren.size(); i++)
+		{
+			if (i + 1 < node.m_vecChildren.size())
+			{
+				int split = Emit(enOpSplit, 0, 0);
+				m_vecProgram[split].m_nX = split + 1;
+				Compile(node.m_vecChildren[i]);
+				jumps.push_back(Emit(enOpJmp));
+				m_vecProgram[split].m_nY = (int)m_vecProgram.size();
+			}
+			else
+				Compile(node.m_vecChildren[i]);
+		}
+
+		for (auto jump : jumps)
+			m_vecProgram[jump].m_nX = (int)m_vecProgram.size();
+		break;
+	}
+
+	case SNode::enGroup:
+		if (node.m_nArg > 0)
+			Emit(enOpSave, 2 * node.m_nArg);
+		Compile(node.m_vecChildren[0]);
+		if (node.m_nArg > 0)
+			Emit(enOpSave, 2 * node.m_nArg + 1);
+		break;
+
+	case SNode::enRepeat:
+	{
+		const SNode &child = node.m_vecChildren[0];
+		vector<int> exits;		// the jumps of the empty iterations to the end
+
+		// the mandatory repetitions, the last one is the loop for an unlimited count.
+		// From the minimum on an empty iteration ends the loop, so the last one
+		// is checked too, if more can follow.
+		int mandatory = node.m_nMax < 0 && node.m_nMin > 0 ? node.m_nMin - 1 : node.m_nMin;
+		for (int i = 0; i < mandatory; i++)
+		{
+			if (i + 1 == node.m_nMin && node.m_nMax > node.m_nMin)
+				CompileIteration(child, exits);
+			else
+				Compile(child);
+		}
+
+		int end;
+		if (node.m_nMax < 0 && node.m_nMin > 0)
+		{
+			// L: child; split L, end
+			int loop = (int)m_vecProgram.size();
+			CompileIteration(child, exits);
+			int split = Emit(enOpSplit);
+			end = split + 1;
+			m_vecProgram[split].m_nX = node.m_bGreedy ? loop : end;
+			m_vecProgram[split].m_nY = node.m_bGreedy ? end : loop;
+		}
+		else if (node.m_nMax < 0)
+		{
+			// L: split L1, end; L1: child; jmp L
+			int split = Emit(enOpSplit);
+			CompileIteration(child, exits);
+			Emit(enOpJmp, split);
+			end = (int)m_vecProgram.size();
+			m_vecProgram[split].m_nX = node.m_bGreedy ? split + 1 : end;
+			m_vecProgram[split].m_nY = node.m_bGreedy ? end : split + 1;
+		}
+		else
+		{
+			// the optional repetitions: split L1, end; L1: child; split L2, end; ...
+			// the last one ends the loop anyway
+			vector<int> splits;
+			for (int i = node.m_nMin; i < node.m_nMax; i++)
+			{
+				splits.push_back(Emit(enOpSplit));
+				if (i + 1 < node.m_nMax)
+					CompileIteration(child, exits);
+				else
+					Compile(child);
+			}
+
+			end = (int)m_vecProgram.size();
+			for (auto split : splits)
+			{
+				m_vecProgram[split].m_nX = node.m_bGreedy ? split + 1 : end;
+				m_vecProgram[split].m_nY = node.m_bGreedy ? end : split + 1;
+			}
+		}
+
+		for (auto exit : exits)
+			m_vecProgram[exit].m_nX = end;
+		break;
+	}
+	}
+}
+
+
+// ===============================================================================
+//							CRegex::CompileIteration
+//
+// An iteration of a loop from the minimum on. As in Perl, the loop ends, if
+// the iteration matches empty. For a child which can match empty, it is
+// compiled twice: "child; jmp end; child". The first copy is entered, a byte
+// consumed there continues in the second one. So the end of the first copy
+// is only reached by an empty match, it jumps to the end of the loop, which
+// is added to "exits". The end of the second one continues the loop.
+// Revisiting the instructions of the child at the same position would not
+// do: a thread list holds each instruction once.
+// ===============================================================================
+void CRegex::CompileIteration(const SNode &child, vector<int> &exits)
+{
+	if (!CanBeEmpty(child))
+	{
+		Compile(child);
+		return;
+	}
+
+	int first = (int)m_vecProgram.size();
+	Compile(child);
+	exits.push_back(Emit(enOpJmp));
+
+	int second = (int)m_vecProgram.size();
+	Compile(child);
+
+	// the copies are alike, the bytes consumed in the first continue in the second
+	for (int pc = first; pc < second; pc++)
+	{
+		if (m_vecProgram[pc].m_enOp == enOpSet)
+			m_vecProgram[pc].m_nY += second - first;
+	}
+}
+
+
+// ===============================================================================
+//							CRegex::CanBeEmpty
+//
+// true, if "node" can match the empty string
+// ===============================================================================
+bool CRegex::CanBeEmpty(const SNode &node)
+{
+	switch (node.m_enType)
+	{
+	case SNode::enSet:
+		return false;
+
+	case SNode::enCat:
+		for (auto &it : node.m_vecChildren)
+		{
+			if (!CanBeEmpty(it))
+				return false;
+		}
+		return true;
+
+	case SNode::enAlt:
+		for (auto &it : node.m_vecChildren)
+		{
+			if (CanBeEmpty(it))
+				return true;
+		}
+		return false;
+
+	case SNode::enGroup:
+		return CanBeEmpty(node.m_vecChildren[0]);
+
+	case SNode::enRepeat:
+		return node.m_nMin == 0 || CanBeEmpty(node.m_vecChildren[0]);
+
+	default:		// enEmpty, enAssert
+		return true;
+	}
+}
+
+
+// ===============================================================================
+//							CRegex::ComputeFirst
+//
+// the bytes a match can start with, so the search can skip the text quickly
+// while no thread is alive
+// ===============================================================================
+void CRegex::ComputeFirst()
+{
+	memset(m_aFirst, 0, sizeof(m_aFirst));
+	m_bSkip = true;
+
+	vector<char> visited(m_vecProgram.size(), 0);
+	vector<int> stack(1, 0);
+	while (!stack.empty())
+	{
+		int pc = stack.back();
+		stack.pop_back();
+		if (visited[pc])
+			continue;
+		visited[pc] = 1;
+
+		const SInst &inst = m_vecProgram[pc];
+		switch (inst.m_enOp)
+		{
+		case enOpSet:
+			for (int i = 0; i < 256; i++)
+				m_aFirst[i] |= m_vecSets[inst.m_nX * 256 + i];
+			break;
+
+		case enOpMatch:
+			m_bSkip = false;		// the empty string matches
+			break;
+
+		case enOpSplit:
+			stack.push_back(inst.m_nY);
+			stack.push_back(inst.m_nX);
+			break;
+
+		case enOpJmp:
+			stack.push_back(inst.m_nX);
+			break;
+
+		default:
+			stack.push_back(pc + 1);	// the assertions only make the set smaller
+			break;
+		}
+	}
+
+	m_nFirstByte = -1;
+	int count = 0;
+	for (int i = 0; i < 256; i++)
+	{
+		if (m_aFirst[i])
+		{
+			m_nFirstByte = i;
+			count++;
+		}
+	}
+
+	if (count != 1)
+		m_nFirstByte = -1;
+}
+
+
+// ===============================================================================
+//							CRegex::AddThread
+//
+// Adds a thread at instruction "pc" to the thread list "list" for the
+// position "pos". The instructions which consume nothing are followed right
+// away, so the list only holds enOpSet and enOpMatch. "slots" are the capture
+// slots of the thread, they are restored on return.
+// ===============================================================================
+void CRegex::AddThread(SWorkspace &work, int list, int pc, size_t *slots, const char *buf, size_t size, size_t pos) const
+{
+	size_t slot_count = 2 * (m_nGroups + 1);
+	vector<unsigned> &mark = work.m_vecMark[list];
+	unsigned generation = work.m_nGeneration[list];
+	vector<pair<int, size_t>> &stack = work.m_vecStack;
+
+	int prev = pos > 0 ? (unsigned char)buf[pos - 1] : -1;
+	int next = pos < size ? (unsigned char)buf[pos] : -1;
+
+	stack.clear();
+	stack.push_back(make_pair(pc, (size_t)0));
+	while (!stack.empty())
+	{
+		pair<int, size_t> entry = stack.back();
+		stack.pop_back();
+
+		if (entry.first < 0)
+		{
+			slots[-1 - entry.first] = entry.second;
+			continue;
+		}
+
+		pc = entry.first;
+		if (mark[pc] == generation)
+			continue;
+		mark[pc] = generation;
+
+		const SInst &inst = m_vecProgram[pc];
+		switch (inst.m_enOp)
+		{
+		case enOpSet:
+		case enOpMatch:
+			work.m_vecPc[list].push_back(pc);
+			memcpy(&work.m_vecCaps[list][pc * slot_count], slots, slot_count * sizeof(size_t));
+			break;
+
+		case enOpSplit:
+			stack.push_back(make_pair(inst.m_nY, (size_t)0));
+			stack.push_back(make_pair(inst.m_nX, (size_t)0));
+			break;
+
+		case enOpJmp:
+			stack.push_back(make_pair(inst.m_nX, (size_t)0));
+			break;
+
+		case enOpSave:
+			// the old value is restored, when the rest of this thread is added
+			stack.push_back(make_pair(-1 - inst.m_nX, slots[inst.m_nX]));
+			slots[inst.m_nX] = pos;
+			stack.push_back(make_pair(pc + 1, (size_t)0));
+			break;
+
+		case enOpLineStart:
+			if (prev < 0 || prev == '\n')
+				stack.push_back(make_pair(pc + 1, (size_t)0));
+			break;
+
+		case enOpLineEnd:
+			if (next < 0 || next == '\n' || next == '\r')
+				stack.push_back(make_pair(pc + 1, (size_t)0));
+			break;
+
+		case enOpWordBoundary:
+		case enOpNotWordBoundary:
+			if ((IsWordByte(prev) != IsWordByte(next)) == (inst.m_enOp == enOpWordBoundary))
+				stack.push_back(make_pair(pc + 1, (size_t)0));
+			break;
+		}
+	}
+}
+
+
+// ===============================================================================
+//							CRegex::Search
+// ===============================================================================
+CRegex::ESearch CRegex::Search(const char *buf, size_t size, size_t start, bool final, SWorkspace &work, vector<size_t> &caps, size_t &keep) const
+{
+	size_t slot_count = 2 * (m_nGroups + 1);
+	size_t program_size = m_vecProgram.size();
+
+	// Without the final data, the last byte is not consumed, so the
+	// assertions can always look at the byte behind the position.
+	size_t limit = final ? size : (size > 0 ? size - 1 : 0);
+	if (!final && start >= limit)
+	{
+		keep = start;
+		return enSrMore;
+	}
+
+	// a list is cleared by a new generation of its marks
+	auto clear_list = [&](int list)
+	{
+		work.m_vecPc[list].clear();
+		if (++work.m_nGeneration[list] == 0)
+		{
+			fill(work.m_vecMark[list].begin(), work.m_vecMark[list].end(), 0);
+			work.m_nGeneration[list] = 1;
+		}
+	};
+
+	for (int i = 0; i < 2; i++)
+	{
+		work.m_vecCaps[i].resize(program_size * slot_count);
+		if (work.m_vecMark[i].size() != program_size)
+		{
+			work.m_vecMark[i].assign(program_size, 0);
+			work.m_nGeneration[i] = 0;
+		}
+		clear_list(i);
+	}
+	work.m_vecSlots.resize(slot_count);
+
+	int current = 0;
+	bool matched = false;
+	caps.assign(slot_count, string::npos);
+
+	size_t pos = start;
+	for (;;)
+	{
+		if (!matched)
+		{
+			if (work.m_vecPc[current].empty() && m_bSkip)
+			{
+				// no thread alive, skip to a byte a match can start with
+				if (m_nFirstByte >= 0)
+				{
+					const char *p = pos < limit ? (const char *)memchr(buf + pos, m_nFirstByte, limit - pos) : NULL;
+					pos = p ? p - buf : limit;
+				}
+				else
+				{
+					while (pos < limit && !m_aFirst[(unsigned char)buf[pos]])
+						pos++;
+				}
+
+				if (pos >= limit)
+				{
+					keep = limit;
+					return final ? enSrNone : enSrMore;
+				}
+			}
+
+			// a new thread for a match starting here, with the lowest priority
+			fill(work.m_vecSlots.begin(), work.m_vecSlots.end(), string::npos);
+			AddThread(work, current, 0, work.m_vecSlots.data(), buf, size, pos);
+		}
+
+		if (pos >= limit)
+			break;
+
+		// step all threads over the byte at pos
+		int next = 1 - current;
+		clear_list(next);
+
+		unsigned char c = (unsigned char)buf[pos];
+		for (auto pc : work.m_vecPc[current])
+		{
+			const SInst &inst = m_vecProgram[pc];
+			size_t *slots = &work.m_vecCaps[current][pc * slot_count];
+
+			if (inst.m_enOp == enOpMatch)
+			{
+				// the threads behind this one have a lower priority
+				matched = true;
+				caps.assign(slots, slots + slot_count);
+				break;
+			}
+
+			if (m_vecSets[inst.m_nX * 256 + c])
+				AddThread(work, next, inst.m_nY, slots, buf, size, pos + 1);
+		}
+
+		current = next;
+		pos++;
+
+		if (matched && work.m_vecPc[current].empty())
+			return enSrFound;
+	}
+
+	// the end of the data: a thread at enOpMatch ends a match, unless a thread
+	// with a higher priority could still match, if more data follows
+	for (auto pc : work.m_vecPc[current])
+	{
+		if (m_vecProgram[pc].m_enOp == enOpMatch)
+		{
+			const size_t *slots = &work.m_vecCaps[current][pc * slot_count];
+			caps.assign(slots, slots + slot_count);
+			return enSrFound;
+		}
+
+		if (!final)
+			break;
+	}
+
+	if (final)
+		return matched ? enSrFound : enSrNone;
+
+	// the data is needed from the start of the earliest match still possible
+	keep = matched ? caps[0] : limit;
+	for (auto pc : work.m_vecPc[current])
+		keep = min(keep, work.m_vecCaps[current][pc * slot_count]);
+
+	return enSrMore;
+}
+
+
+// ===============================================================================
+//							CRegex::Expand
+// ===============================================================================
+void CRegex::Expand(const string &with, const char *buf, const vector<size_t> &caps, string &out) const
+{
+	out.clear();
+	for (size_t i = 0; i < with.length(); i++)
+	{
+		char c = with[i];
+		if (c == '$' && i + 1 < with.length())
+		{
+			char n = with[i + 1];
+			if (n == '$')
+			{
+				out += '$';
+				i++;
+				continue;
+			}
+
+			if (isdigit((unsigned char)n))
+			{
+				size_t group = n - '0';
+				if (group <= (size_t)m_nGroups && caps[2 * group] != string::npos && caps[2 * group + 1] != string::npos)
+					out.append(buf + caps[2 * group], caps[2 * group + 1] - caps[2 * group]);
+				i++;
+				continue;
+			}
+		}
+
+		out += c;
+	}
+}
+
+
+// ===============================================================================
+//							CRegex::GetMaxReference
+// ===============================================================================
+int CRegex::GetMaxReference(const string &with)
+{
+	int max_group = -1;
+	for (size_t i = 0; i + 1 < with.length(); i++)
+	{
+		if (with[i] != '$')
+			continue;
+
+		if (isdigit((unsigned char)with[i + 1]))
+			max_group = max(max_group, with[i + 1] - '0');
+		i++;
+	}
+
+	return max_group;
+}
+
+
+// ===============================================================================
+//								DetectEncoding
+//
+// the encoding of a file from its first bytes "buf". Without a byte order
+// mark, the file is taken for UTF-16, if the high byte of at least half of
+// the code units is zero and no low byte is. UTF-8 and the 8 bit code pages
+// are matched as bytes.
+// ===============================================================================
+static const size_t EncodingProbeSize = 512;	// the bytes DetectEncoding looks at
+
+static EEncoding DetectEncoding(const char *buf, size_t size, size_t file_size)
+{
+	const unsigned char *p = (const unsigned char *)buf;
+	if (size >= 2 && p[0] == 0xFF && p[1] == 0xFE)
+		return size >= 4 && p[2] == 0 && p[3] == 0 ? enEncBytes : enEncUtf16LE;	// UTF-32 is not supported
+	if (size >= 2 && p[0] == 0xFE && p[1] == 0xFF)
+		return enEncUtf16BE;
+
+	// most files are text without any zero byte
+	size_t units = min(size, EncodingProbeSize) / 2;
+	if (file_size % 2 != 0 || units < 2 || !memchr(p, 0, units * 2))
+		return enEncBytes;
+
+	size_t zero[2] = { 0, 0 };		// zero bytes at even and at odd offsets
+	for (size_t i = 0; i < units * 2; i++)
+	{
+		if (p[i] == 0)
+			zero[i & 1]++;
+	}
+
+	if (zero[0] == 0 && zero[1] * 2 >= units)
+		return enEncUtf16LE;
+	if (zero[1] == 0 && zero[0] * 2 >= units)
+		return enEncUtf16BE;
+	return enEncBytes;
+}
+
+
+// ===============================================================================
+//								DetectFileEncoding
+//
+// DetectEncoding for a file, which is not read as a whole
+// ===============================================================================
+static EEncoding DetectFileEncoding(const string &file_name, size_t file_size)
+{
+	char probe[EncodingProbeSize];
+
+	CountOpen();
+	FILE *fh = fopen(file_name.c_str(), "rb");
+	if (!fh)
+		throw CException("can not open file " + file_name);
+
+	size_t len = fread(probe, 1, sizeof(probe), fh);
+	CountRead(len);
+	fclose(fh);
+
+	return DetectEncoding(probe, len, file_size);
+}
+
+
+// ===============================================================================
+//								EncodeUtf16
+//
+// a string of the Control File in UTF-16. It is decoded as UTF-8, if it is
+// valid UTF-8, otherwise each byte is a character of ISO 8859-1.
+// ===============================================================================
+static string EncodeUtf16(const string &text, bool big_endian)
+{
+	static const unsigned min_char[] = { 0, 0, 0x80, 0x800, 0x10000 };		// by length, longer forms are invalid
+
+	vector<unsigned> chars;
+	bool utf8 = true;
+	for (size_t i = 0; utf8 && i < text.length(); )
+	{
+		unsigned char c = text[i];
+		size_t len = c < 0x80 ? 1 : (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 0;
+		utf8 = len > 0 && i + len <= text.length();
+
+		unsigned ch = len > 1 ? c & (0x7F >> len) : c;
+		for (size_t k = 1; utf8 && k < len; k++)
+		{
+			unsigned char cont = text[i + k];
+			utf8 = (cont & 0xC0) == 0x80;
+			ch = ch << 6 | (cont & 0x3F);
+		}
+
+		utf8 = utf8 && ch >= min_char[len] && ch <= 0x10FFFF && (ch < 0xD800 || ch >= 0xE000);
+		chars.push_back(ch);
+		i += len;
+	}
+
+	if (!utf8)
+		chars.assign((const unsigned char *)text.data(), (const unsigned char *)text.data() + text.length());
+
+	string out;
+	auto put = [&](unsigned unit)
+	{
+		char low = (char)(unit & 0xFF);
+		char high = (char)(unit >> 8);
+		out += big_endian ? high : low;
+		out += big_endian ? low : high;
+	};
+
+	for (auto ch : chars)
+	{
+		if (ch >= 0x10000)
+		{
+			put(0xD800 + ((ch - 0x10000) >> 10));
+			put(0xDC00 + ((ch - 0x10000) & 0x3FF));
+		}
+		else
+			put(ch);
+	}
+
+	return out;
+}
+
+
+// ===============================================================================
+//							CReplace::SetEncoding
+//
+// encodes "what" and "with" for a file in "encoding". A binary replacement is
+// always matched as bytes.
+// ===============================================================================
+void CReplace::SetEncoding(EEncoding encoding)
+{
+	if (m_enReplaceOp == enRoBinary)
+		encoding = enEncBytes;
+	if (encoding == m_enEncoding)
+		return;
+
+	m_enEncoding = encoding;
+	if (encoding == enEncBytes)
+		m_pEncoded.reset();
+	else
+		m_pEncoded = make_shared<const pair<string, string>>(EncodeUtf16(*m_pWhat, encoding == enEncUtf16BE), EncodeUtf16(*m_pWith, encoding == enEncUtf16BE));
+}
+
+
+// ===============================================================================
+//							CReplace::FindWhat
+//
+// the first match of "what" in buf, which starts at a code unit of the file.
+// "offset" is the offset of buf in the file.
+// ===============================================================================
+const char *CReplace::FindWhat(const char *buf, size_t size, size_t offset) const
+{
+	const string &what = GetWhatBytes();
+	const char *end = buf + size;
+	const char *p = buf;
+	while ((p = FindPattern(p, end - p, what)) != NULL && !IsAligned(offset + (p - buf)))
+		p++;
+
+	return p;
+}
+
+
+// ===============================================================================
+//							CReplace::CheckReplace
+//
+// checks, if a replacement will occur. "found" tells, if the what-string
+// occurs in the file. For a regular expression, "changes" tells, if any
+// match differs from its replacement.
+// ===============================================================================
+bool CReplace::CheckReplace(const string &file_name, bool found, bool changes)
+{
+	if (found)
+	{
+		if (!changes || (!IsRegex() && *m_pWhat == *m_pWith))
+			return false;
+
+		m_bMustReplace = true;
+		if (g_bVerbose)
+			Print("%s: found '%s' (to be replaced with '%s')\n", file_name.c_str(), m_pWhat->c_str(), m_pWith->c_str());
+		return true;
+	}
+
+	// Der what-string MUSS gefunden werden, sonst stimmt etwas im Control File nicht
+	if (IsRegex())
+		throw CException(file_name + ": the regular expression '" + *m_pWhat + "' does not match!");
+	throw CException(file_name + ": the string '" + *m_pWhat + "' was not found!");
+}
+
+
+// ===============================================================================
+//							CReplace::ScanRegex
+//
+// check phase of a regular expression: searches the matches in "buf", until
+// one differs from its replacement
+// ===============================================================================
+void CReplace::ScanRegex(const char *buf, size_t size)
+{
+	CRegex::SWorkspace work;
+	vector<size_t> caps;
+	string with;
+	size_t keep;
+	size_t pos = 0;
+
+	m_bRegexFound	= false;
+	m_bRegexChanges	= false;
+
+	while (pos <= size && m_pRegex->Search(buf, size, pos, true, work, caps, keep) == CRegex::enSrFound)
+	{
+		m_bRegexFound = true;
+
+		m_pRegex->Expand(*m_pWith, buf, caps, with);
+		if (with.length() != caps[1] - caps[0] || memcmp(with.c_str(), buf + caps[0], with.length()) != 0)
+		{
+			m_bRegexChanges = true;
+			return;
+		}
+
+		// an empty match: the next search starts behind the next byte
+		pos = caps[1] > caps[0] ? caps[1] : caps[1] + 1;
+	}
+}
+
+
+// ===============================================================================
+//							CReplace::SelectMatches
+//
+// Picks the matches from m_vecMatches, which DoReplace would replace if the
+// file was not modified by other replacements before: the leftmost match,
+// then the next one behind it and so on.
+// ===============================================================================
+void CReplace::SelectMatches(vector<size_t> &selected) const
+{
+	size_t what_len = GetWhatBytes().length();
+	size_t next = 0;
+
+	for (auto pos : m_vecMatches)
+	{
+		if (pos >= next)
+		{
+			selected.push_back(pos);
+			next = pos + what_len;
+		}
+	}
+}
+
+
+// ===============================================================================
+//							CReplace::Replaced
+//
+// marks the replacement as done, "count" occurrences were replaced
+// ===============================================================================
+void CReplace::Replaced(size_t count)
+{
+	m_bDidReplace = true;
+	m_nReplaced += count;
+
+	if (g_bVerbose)
+	{
+		for (size_t i = 0; i < count; i++)
+			Print("replacing '%s' with '%s'\n", m_pWhat->c_str(), m_pWith->c_str());
+	}
+}
+
+
+// ===============================================================================
+//							CReplace::DoReplace
+//
+// performs a replacement for a file. Returns the new contents in a malloc'd
+// buffer, or NULL if nothing was replaced. "buf" is not modified. The
+// replaced spans are recorded in "pass".
+// ===============================================================================
+char *CReplace::DoReplace(const char *buf, size_t &size, CEditPass &pass)
+{
+	if (m_bMustReplace && m_pRegex)
+		return DoReplaceRegex(buf, size, pass);
+
+	if (m_bMustReplace)
+	{
+		const string &with = GetWithBytes();
+		size_t what_len = GetWhatBytes().length();
+		size_t with_len = with.length();
+
+		// First collect all matches. The search continues behind a match, so a
+		// replacement is never searched again.
+		vector<size_t> matches;
+		const char *end = buf + size;
+		const char *p = buf;
+		while ((p = FindWhat(p, end - p, p - buf)) != NULL)
+		{
+			matches.push_back(p - buf);
+			p += what_len;
+		}
+
+		Replaced(matches.size());
+		if (matches.empty())
+			return NULL;
+
+		// Then build the new buffer in a single pass
+		size_t newsize = size - matches.size() * what_len + matches.size() * with_len;
+		CountAllocation();
+		char *newbuf = (char *)malloc(newsize ? newsize : 1);
+		if (!newbuf)
+			throw CException("out of memory");
+
+		char *dst = newbuf;
+		size_t src = 0;
+		for (auto match : matches)
+		{
+			memcpy(dst, buf + src, match - src);
+			dst += match - src;
+			pass.Add(dst - newbuf, with_len, buf + match, what_len);
+			memcpy(dst, with.c_str(), with_len);
+			dst += with_len;
+			src = match + what_len;
+		}
+		memcpy(dst, buf + src, size - src);
+
+		size = newsize;
+		return newbuf;
+	}
+
+	return NULL;
+}
+
+
+// ===============================================================================
+//							CReplace::DoReplaceRegex
+//
+// DoReplace for a regular expression. The matches are replaced by "with",
+// with the groups inserted. Matches equal to their replacement are left alone.
+// ===============================================================================
+char *CReplace::DoReplaceRegex(const char *buf, size_t &size, CEditPass &pass)
+{
+	CRegex::SWorkspace work;
+	vector<size_t> caps;
+	string with;
+	size_t keep;
+	size_t src = 0;			// copied up to here
+	size_t pos = 0;			// the search continues here
+	size_t count = 0;
+
+	// the new buffer is only allocated at the first change, it grows by realloc
+	char *out = NULL;
+	size_t length = 0;
+	size_t capacity = 0;
+	auto append = [&](const char *data, size_t len)
+	{
+		if (!out || length + len > capacity)
+		{
+			capacity = max(length + len, capacity ? capacity * 2 : size + size / 8 + 1);
+			CountAllocation();
+			char *p = (char *)realloc(out, capacity);
+			if (!p)
+			{
+				free(out);
+				throw CException("out of memory");
+			}
+			out = p;
+		}
+		memcpy(out + length, data, len);
+		length += len;
+	};
+
+	while (pos <= size && m_pRegex->Search(buf, size, pos, true, work, caps, keep) == CRegex::enSrFound)
+	{
+		size_t start = caps[0];
+		size_t end = caps[1];
+		pos = end > start ? end : end + 1;
+
+		m_pRegex->Expand(*m_pWith, buf, caps, with);
+		if (with.length() == end - start && memcmp(with.c_str(), buf + start, with.length()) == 0)
+			continue;
+
+		append(buf + src, start - src);
+		pass.Add(length, with.length(), buf + start, end - start);
+		append(with.c_str(), with.length());
+		src = end;
+		count++;
+	}
+
+	Replaced(count);
+	if (!count)
+		return NULL;
+
+	append(buf + src, size - src);
+	size = length;
+	return out;
+}
+
+
+// ===============================================================================
+//							CRegexStream::Write
+// ===============================================================================
+void CRegexStream::Write(const char *buf, size_t size)
+{
+	if (IsDecided() || size == 0)
+		return;
+
+	size_t pos = 0;		// the search continues at buf + pos
+
+	// The search continues in the pending bytes, buf is appended to them in
+	// pieces of growing size, until the search has left them. So only the bytes
+	// of a match still possible are copied.
+	if (!m_strPending.empty())
+	{
+		for (;;)
+		{
+			size_t pending = m_strPending.length();
+			size_t piece = min(size - pos, max(pending, (size_t)MinPiece));
+			m_strPending.append(buf + pos, piece);
+			pos += piece;
+
+			size_t next = Process(m_strPending.c_str(), m_strPending.length(), m_nStart, false);
+			if (IsDecided())
+			{
+				m_strPending.clear();
+				m_nStart = 0;
+				return;
+			}
+
+			if (next > pending)
+			{
+				// the search and the byte before it for the assertions are in buf
+				pos = pos - piece + next - pending;
+				m_strPending.clear();
+				m_nStart = 0;
+				break;
+			}
+
+			m_strPending.erase(0, next > 0 ? next - 1 : 0);
+			m_nStart = next > 0 ? 1 : 0;
+			if (pos == size)
+				return;
+		}
+	}
+
+	// buf itself is searched in place
+	size_t next = Process(buf, size, pos, false);
+	if (IsDecided())
+		return;
+
+	size_t erase = next > 0 ? min(next - 1, size) : 0;
+	m_strPending.assign(buf + erase, size - erase);
+	m_nStart = next - erase;
+}
+
+
+// ===============================================================================
+//							CRegexStream::Finish
+// ===============================================================================
+void CRegexStream::Finish()
+{
+	if (!IsDecided())
+		Process(m_strPending.c_str(), m_strPending.length(), m_nStart, true);
+	m_strPending.clear();
+	m_nStart = 0;
+
+	// the count is final now, it is reported before the next stages in the
+	// order of the rules
+	if (m_pNext)
+	{
+		m_Replace.Replaced(m_nCount);
+		m_pNext->Finish();
+	}
+	else
+		m_Replace.SetRegexResult(m_bFound, m_bChanges);
+}
+
+
+// ===============================================================================
+//							CRegexStream::Output
+// ===============================================================================
+void CRegexStream::Output(const char *buf, size_t size)
+{
+	if (m_pNext)
+		m_pNext->Write(buf, size);
+	m_nOutput += size;
+}
+
+
+// ===============================================================================
+//							CRegexStream::Process
+//
+// Replaces the matches in buf from "pos" on and passes the result on.
+// buf[0, pos) is only looked at by the assertions. Unless this is the end of
+// the data, the search stops at the start of a possible match, its position is
+// returned: from there on the bytes are still needed, and one byte before
+// them for the assertions.
+// ===============================================================================
+size_t CRegexStream::Process(const char *buf, size_t size, size_t pos, bool final)
+{
+	while (!IsDecided())
+	{
+		size_t keep = pos;
+		CRegex::ESearch result = pos <= size ? m_Regex.Search(buf, size, pos, final, m_Work, m_vecCaps, keep) : CRegex::enSrNone;
+
+		if (result == CRegex::enSrNone)
+		{
+			if (pos < size)
+				Output(buf + pos, size - pos);
+			pos = size;
+			break;
+		}
+
+		if (result == CRegex::enSrMore)
+		{
+			Output(buf + pos, keep - pos);
+			pos = keep;
+			break;
+		}
+
+		size_t start = m_vecCaps[0];
+		size_t end = m_vecCaps[1];
+		m_bFound = true;
+
+		Output(buf + pos, start - pos);
+
+		m_Regex.Expand(m_Replace.GetWith(), buf, m_vecCaps, m_strWith);
+		if (m_strWith.length() == end - start && memcmp(m_strWith.c_str(), buf + start, end - start) == 0)
+			Output(buf + start, end - start);
+		else
+		{
+			m_bChanges = true;
+			if (m_pPass)
+				m_pPass->Add(m_nOutput, m_strWith.length(), buf + start, end - start);
+			Output(m_strWith.c_str(), m_strWith.length());
+			m_nCount++;
+		}
+
+		// an empty match: the next search starts behind the next byte
+		pos = end;
+		if (end == start)
+		{
+			if (end < size)
+				Output(buf + end, 1);
+			pos = end + 1;
+		}
+	}
+
+	return pos;
+}
+
+
+// ===============================================================================
+//							CReplaceStream::Write
+// ===============================================================================
+void CReplaceStream::Write(const char *buf, size_t size)
+{
+	size_t hold = GetHold();
+	size_t pos = 0;
+
+	// the matches, which start in the pending bytes, end in the first
+	// what_len - 1 bytes of buf
+	if (!m_strPending.empty())
+	{
+		size_t pending = m_strPending.length();
+		size_t head = min(size, hold);
+		m_strPending.append(buf, head);
+
+		size_t len = m_strPending.length();
+		size_t done = Process(m_strPending.c_str(), len, len > hold ? min(len - hold, pending) : 0);
+		if (done < pending)
+		{
+			// buf was too short to decide all of them
+			m_strPending.erase(0, done);
+			return;
+		}
+
+		m_strPending.clear();
+		pos = done - pending;
+	}
+
+	// buf itself is searched in place, only its tail is kept
+	if (pos < size)
+	{
+		size_t len = size - pos;
+		pos += Process(buf + pos, len, len > hold ? len - hold : 0);
+		m_strPending.assign(buf + pos, size - pos);
+	}
+}
+
+
+// ===============================================================================
+//							CReplaceStream::Finish
+// ===============================================================================
+void CReplaceStream::Finish()
+{
+	Process(m_strPending.c_str(), m_strPending.length(), m_strPending.length());
+	m_strPending.clear();
+	m_Replace.Replaced(m_nCount);
+	m_Next.Finish();
+}
+
+
+// ===============================================================================
+//							CReplaceStream::Process
+//
+// Replaces the matches in buf, which start before "end", and passes the
+// result on up to "end", or up to the end of the last match behind it. buf
+// follows the bytes processed so far. Returns the number of bytes processed.
+// ===============================================================================
+size_t CReplaceStream::Process(const char *buf, size_t size, size_t end)
+{
+	const string &what = m_Replace.GetWhatBytes();
+	const string &with = m_Replace.GetWithBytes();
+
+	// the search continues behind a match, as in CReplace::DoReplace
+	size_t src = 0;
+	const char *p;
+	while (src < end && (p = m_Replace.FindWhat(buf + src, size - src, m_nInput + src)) != NULL && (size_t)(p - buf) < end)
+	{
+		size_t match = p - buf;
+		m_Next.Write(buf + src, match - src);
+		m_nOutput += match - src;
+
+		m_Pass.Add(m_nOutput, with.length(), what.c_str(), what.length());
+		m_Next.Write(with.c_str(), with.length());
+		m_nOutput += with.length();
+
+		src = match + what.length();
+		m_nCount++;
+	}
+
+	if (src < end)
+	{
+		m_Next.Write(buf + src, end - src);
+		m_nOutput += end - src;
+		src = end;
+	}
+
+	m_nInput += src;
+	return src;
+}
+
+
+// ===============================================================================
+//							CFileNode::BuildMatcher
+//
+// builds the automaton from the what-strings of all literal replacements,
+// the regular expressions are searched on their own
+// ===============================================================================
+void CFileNode::BuildMatcher()
+{
+	vector<string> patterns;
+	for (auto &it : m_vecReplacements)
+	{
+		if (!it.IsRegex())
+			patterns.push_back(it.GetWhatBytes());
+	}
+
+	shared_ptr<CMultiMatcher> matcher = make_shared<CMultiMatcher>();
+	matcher->Build(patterns);
+	m_pMatcher = matcher;
+	m_pOverlaps = make_shared<CRuleOverlaps>();
+}
+
+
+// ===============================================================================
+//							CFileNode::SetEncoding
+//
+// The replacements are matched in the encoding of the file, so a UTF-16 file
+// is neither converted nor searched any slower. The automaton is built again
+// for the encoded strings, when needed.
+// ===============================================================================
+void CFileNode::SetEncoding(const string &file_name, EEncoding encoding)
+{
+	if (encoding == m_enEncoding)
+		return;
+
+	for (auto &it : m_vecReplacements)
+	{
+		if (it.IsRegex() && encoding != enEncBytes)
+			throw CException(file_name + ": regular expressions can not be used in UTF-16 files!");
+		it.SetEncoding(encoding);
+	}
+
+	m_enEncoding = encoding;
+	m_pMatcher.reset();
+	m_pOverlaps.reset();
+
+	if (g_bVerbose)
+		Print("%s: %s\n", file_name.c_str(), encoding == enEncUtf16LE ? "UTF-16LE" : encoding == enEncUtf16BE ? "UTF-16BE" : "matched as bytes");
+}
+
+
+// ===============================================================================
+//							CFileNode::Add
+//
+// The rules of a file grow by half, not by doubling: with a million rules,
+// the spare capacity during parsing is a large part of the memory.
+// ===============================================================================
+void CFileNode::Add(CReplace r)
+{
+	if (m_vecReplacements.size() == m_vecReplacements.capacity())
+		m_vecReplacements.reserve(m_vecReplacements.size() + m_vecReplacements.size() / 2 + 1);
+
+	m_vecReplacements.push_back(std::move(r));
+	m_pMatcher.reset();
+	m_pOverlaps.reset();
+}
+
+
+// ===============================================================================
+//							CFileNode::AddRules
+//
+// Adds the replacements of a file pattern to a file matched by it. If the
+// file has no other replacements, it shares the automaton and the overlaps
+// of the pattern.
+// Not thread safe, as the automaton of "rules" may be built here.
+// ===============================================================================
+void CFileNode::AddRules(CFileNode &rules)
+{
+	if (!m_vecReplacements.empty())
+	{
+		for (auto &it : rules.m_vecReplacements)
+			Add(it);
+		return;
+	}
+
+	m_vecReplacements = rules.m_vecReplacements;
+	if (m_vecReplacements.size() > MaxSingleSearchReplacements)
+	{
+		if (!rules.m_pMatcher)
+			rules.BuildMatcher();
+		m_pMatcher = rules.m_pMatcher;
+		m_pOverlaps = rules.m_pOverlaps;
+	}
+}
+
+
+// ===============================================================================
+//							CFileNode::GetMatcherKey
+//
+// The what- and with-strings are interned, so their addresses identify the
+// automaton and the overlaps of the literal replacements.
+// ===============================================================================
+string CFileNode::GetMatcherKey() const
+{
+	string key;
+	if (m_pMatcher)
+		return key;
+
+	for (auto &it : m_vecReplacements)
+	{
+		if (!it.IsRegex())
+		{
+			const string *strings[2] = { &it.GetWhat(), &it.GetWith() };
+			key.append((const char *)strings, sizeof(strings));
+		}
+	}
+
+	if (key.length() <= MaxSingleSearchReplacements * 2 * sizeof(const string *))
+		key.clear();
+	return key;
+}
+
+
+// ===============================================================================
+//							CFileNode::ShareMatcher
+// ===============================================================================
+void CFileNode::ShareMatcher(CFileNode &node)
+{
+	if (!node.m_pMatcher)
+		node.BuildMatcher();
+	m_pMatcher = node.m_pMatcher;
+	m_pOverlaps = node.m_pOverlaps;
+}
+
+
+// ===============================================================================
+//							CFileNode::ResetState
+//
+// forgets the results of the check and the replace phase, the rules and the
+// automaton are kept
+// ===============================================================================
+void CFileNode::ResetState()
+{
+	m_bMustReplace	= false;
+	m_bDidReplace	= false;
+	m_pCache.reset();
+	m_State.Reset();
+	m_nWindow		= 0;
+
+	for (auto &it : m_vecReplacements)
+		it.ResetState();
+}
+
+
+// ===============================================================================
+//							CFileNode::GetRulesHash
+//
+// hash of the what-strings of all replacements, in their order. The check
+// phase only depends on these and the file contents, for a regular
+// expression also on the with-string.
+// ===============================================================================
+unsigned long long CFileNode::GetRulesHash() const
+{
+	string rules;
+	for (auto &it : m_vecReplacements)
+	{
+		PutString(rules, it.GetWhat());
+		if (it.IsRegex())
+			PutString(rules, it.GetWith());
+	}
+
+	return HashBuffer(rules.c_str(), rules.length());
+}
+
+
+// ===============================================================================
+//							CFileNode::SpliceMatches
+//
+// Applies the matches found during the check phase to the file contents "buf"
+// in a single pass. This gives the same result as calling DoReplace for each replacement,
+// as long as no replacement can touch the matches of another one, i.e. the
+// matches do not overlap and no "with" string can become part of a match of
+// a later replacement, see CRuleOverlaps. Otherwise NULL is returned and
+// nothing is changed.
+// As the spans do not overlap, they are recorded in "pass" as a single pass.
+// The matches of regular expressions are not kept, so they are never spliced.
+// ===============================================================================
+char *CFileNode::SpliceMatches(const char *buf, size_t &size, CEditPass &pass)
+{
+	vector<CReplace *> replacements;
+	vector<const string *> what, with;		// of all literal replacements
+	vector<char> must;
+	for (auto &it : m_vecReplacements)
+	{
+		if (it.GetMustReplace() && it.IsRegex())
+			return NULL;
+		if (it.IsRegex())
+			continue;
+
+		if (it.GetMustReplace())
+			replacements.push_back(&it);
+		what.push_back(&it.GetWhatBytes());
+		with.push_back(&it.GetWithBytes());
+		must.push_back(it.GetMustReplace());
+	}
+
+	if (!m_pOverlaps)
+		m_pOverlaps = make_shared<CRuleOverlaps>();
+	if (m_pOverlaps->Overlap(what, with, must))
+		return NULL;
+
+	// (offset, index into replacements), sorted by offset
+	vector<pair<size_t, size_t>> spans;
+	vector<size_t> selected;
+	for (size_t i = 0; i < replacements.size(); i++)
+	{
+		selected.clear();
+		replacements[i]->SelectMatches(selected);
+		for (auto pos : selected)
+			spans.push_back(make_pair(pos, i));
+	}
+
+	sort(spans.begin(), spans.end());
+
+	size_t newsize = size;
+	size_t next = 0;
+	for (auto &it : spans)
+	{
+		if (it.first < next)
+			return NULL;	// overlapping matches
+
+		const CReplace *r = replacements[it.second];
+		next = it.first + r->GetWhatBytes().length();
+		newsize = newsize - r->GetWhatBytes().length() + r->GetWithBytes().length();
+	}
+
+	CountAllocation();
+	char *newbuf = (char *)malloc(newsize ? newsize : 1);
+	if (!newbuf)
+		throw CException("out of memory");
+
+	char *dst = newbuf;
+	size_t src = 0;
+	for (auto &it : spans)
+	{
+		const string &what = replacements[it.second]->GetWhatBytes();
+		const string &with = replacements[it.second]->GetWithBytes();
+
+		memcpy(dst, buf + src, it.first - src);
+		dst += it.first - src;
+		pass.Add(dst - newbuf, with.length(), buf + it.first, what.length());
+		memcpy(dst, with.c_str(), with.length());
+		dst += with.length();
+		src = it.first + what.length();
+	}
+	memcpy(dst, buf + src, size - src);
+
+	for (auto r : replacements)
+	{
+		selected.clear();
+		r->SelectMatches(selected);
+		r->Replaced(selected.size());
+	}
+
+	size = newsize;
+	return newbuf;
+}
+
+
+// ===============================================================================
+//							CFileNode::ReplaceAll
+//
+// Performs the replacements one after another on "data", each one on the
+// result of the previous one. Returns the new contents in a malloc'd buffer,
+// the passes of the replacements are appended to "passes".
+// ===============================================================================
+char *CFileNode::ReplaceAll(const char *data, size_t &size, vector<CEditPass> &passes)
+{
+	char *buf = NULL;
+	for (auto &it : m_vecReplacements)
+	{
+		CEditPass pass;
+		char *newbuf = it.DoReplace(data, size, pass);
+		if (newbuf)
+		{
+			free(buf);
+			buf = newbuf;
+			data = newbuf;
+			passes.push_back(pass);
+		}
+	}
+
+	if (!buf)
+	{
+		CountAllocation();
+		buf = (char *)malloc(size ? size : 1);
+		if (!buf)
+			throw CException("out of memory");
+		memcpy(buf, data, size);
+	}
+
+	return buf;
+}
+
+
+// ===============================================================================
+//							CFileNode::ScanStream
+//
+// Streaming mode of CheckReplacements: the file is read in windows of m_nWindow
+// bytes, the last max(what_len) - 1 bytes of a window are searched again with
+// the next one. Sets "found" for each replacement and returns the hash of the
+// file. If "need_hash" is false, reading stops when all what-strings are found.
+// The regular expressions get the windows through a CRegexStream, which
+// stores the result in the replacement.
+// ===============================================================================
+unsigned long long CFileNode::ScanStream(const string &file_name, vector<char> &found, bool need_hash)
+{
+	vector<CReplace *> replacements;		// the literal ones
+	vector<size_t> index;					// their index in m_vecReplacements
+	vector<unique_ptr<CRegexStream>> regex_streams;
+	size_t max_len = 1;
+	size_t i = 0;
+	for (auto &it : m_vecReplacements)
+	{
+		if (it.IsRegex())
+			regex_streams.push_back(unique_ptr<CRegexStream>(new CRegexStream(it, NULL, NULL)));
+		else
+		{
+			replacements.push_back(&it);
+			index.push_back(i);
+			max_len = max(max_len, it.GetWhatBytes().length());
+		}
+		i++;
+	}
+
+	bool search_single = replacements.size() <= MaxSingleSearchReplacements;
+	if (!search_single && !m_pMatcher)
+		BuildMatcher();
+
+	CountOpen();
+	FILE *fh = fopen(file_name.c_str(), "rb");
+	if (!fh)
+		throw CException("can not open file " + file_name);
+
+	vector<char> window(m_nWindow + max_len - 1);
+	char *buf = window.data();
+	size_t carry = 0;
+	size_t offset = 0;		// of buf in the file
+	size_t missing = replacements.size();
+	int state = 0;
+	unsigned long long hash = HashBuffer(NULL, 0);
+
+	auto regex_missing = [&]()
+	{
+		for (auto &it : regex_streams)
+		{
+			if (!it->IsDecided())
+				return true;
+		}
+		return false;
+	};
+
+	size_t len;
+	while ((missing > 0 || need_hash || regex_missing()) && (len = fread(buf + carry, 1, m_nWindow, fh)) > 0)
+	{
+		CountRead(len);
+		hash = HashBuffer(buf + carry, len, hash);
+		size_t size = carry + len;
+
+		for (auto &it : regex_streams)
+			it->Write(buf + carry, len);
+
+		if (missing > 0 && search_single)
+		{
+			for (size_t i = 0; i < replacements.size(); i++)
+			{
+				if (!found[index[i]] && replacements[i]->FindWhat(buf, size, offset))
+				{
+					found[index[i]] = 1;
+					missing--;
+				}
+			}
+		}
+		else if (missing > 0)
+		{
+			// the automaton keeps its state between the windows, the carry is not scanned again
+			size_t pos = carry;
+			m_pMatcher->Scan(buf, size, pos, state, [&](int pattern, size_t match)
+			{
+				if (!found[index[pattern]] && replacements[pattern]->IsAligned(offset + match))
+				{
+					found[index[pattern]] = 1;
+					missing--;
+				}
+				return missing > 0;
+			});
+		}
+
+		carry = min(size, max_len - 1);
+		memmove(buf, buf + size - carry, carry);
+		offset += size - carry;
+	}
+
+	bool failed = ferror(fh) != 0;
+	fclose(fh);
+	if (failed)
+		throw CException("reading file " + file_name + " failed!");
+
+	for (auto &it : regex_streams)
+		it->Finish();
+
+	return hash;
+}
+
+
+// ===============================================================================
+//							CFileNode::StreamReplacements
+//
+// The file is read in windows of "window" bytes and passed through a chain of
+// CReplaceStream or CRegexStream, one for each replacement to perform, into "out". The
+// replaced spans of each replacement are returned in "passes". Returns the
+// hash of the file, its size in "size".
+// ===============================================================================
+unsigned long long CFileNode::StreamReplacements(const string &file_name, size_t window, CStream &out, vector<CEditPass> &passes, size_t &size)
+{
+	vector<CReplace *> replacements;
+	for (auto &it : m_vecReplacements)
+	{
+		if (it.GetMustReplace())
+			replacements.push_back(&it);
+	}
+
+	// the chain is built from its end
+	passes.assign(replacements.size(), CEditPass());
+	vector<unique_ptr<CStream>> chain;
+	CStream *next = &out;
+	for (size_t i = replacements.size(); i-- > 0; )
+	{
+		if (replacements[i]->IsRegex())
+			chain.push_back(unique_ptr<CStream>(new CRegexStream(*replacements[i], &passes[i], next)));
+		else
+			chain.push_back(unique_ptr<CStream>(new CReplaceStream(*replacements[i], passes[i], *next)));
+		next = chain.back().get();
+	}
+
+	unsigned long long hash = StreamFile(file_name, window, next, size);
+	next->Finish();
+	return hash;
+}
+
+
+// ===============================================================================
+//							CFileNode::ReplaceStream
+//
+// Streaming mode of DoReplacments: the result of StreamReplacements is written
+// to a temporary file, which replaces the file at the end.
+// ===============================================================================
+void CFileNode::ReplaceStream(const string &file_name, CJournal &journal)
+{
+	CFileStream out;
+	out.Open(file_name);
+
+	vector<CEditPass> passes;
+	size_t size;
+	unsigned long long hash = StreamReplacements(file_name, m_nWindow, out, passes, size);
+
+	if (size != m_State.m_nSize || hash != m_State.m_nHash)
+		throw CException("the file " + file_name + " was modified since it was scanned!");
+
+	CJournalEntry entry;
+	entry.m_strFileName	= file_name;
+	entry.m_nOldSize	= size;
+	entry.m_nOldHash	= hash;
+	entry.m_nNewSize	= out.GetSize();
+	entry.m_nNewHash	= out.GetHash();
+	for (auto &pass : passes)
+	{
+		if (!pass.IsEmpty())
+			entry.m_vecPasses.push_back(pass);
+	}
+
+	journal.Append(entry);
+	m_bDidReplace = true;
+
+	out.Commit();
+}
+
+
+// ===============================================================================
+//							CFileNode::CanPatch
+//
+// true, if no replacement changes the length, so the file can be patched in
+// place. The length of the matches of a regular expression is not known.
+// ===============================================================================
+bool CFileNode::CanPatch() const
+{
+	for (auto &it : m_vecReplacements)
+	{
+		if (it.GetMustReplace() && (it.IsRegex() || it.GetWhatBytes().length() != it.GetWithBytes().length()))
+			return false;
+	}
+
+	return true;
+}
+
+
+// ===============================================================================
+//							CFileNode::PatchInPlace
+//
+// DoReplacments for replacements which do not change the length: only the
+// changed spans are written into the file. "hash" is the expected hash of the
+// file contents.
+// ===============================================================================
+void CFileNode::PatchInPlace(const string &file_name, unsigned long long hash, CJournal &journal)
+{
+	CPatchStream out;
+	out.Open(file_name);
+
+	vector<CEditPass> passes;
+	size_t size;
+	unsigned long long old_hash = StreamReplacements(file_name, CStream::DefaultWindow, out, passes, size);
+
+	if (size != m_State.m_nSize || old_hash != hash || out.Failed())
+		throw CException("the file " + file_name + " was modified since it was scanned!");
+
+	CJournalEntry entry;
+	entry.m_strFileName	= file_name;
+	entry.m_nOldSize	= size;
+	entry.m_nOldHash	= old_hash;
+	entry.m_nNewSize	= size;
+	entry.m_nNewHash	= out.GetHash();
+	entry.m_bInPlace	= true;
+	entry.m_vecPasses.push_back(out.m_Pass);
+	entry.m_strNew		= out.m_strNew;
+
+	if (g_bVerbose)
+		Print("patching %d spans in place\n", (int)out.m_Pass.m_vecOffset.size());
+
+	journal.Append(entry);
+	m_bDidReplace = true;
+
+	PatchFile(file_name, out.m_Pass, out.m_strNew);
+}
+
+
+// ===============================================================================
+//							SetScanState
+//
+// stores the current state of a file for the scan cache. Returns true, if
+// "check_last" is set and the contents are the same as in the last run.
+// ===============================================================================
+static bool SetScanState(CScanCacheEntry &scan_state, bool check_last, const struct stat &st, unsigned long long hash, unsigned long long rules_hash)
+{
+	bool unchanged = check_last && hash == scan_state.m_nHash;
+
+	// Time stamps within the last seconds are not trusted, the file might
+	// be modified again without changing them.
+	time_t now = time(NULL);
+
+	scan_state.m_bValid		= st.st_mtime < now - 1 && st.st_ctime < now - 1;
+	scan_state.m_nSize		= st.st_size;
+	scan_state.m_tModified	= st.st_mtime;
+	scan_state.m_tChanged	= st.st_ctime;
+	scan_state.m_nInode		= st.st_ino;
+	scan_state.m_nHash		= hash;
+	scan_state.m_nRulesHash	= rules_hash;
+
+	return unchanged;
+}
+
+
+// ===============================================================================
+//							CFileNode::IsUnchanged
+//
+// Incremental mode: true, if the state of the last run applies to the file as
+// long as its contents are the same. So there is nothing to replace.
+// ===============================================================================
+bool CFileNode::IsUnchanged(const CScanCacheEntry &last) const
+{
+	if (!last.m_bValid)
+		return false;
+
+	// a regular expression did not change anything in the last run, if the state is valid
+	for (auto &it : m_vecReplacements)
+	{
+		if (!it.IsRegex() && it.GetWhat() != it.GetWith())
+			return false;
+	}
+
+	return last.m_nRulesHash == GetRulesHash();
+}
+
+
+// ===============================================================================
+//							CFileNode::CheckReplacements
+//
+// checks, if any replacement for this file will occur. If so, the file
+// contents and the matches are kept for DoReplacments, as long as the
+// cache_budget allows.
+// Files larger than "stream_window" are processed in streaming mode.
+// In incremental mode, "scan_state" holds the state of the file from the last
+// run on entry. It is replaced by the current state, which is only valid, if
+// nothing is to be replaced in the file.
+// "prefetched" is the file as read by CBatchReader, if it was.
+// ===============================================================================
+bool CFileNode::CheckReplacements(const string &file_name, atomic<size_t> &cache_budget, size_t stream_window, CScanCacheEntry *scan_state,
+								  const CBatchReader::SFile *prefetched)
+{
+	if (g_bVerbose)
+		Print("\nchecking file %s\n", file_name.c_str());
+
+	struct stat st;
+	if (prefetched)
+		st = prefetched->m_Stat;
+	else if (stat(file_name.c_str(), &st) != 0)
+		throw CException("stat failed for file " + file_name);
+
+	// In incremental mode, the file is skipped if nothing was to be replaced in
+	// the last run, the what-strings are the same and the file was not touched
+	// since then. If only the time stamps differ, the contents are compared.
+	bool check_last = false;
+	if (scan_state)
+	{
+		CScanCacheEntry &last = *scan_state;
+		check_last = IsUnchanged(last) && last.m_nSize == (size_t)st.st_size;
+
+		if (check_last && last.m_tModified == st.st_mtime && last.m_tChanged == st.st_ctime && last.m_nInode == (unsigned long long)st.st_ino)
+		{
+			if (g_bVerbose)
+				Print("%s: unchanged since the last run\n", file_name.c_str());
+			return false;
+		}
+	}
+
+	// Files larger than the window are never read as a whole
+	if (stream_window > 0 && (size_t)st.st_size > stream_window)
+	{
+		m_nWindow = stream_window;
+		SetEncoding(file_name, DetectFileEncoding(file_name, st.st_size));
+
+		bool need_hash = scan_state != NULL;
+		for (auto &it : m_vecReplacements)
+		{
+			if (it.IsRegex() || it.GetWhat() != it.GetWith())
+				need_hash = true;
+		}
+
+		vector<char> found(m_vecReplacements.size(), 0);
+		unsigned long long hash = ScanStream(file_name, found, need_hash);
+
+		if (scan_state && SetScanState(*scan_state, check_last, st, hash, GetRulesHash()))
+		{
+			if (g_bVerbose)
+				Print("%s: contents unchanged since the last run\n", file_name.c_str());
+			return false;
+		}
+
+		size_t i = 0;
+		for (auto &it : m_vecReplacements)
+		{
+			bool must_replace = it.IsRegex() ? it.CheckReplace(file_name, it.GetRegexFound(), it.GetRegexChanges()) : it.CheckReplace(file_name, found[i] != 0);
+			if (must_replace)
+				m_bMustReplace = true;
+			i++;
+		}
+
+		if (scan_state && m_bMustReplace)
+			scan_state->m_bValid = false;
+
+		m_State.Set(st, hash);
+		return m_bMustReplace;
+	}
+
+	// Datei in den Speicher lesen
+	shared_ptr<CFileBuffer> file = prefetched ? prefetched->m_pBuffer : nullptr;
+	if (!file)
+	{
+		file = make_shared<CFileBuffer>();
+		file->Open(file_name);
+	}
+
+	const char *buf = file->GetData();
+	size_t size = file->GetSize();
+
+	if (scan_state && SetScanState(*scan_state, check_last, st, HashBuffer(buf, size), GetRulesHash()))
+	{
+		if (g_bVerbose)
+			Print("%s: contents unchanged since the last run\n", file_name.c_str());
+		return false;
+	}
+
+	SetEncoding(file_name, DetectEncoding(buf, size, size));
+
+	// the literal replacements, the regular expressions are searched on their own
+	vector<CReplace *> replacements;
+	for (auto &it : m_vecReplacements)
+	{
+		if (it.IsRegex())
+			it.ScanRegex(buf, size);
+		else
+			replacements.push_back(&it);
+	}
+
+	vector<char> found(replacements.size(), 0);
+	size_t pos = 0;
+	int state = 0;
+
+	// For a few what-strings, a vectorized search per string is faster than a
+	// single pass with the automaton.
+	bool search_single = replacements.size() <= MaxSingleSearchReplacements;
+	if (search_single)
+	{
+		for (size_t i = 0; i < replacements.size(); i++)
+		{
+			const char *match = replacements[i]->FindWhat(buf, size);
+			if (match)
+			{
+				replacements[i]->AddMatch(match - buf);
+				found[i] = 1;
+			}
+		}
+	}
+	else
+	{
+		// Alle what-strings in einem einzigen Durchlauf suchen
+		if (!m_pMatcher)
+			BuildMatcher();
+
+		size_t missing = found.size();
+		m_pMatcher->Scan(buf, size, pos, state, [&](int pattern, size_t offset)
+		{
+			if (!replacements[pattern]->IsAligned(offset))
+				return true;
+
+			replacements[pattern]->AddMatch(offset);
+			if (!found[pattern])
+			{
+				found[pattern] = 1;
+				missing--;
+			}
+			return missing > 0;
+		});
+	}
+
+	// Dann testen, ob ein Replacement durchgef�hrt wird, Replacements anzeigen.
+	size_t i = 0;
+	for (auto &it : m_vecReplacements)
+	{
+		bool must_replace = it.IsRegex() ? it.CheckReplace(file_name, it.GetRegexFound(), it.GetRegexChanges()) : it.CheckReplace(file_name, found[i++] != 0);
+		if (must_replace)
+			m_bMustReplace = true;
+	}
+
+	// the file will be written, its state must not be kept
+	if (scan_state && m_bMustReplace)
+		scan_state->m_bValid = false;
+
+	if (!m_bMustReplace)
+	{
+		ClearMatches();
+		return false;
+	}
+
+	m_State.Set(st, scan_state ? scan_state->m_nHash : HashBuffer(buf, size));
+
+	size_t budget = cache_budget;
+	while (size <= budget && !cache_budget.compare_exchange_weak(budget, budget - size))
+		;
+
+	if (size <= budget)
+	{
+		// keep the file for DoReplacments, the rest of the file must be scanned for all matches then
+		if (search_single)
+		{
+			for (size_t i = 0; i < replacements.size(); i++)
+			{
+				if (!found[i])
+					continue;
+
+				const char *match = buf + replacements[i]->GetMatches().back();
+				while ((match = replacements[i]->FindWhat(match + 1, buf + size - match - 1, match + 1 - buf)) != NULL)
+					replacements[i]->AddMatch(match - buf);
+			}
+		}
+		else
+		{
+			m_pMatcher->Scan(buf, size, pos, state, [&](int pattern, size_t offset)
+			{
+				if (replacements[pattern]->IsAligned(offset))
+					replacements[pattern]->AddMatch(offset);
+				return true;
+			});
+		}
+
+		m_pCache = file;
+		return true;
+	}
+
+	for (auto &it : m_vecReplacements)
+		it.ClearMatches();
+
+	return true;
+}
+
+
+// ===============================================================================
+//							GetFileTimes
+//
+// the modification and the status change time of a file in ns, as precise as
+// the platform reports them
+// ===============================================================================
+static void GetFileTimes(const struct stat &st, long long &modified, long long &changed)
+{
+#if defined(WIN32)
+	modified	= (long long)st.st_mtime * 1000000000;
+	changed		= (long long)st.st_ctime * 1000000000;
+#elif defined(__APPLE__)
+	modified	= (long long)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+	changed		= (long long)st.st_ctimespec.tv_sec * 1000000000 + st.st_ctimespec.tv_nsec;
+#else
+	modified	= (long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	changed		= (long long)st.st_ctim.tv_sec * 1000000000 + st.st_ctim.tv_nsec;
+#endif
+}
+
+
+// ===============================================================================
+//							CFileState::Set
+//
+// remembers the state of the file at check time, see IsModified
+// ===============================================================================
+void CFileState::Set(const struct stat &st, unsigned long long hash)
+{
+	m_nSize		= st.st_size;
+	m_nInode	= st.st_ino;
+	m_nHash		= hash;
+	GetFileTimes(st, m_tModified, m_tChanged);
+}
+
+
+// ===============================================================================
+//							CFileState::IsModified
+//
+// true, if the file was changed since the check phase. The time stamps may be
+// too coarse to show a change made right after the check, so the kept contents
+// are compared by their hash as well: a mapping shows the current contents,
+// a copy is replaced by the file read again. Contents which were not kept are
+// compared by their hash when they are read for the replacement.
+// ===============================================================================
+bool CFileState::IsModified(const string &file_name, const struct stat &st, shared_ptr<CFileBuffer> &contents) const
+{
+	long long modified, changed;
+	GetFileTimes(st, modified, changed);
+
+	if ((size_t)st.st_size != m_nSize || (unsigned long long)st.st_ino != m_nInode || modified != m_tModified || changed != m_tChanged)
+		return true;
+
+	if (!contents)
+		return false;
+
+	if (!contents->IsMapped())
+	{
+		shared_ptr<CFileBuffer> file = make_shared<CFileBuffer>();
+		file->Open(file_name);
+		contents = file;
+	}
+
+	return HashBuffer(contents->GetData(), contents->GetSize()) != m_nHash;
+}
+
+
+// ===============================================================================
+//							CFileNode::Rescan
+//
+// The file was changed after the check phase: the results of the check are
+// dropped and the file is checked again. The new contents are kept for the
+// replacement regardless of the cache budget, they are read as a whole anyway.
+// ===============================================================================
+void CFileNode::Rescan(const string &file_name)
+{
+	if (g_bVerbose)
+		Print("%s was modified since it was scanned, checking it again\n", file_name.c_str());
+
+	size_t window = m_nWindow;
+	ResetState();
+
+	atomic<size_t> budget(SIZE_MAX);
+	CheckReplacements(file_name, budget, window);
+}
+
+
+// ===============================================================================
+//							CFileNode::DoReplacments
+//
+// performs all replacements for this file. The edits are appended to the
+// journal before the file is written.
+// ===============================================================================
+void CFileNode::DoReplacments(const string &file_name, CJournal &journal)
+{
+	if (m_bMustReplace)
+	{
+		if (g_bVerbose)
+			Print("\nreplacing in file %s\n", file_name.c_str());
+
+		struct stat st;
+		if (stat(file_name.c_str(), &st) != 0)
+			throw CException("stat failed for file " + file_name);
+
+		// the check is repeated on the current contents, they might not need
+		// any replacement now
+		if (m_State.IsModified(file_name, st, m_pCache))
+		{
+			Rescan(file_name);
+			if (!m_bMustReplace)
+				return;
+
+			if (stat(file_name.c_str(), &st) != 0)
+				throw CException("stat failed for file " + file_name);
+		}
+
+		// replacements which keep the length are written in place
+		if (CanPatch() && (st.st_mode & S_IFMT) == S_IFREG)
+		{
+			m_pCache.reset();
+			PatchInPlace(file_name, m_State.m_nHash, journal);
+			return;
+		}
+
+		if (m_nWindow > 0)
+		{
+			ReplaceStream(file_name, journal);
+			return;
+		}
+
+		shared_ptr<CFileBuffer> file;
+		size_t size;
+		CJournalEntry entry;
+		char *buf = ReplaceContents(file_name, file, size, entry);
+
+		// the file must not be mapped any more, when it is written
+		file.reset();
+
+		journal.Append(entry);
+		m_bDidReplace = true;
+
+		// Datei schreiben
+		try
+		{
+			WriteFileContents(file_name, buf, size);
+		}
+		catch (...)
+		{
+			free(buf);
+			throw;
+		}
+
+		free(buf);
+	}
+}
+
+
+// ===============================================================================
+//							CFileNode::ReplaceContents
+//
+// Returns the new contents of the file in a malloc'd buffer and fills "entry"
+// for them. The old contents are taken from the check phase or read again,
+// they are returned in "file".
+// ===============================================================================
+char *CFileNode::ReplaceContents(const string &file_name, shared_ptr<CFileBuffer> &file, size_t &size, CJournalEntry &entry)
+{
+	file = m_pCache;
+	m_pCache.reset();
+
+	char *buf = NULL;		// the new contents
+	entry.m_strFileName = file_name;
+
+	if (file)
+	{
+		// file contents and matches are known from the check phase
+		size = file->GetSize();
+
+		CEditPass pass;
+		buf = SpliceMatches(file->GetData(), size, pass);
+		if (buf)
+			entry.m_vecPasses.push_back(pass);
+	}
+	else
+	{
+		// Datei in den Speicher lesen
+		file = make_shared<CFileBuffer>();
+		file->Open(file_name);
+		size = file->GetSize();
+
+		if (HashBuffer(file->GetData(), size) != m_State.m_nHash)
+			throw CException("the file " + file_name + " was modified since it was scanned!");
+	}
+
+	entry.m_nOldHash = m_State.m_nHash;
+	entry.m_nOldSize = file->GetSize();
+
+	ClearMatches();
+
+	// Replacements durchf�hren
+	if (!buf)
+		buf = ReplaceAll(file->GetData(), size, entry.m_vecPasses);
+
+	// A mapping is no snapshot, it shows a change of the file made meanwhile.
+	// The replacements must have been made on the contents of the check phase.
+	if (file->IsMapped() && HashBuffer(file->GetData(), file->GetSize()) != m_State.m_nHash)
+	{
+		free(buf);
+		throw CException("the file " + file_name + " was modified since it was scanned!");
+	}
+
+	entry.m_nNewSize = size;
+	entry.m_nNewHash = HashBuffer(buf, size);
+	return buf;
+}
+
+
+// ===============================================================================
+//										ComposePasses
+//
+// Combines the passes, which turned "old_buf" into "new_buf", into a single
+// pass. A span of a pass, which overlaps or touches a span of an earlier pass,
+// is merged with it. The new bytes of the spans are appended to "new_bytes".
+// ===============================================================================
+static void ComposePasses(const vector<CEditPass> &passes, const char *old_buf, const char *new_buf, CEditPass &result, string &new_bytes)
+{
+	struct SSpan
+	{
+		long long	m_nOffset;		// in old_buf
+		long long	m_nOldLength;
+		long long	m_nLength;		// in the output of the passes so far
+	};
+
+	vector<SSpan> spans;		// ascending, in old_buf and in the output
+	vector<SSpan> next;
+	for (auto &pass : passes)
+	{
+		// The spans of the pass are in its output, the spans so far in its input.
+		// Positions in the input behind spans[0..i) are old_buf positions + shift.
+		next.clear();
+		size_t i = 0;
+		long long shift = 0;
+		long long pass_shift = 0;		// output - input of the pass behind its spans so far
+
+		bool open = false;				// a merged span is being built
+		long long start = 0;			// the merged span in the input of the pass
+		long long end = 0;
+		long long old_start = 0;
+		long long change = 0;			// its change of length by the pass
+
+		auto flush = [&]()
+		{
+			SSpan span;
+			span.m_nOffset		= old_start;
+			span.m_nOldLength	= end - shift - old_start;
+			span.m_nLength		= end - start + change;
+			next.push_back(span);
+			open = false;
+		};
+
+		for (size_t k = 0; k < pass.m_vecOffset.size(); k++)
+		{
+			long long a = (long long)pass.m_vecOffset[k] - pass_shift;
+			long long b = a + (long long)pass.m_vecOldLength[k];
+			long long delta = (long long)pass.m_vecNewLength[k] - (long long)pass.m_vecOldLength[k];
+			pass_shift += delta;
+
+			if (open && a > end)
+				flush();
+
+			if (!open)
+			{
+				while (i < spans.size() && spans[i].m_nOffset + shift + spans[i].m_nLength < a)
+				{
+					shift += spans[i].m_nLength - spans[i].m_nOldLength;
+					next.push_back(spans[i++]);
+				}
+
+				open		= true;
+				start		= a;
+				end			= b;
+				old_start	= a - shift;
+				change		= 0;
+			}
+
+			end = max(end, b);
+			change += delta;
+
+			// the spans of earlier passes overlapping or touching the merged span
+			while (i < spans.size() && spans[i].m_nOffset + shift <= end)
+			{
+				long long s = spans[i].m_nOffset + shift;
+				if (s < start)
+				{
+					start = s;
+					old_start = spans[i].m_nOffset;
+				}
+				end = max(end, s + spans[i].m_nLength);
+				shift += spans[i].m_nLength - spans[i].m_nOldLength;
+				i++;
+			}
+		}
+
+		if (open)
+			flush();
+		while (i < spans.size())
+			next.push_back(spans[i++]);
+
+		spans.swap(next);
+	}
+
+	long long shift = 0;
+	for (auto &it : spans)
+	{
+		size_t offset = (size_t)(it.m_nOffset + shift);
+		result.Add(offset, (size_t)it.m_nLength, old_buf + it.m_nOffset, (size_t)it.m_nOldLength);
+		new_bytes.append(new_buf + offset, (size_t)it.m_nLength);
+		shift += it.m_nLength - it.m_nOldLength;
+	}
+}
+
+
+// ===============================================================================
+//							CFileNode::PlanReplacements
+//
+// Plan mode: fills "entry" with the replacements of the file as a single
+// pass and its new bytes, see class CJournal. Nothing is written. Returns
+// false, if nothing is to be replaced. A file, which is processed in windows
+// otherwise, is read as a whole.
+// ===============================================================================
+bool CFileNode::PlanReplacements(const string &file_name, CJournalEntry &entry)
+{
+	if (!m_bMustReplace)
+		return false;
+
+	if (g_bVerbose)
+		Print("\nplanning file %s\n", file_name.c_str());
+
+	shared_ptr<CFileBuffer> file;
+	size_t size;
+	char *buf = ReplaceContents(file_name, file, size, entry);
+
+	CEditPass pass;
+	ComposePasses(entry.m_vecPasses, file->GetData(), buf, pass, entry.m_strNew);
+	entry.m_vecPasses.assign(1, pass);
+
+	free(buf);
+	m_bDidReplace = true;
+	return true;
+}
+
+
+// ===============================================================================
+//							CFileNode::ClearMatches
+// ===============================================================================
+void CFileNode::ClearMatches()
+{
+	for (auto &it : m_vecReplacements)
+		it.ClearMatches();
+}
+
+
+// ===============================================================================
+//							CFileNode::FindMatches
+//
+// Matrix mode: finds all matches of the replacements of "nodes", which are
+// the nodes of the same file in several configurations, in a single pass.
+// Each distinct what-string is searched once, no matter how many
+// configurations replace it.
+// ===============================================================================
+void CFileNode::FindMatches(const string &file_name, const char *buf, size_t size, const vector<CFileNode *> &nodes)
+{
+	vector<string> patterns;
+	vector<vector<CReplace *>> users;		// the replacements of each pattern
+	unordered_map<string, size_t> index;
+
+	EEncoding encoding = DetectEncoding(buf, size, size);
+	for (auto node : nodes)
+	{
+		node->SetEncoding(file_name, encoding);
+		for (auto &it : node->m_vecReplacements)
+		{
+			it.ClearMatches();
+			if (it.IsRegex())
+			{
+				it.ScanRegex(buf, size);
+				continue;
+			}
+
+			auto ins = index.emplace(it.GetWhatBytes(), patterns.size());
+			if (ins.second)
+			{
+				patterns.push_back(it.GetWhatBytes());
+				users.emplace_back();
+			}
+			users[ins.first->second].push_back(&it);
+		}
+	}
+
+	vector<vector<size_t>> matches(patterns.size());
+	if (patterns.size() <= MaxSingleSearchReplacements)
+	{
+		for (size_t i = 0; i < patterns.size(); i++)
+		{
+			const char *match = FindPattern(buf, size, patterns[i]);
+			while (match)
+			{
+				matches[i].push_back(match - buf);
+				match = FindPattern(match + 1, buf + size - match - 1, patterns[i]);
+			}
+		}
+	}
+	else
+	{
+		CMultiMatcher matcher;
+		matcher.Build(patterns);
+
+		size_t pos = 0;
+		int state = 0;
+		matcher.Scan(buf, size, pos, state, [&](int pattern, size_t offset)
+		{
+			matches[pattern].push_back(offset);
+			return true;
+		});
+	}
+
+	for (size_t i = 0; i < patterns.size(); i++)
+	{
+		for (auto r : users[i])
+		{
+			for (auto pos : matches[i])
+			{
+				if (r->IsAligned(pos))
+					r->AddMatch(pos);
+			}
+		}
+	}
+}
+
+
+// ===============================================================================
+//							CFileNode::CheckMatches
+//
+// checks, if any replacement will occur, after FindMatches
+// ===============================================================================
+bool CFileNode::CheckMatches(const string &file_name)
+{
+	for (auto &it : m_vecReplacements)
+	{
+		bool must_replace = it.IsRegex() ? it.CheckReplace(file_name, it.GetRegexFound(), it.GetRegexChanges()) : it.CheckReplace(file_name, !it.GetMatches().empty());
+		if (must_replace)
+			m_bMustReplace = true;
+	}
+
+	return m_bMustReplace;
+}
+
+
+// ===============================================================================
+//							CFileNode::WriteResult
+//
+// Matrix mode: writes the contents "buf" of the file with the replacements of
+// this node to "out_name". The file itself is not changed, so neither a
+// journal nor a backup is needed. The matches must have been found by
+// FindMatches.
+// ===============================================================================
+void CFileNode::WriteResult(const char *buf, size_t size, const string &out_name)
+{
+	if (g_bVerbose)
+		Print("\nwriting file %s\n", out_name.c_str());
+
+	char *newbuf = NULL;
+	if (m_bMustReplace)
+	{
+		CEditPass pass;
+		newbuf = SpliceMatches(buf, size, pass);
+	}
+
+	ClearMatches();
+
+	if (!newbuf)
+	{
+		vector<CEditPass> passes;
+		newbuf = ReplaceAll(buf, size, passes);
+	}
+
+	m_bDidReplace = m_bMustReplace;
+
+	try
+	{
+		CreateParentDirectories(out_name);
+		WriteFileContents(out_name, newbuf, size);
+	}
+	catch (...)
+	{
+		free(newbuf);
+		throw;
+	}
+
+	free(newbuf);
+}
+
+
+// ===============================================================================
+//							CAutoVersion::SkipWhiteSpaces
+// ===============================================================================
+void CAutoVersion::SkipWhiteSpaces(char *&p)
+{
+	while (*p == ' ' || *p == '\t')
+		p++;
+}
+
+
+// ===============================================================================
+//								CAutoVersion::SkipLine
+// 
+// only_white_spaces: if true, only white spaces and comments may appear
+// ===============================================================================
+void CAutoVersion::SkipLine(char *&p, bool only_white_spaces)
+{
+	bool is_comment = false;
+
+	while (*p && *p != '\012' && *p != '\015')
+	{
+		if (*p == '#')
+			is_comment = true;
+
+		if (only_white_spaces && !is_comment && *p != ' ' && *p != '\t')
+		{
+			char c = *p;
+			throw CParseException((string)"unexpected character '" + c + 
+				(string)"'. Expected white-space or newline while scanning for end of line", m_nCurrentLine);
+		}
+
+		p++;
+	}
+
+	if (*p)
+		m_nCurrentLine++;
+
+	if (*p == '\015')	// Dos / Windows: 0x0d / 0x0a sequence
+		p++;
+
+	if (*p)
+		p++;
+}
+
+
+// ===============================================================================
+//								CAutoVersion::SkipComment
+// ===============================================================================
+void CAutoVersion::SkipComment(char *&p)
+{
+	while (*p && *p != '\012' && *p != '\015')
+		p++;
+}
+
+
+// ===============================================================================
+//								CAutoVersion::Scan
+//
+// Search for given string at the *beginning* of a new line.
+// ===============================================================================
+void CAutoVersion::Scan(char *&p, const char *token)
+{
+	size_t token_len = strlen(token);
+
+	while (*p)
+	{
+		SkipLine(p, false);
+
+		SkipWhiteSpaces(p);
+		if (strncmp(p, token, token_len) == 0)
+			return;
+	}
+}
+
+
+// ===============================================================================
+//							CAutoVersion::GetIdentifier
+//
+// The tokens returned by the parser point into m_pBuffer, nothing is copied.
+// ===============================================================================
+string_view CAutoVersion::GetIdentifier(char *&p)
+{
+	SkipWhiteSpaces(p);
+
+	char *start = p;
+	while (*p && *p != ' ' && *p != '\t' && *p != '\012' && *p != '\015')
+		p++;
+
+	if (p == start)
+		throw CParseException("expected identifier", m_nCurrentLine);
+
+	return string_view(start, p - start);
+}
+
+
+// ===============================================================================
+//							CAutoVersion::GetLiteral
+//
+// returns the position of the literal in "offset". Escaped " and backslashes
+// are not decoded, see Unescape.
+// ===============================================================================
+string_view CAutoVersion::GetLiteral(char *&p, size_t *offset)
+{
+	SkipWhiteSpaces(p);
+
+	if (*p++ != '"')
+		throw CParseException("\" expected", m_nCurrentLine);
+
+	if (offset)
+		*offset = (p - m_pBuffer);
+
+	char *start = p;
+	while (*p && *p != '"' && *p != '\012' && *p != '\015')
+	{
+		if (*p == '\\' && (*(p + 1) == '"' || *(p + 1) == '\\'))	// this is an escaped " or backslash
+			p++;
+		p++;
+	}
+
+	string_view literal(start, p - start);
+
+	if (*p++ != '"')
+		throw CParseException("missing \"", m_nCurrentLine);
+
+	if (literal.empty())
+		throw CParseException("empty literal not allowed", m_nCurrentLine);
+
+	return literal;
+}
+
+
+// ===============================================================================
+//										Unescape
+//
+// decodes the escaped " and backslashes of a literal
+// ===============================================================================
+static string Unescape(string_view literal)
+{
+	if (literal.find('\\') == string_view::npos)
+		return string(literal);
+
+	string s;
+	s.reserve(literal.length());
+	for (size_t i = 0; i < literal.length(); i++)
+	{
+		if (literal[i] == '\\' && i + 1 < literal.length() && (literal[i + 1] == '"' || literal[i + 1] == '\\'))
+			i++;
+		s += literal[i];
+	}
+
+	return s;
+}
+
+
+// ===============================================================================
+//										Escape
+//
+// the inverse of Unescape: writes "value" to "dst" as it is written within a
+// literal of the Control File. "dst" must hold EscapedLength(value) bytes.
+// Returns the end of the written bytes.
+// ===============================================================================
+static size_t EscapedLength(const string &value)
+{
+	size_t len = value.length();
+	for (char c : value)
+	{
+		if (c == '"' || c == '\\')
+			len++;
+	}
+
+	return len;
+}
+
+static char *Escape(char *dst, const string &value)
+{
+	for (char c : value)
+	{
+		if (c == '"' || c == '\\')
+			*dst++ = '\\';
+		*dst++ = c;
+	}
+
+	return dst;
+}
+
+
+// ===============================================================================
+//										MatchLiteral
+//
+// checks, if the literal in the Control File starting at "p" (behind the
+// opening ") decodes to "value". Returns its length in the Control File,
+// 0 if it does not match.
+// ===============================================================================
+static size_t MatchLiteral(const char *p, const char *end, const string &value)
+{
+	const char *start = p;
+	size_t i = 0;
+
+	while (p < end && *p != '"' && *p != '\012' && *p != '\015')
+	{
+		if (*p == '\\' && p + 1 < end && (*(p + 1) == '"' || *(p + 1) == '\\'))	// this is an escaped " or backslash
+			p++;
+
+		if (i >= value.length() || value[i] != *p)
+			return 0;
+		i++;
+		p++;
+	}
+
+	return i == value.length() && p < end && *p == '"' ? p - start : 0;
+}
+
+
+// ===============================================================================
+//							CAutoVersion::FindConstant
+//
+// returns the value of a constant, NULL if it is not defined
+// ===============================================================================
+const string *CAutoVersion::FindConstant(const CConfiguration &config, string_view ident)
+{
+	m_strKey.assign(ident.data(), ident.length());
+
+	auto it = config.m_mapConstantDefs.find(m_strKey);
+	return it != config.m_mapConstantDefs.end() ? &it->second : NULL;
+}
+
+
+// ===============================================================================
+//							CAutoVersion::ParseConstantDef
+//
+// The value is either a literal or the name of another constant.
+// ===============================================================================
+void CAutoVersion::ParseConstantDef(char *&p)
+{
+	string_view ident = GetIdentifier(p);
+
+	SkipWhiteSpaces(p);
+	bool is_literal = *p == '"';
+	string literal;
+	string_view symbol;
+	if (is_literal)
+		literal = Unescape(GetLiteral(p));
+	else
+		symbol = GetIdentifier(p);
+
+	ForEachActive([&](CConfiguration &config)
+	{
+		string what = literal;
+		if (!is_literal)
+		{
+			const string *value = FindConstant(config, symbol);
+			if (!value)
+				throw CParseException("symbol " + string(symbol) + " undefined", m_nCurrentLine);
+			what = *value;
+		}
+
+		if (FindConstant(config, ident))
+			throw CParseException("duplicate symbol " + string(ident), m_nCurrentLine);
+
+		config.m_mapConstantDefs.emplace(string(ident), std::move(what));
+	});
+}
+
+
+// ===============================================================================
+//							CAutoVersion::ParseReplacement
+// ===============================================================================
+void CAutoVersion::ParseReplacement(EReplaceOp op, char *&p)
+{
+	size_t offset;
+	string_view file_name = GetLiteral(p);		// file name
+	string_view what = GetLiteral(p, &offset);	// what to replace
+
+	SkipWhiteSpaces(p);
+	if (*p != '@')
+		throw CParseException("@ symbol missing", m_nCurrentLine);
+
+	string_view ident = GetIdentifier(++p);		// get replace with (this is a constant name)
+
+	const string *what_str = m_StringPool.Intern(Unescape(what));
+	string file = Unescape(file_name);
+
+	// a regular expression is compiled once for all files and configurations
+	shared_ptr<const CRegex> regex;
+	if (op == enRoRegex)
+	{
+		try
+		{
+			regex = make_shared<const CRegex>(*what_str);
+		}
+		catch (CException &e)
+		{
+			throw CParseException(e.what(), m_nCurrentLine);
+		}
+	}
+
+	ForEachActive([&](CConfiguration &config)
+	{
+		// get the value of the constant
+		const string *with = FindConstant(config, ident);
+		if (!with)
+			throw CParseException("constant '" + string(ident) + "' not found", m_nCurrentLine);
+
+		if (op == enRoBinary && what_str->length() != with->length())
+			throw CParseException("for binary replacements the length of the find string must be equal to the length of the replace string", m_nCurrentLine);
+
+		if (regex && CRegex::GetMaxReference(*with) > regex->GetGroups())
+			throw CParseException("constant '" + string(ident) + "' refers to a group the regular expression does not have", m_nCurrentLine);
+
+		if (!CGlob::IsPattern(file))
+		{
+			config.m_mapFiles[file].Add(CReplace(op, what_str, m_StringPool.Intern(*with), offset, regex));
+			return;
+		}
+
+		// the files matching a pattern are known after the parsing, see ExpandPatterns
+		auto it = find_if(config.m_vecPatterns.begin(), config.m_vecPatterns.end(),
+						  [&](const pair<string, CFileNode> &entry) { return entry.first == file; });
+		if (it == config.m_vecPatterns.end())
+			it = config.m_vecPatterns.insert(it, make_pair(file, CFileNode()));
+
+		it->second.Add(CReplace(op, what_str, m_StringPool.Intern(*with), offset, regex));
+	});
+}
+
+
+// ===============================================================================
+//							CAutoVersion::ParseMessage
+// ===============================================================================
+void CAutoVersion::ParseMessage(char *&p)
+{
+	char *start = p;
+	while (*p && *p != '\012' && *p != '\015')
+		p++;
+
+	ForEachActive([&](CConfiguration &config)
+	{
+		config.m_listMessages.emplace_back(start, p - start);
+	});
+}
+
+
+// ===============================================================================
+//										IsToken
+//
+// true, if p starts with the token, and not only with its first characters
+// like "%endgroup" with "%end"
+// ===============================================================================
+static bool IsToken(const char *p, const char *token)
+{
+	size_t len = strlen(token);
+	return strncmp(p, token, len) == 0 && (!p[len] || strchr(" \t\012\015", p[len]));
+}
+
+
+// ===============================================================================
+//							CAutoVersion::SkipBlock
+//
+// skips the lines of a conditional block, which applies to no configuration,
+// until the matching %end token, or %else token if "stop_at_else" is set.
+// Returns true, if it stopped at %else.
+// ===============================================================================
+bool CAutoVersion::SkipBlock(char *&p, bool stop_at_else)
+{
+	int if_count = 1;
+
+	while (if_count > 0)
+	{
+		// search next command token
+		Scan(p, "%");
+		if (!*p)
+			throw CParseException("missing %end token for if-token", m_nCurrentLine);
+
+		if (IsToken(p, "%if"))
+		{
+			if_count++;
+			p += 3;
+		}
+		else if (stop_at_else && IsToken(p, "%else"))
+		{
+			p += 5;
+			if (if_count == 1)
+				return true;
+		}
+		else if (IsToken(p, "%end"))
+		{
+			if_count--;
+			p += 4;
+		}
+		else
+			p++;
+	}
+
+	return false;
+}
+
+
+// ===============================================================================
+//							CAutoVersion::ParseCommand
+//
+// In matrix mode, the branches of an %if block are parsed for the
+// configurations they apply to. A branch which applies to none is skipped.
+// ===============================================================================
+void CAutoVersion::ParseCommand(char *&p)
+{
+	string_view ident = GetIdentifier(p);
+
+	if (ident == "Basepath")
+	{
+		string base_path = Unescape(GetLiteral(p));
+
+		ForEachActive([&](CConfiguration &config)
+		{
+			if (!config.m_strBasePath.empty())
+				throw CParseException("basepath already defined", m_nCurrentLine);
+
+			config.m_strBasePath = base_path;
+		});
+	}
+	else if (ident == "if")
+	{
+		m_strKey.assign(GetIdentifier(p));
+
+		unsigned long long condition = 0;
+		bool common = m_setDefines.find(m_strKey) != m_setDefines.end();
+		for (size_t i = 0; i < m_vecConfigs.size(); i++)
+		{
+			if (common || m_vecConfigs[i].m_setDefines.find(m_strKey) != m_vecConfigs[i].m_setDefines.end())
+				condition |= 1ULL << i;
+		}
+
+		m_vecIfStack.push_back(make_pair(m_nActive, condition));
+		m_nActive &= condition;
+
+		if (!m_nActive)
+		{
+			// condition failed for all configurations, search matching %else or %end token
+			unsigned long long parent = m_vecIfStack.back().first;
+			if (SkipBlock(p, true))
+				m_nActive = parent & ~condition;
+			else
+			{
+				m_nActive = parent;
+				m_vecIfStack.pop_back();
+			}
+		}
+	}
+	else if (ident == "else")
+	{
+		unsigned long long parent = m_nActive;
+		if (!m_vecIfStack.empty())
+		{
+			parent = m_vecIfStack.back().first;
+			m_nActive = parent & ~m_vecIfStack.back().second;
+		}
+		else
+			m_nActive = 0;
+
+		if (!m_nActive)
+		{
+			// skip until matching %end token
+			SkipBlock(p, false);
+			m_nActive = parent;
+			if (!m_vecIfStack.empty())
+				m_vecIfStack.pop_back();
+		}
+	}
+	else if (ident == "end")
+	{
+		if (!m_vecIfStack.empty())
+		{
+			m_nActive = m_vecIfStack.back().first;
+			m_vecIfStack.pop_back();
+		}
+	}
+	else if (ident == "shell")
+	{
+		// get the shell command-string
+		string arg = Unescape(GetLiteral(p));
+
+		// Create the delayed command
+		CCommandShell cmd;
+		cmd.AddArg(arg);
+		cmd.m_nGroup = m_nGroup;
+		cmd.m_nParallel = m_nGroup ? m_nGroupParallel : 1;
+		ForEachActive([&](CConfiguration &config)
+		{
+			config.m_listDelayedCommands.push_back(cmd);
+		});
+	}
+	else if (ident == "group")
+	{
+		if (m_nGroup)
+			throw CParseException("%group blocks can not be nested", m_nCurrentLine);
+
+		// the optional maximum number of commands running at once
+		SkipWhiteSpaces(p);
+		int parallel = 0;
+		while (*p >= '0' && *p <= '9')
+			parallel = parallel * 10 + (*p++ - '0');
+
+		m_nGroup = ++m_nGroups;
+		m_nGroupParallel = parallel;
+	}
+	else if (ident == "endgroup")
+	{
+		if (!m_nGroup)
+			throw CParseException("%endgroup without %group", m_nCurrentLine);
+
+		m_nGroup = 0;
+	}
+	else
+		throw CParseException("unkown %-command", m_nCurrentLine);
+}
+
+
+// ===============================================================================
+//							CAutoVersion::ParseControlFile
+// ===============================================================================
+void CAutoVersion::ParseControlFile()
+{
+	struct stat st;
+	if (stat(m_strControlFile.c_str(), &st) != 0)
+		throw CException("stat failed for file " + m_strControlFile);
+
+	CountAllocation();
+	m_pBuffer = (char *)malloc(st.st_size + 1);
+	if (!m_pBuffer)
+		throw CException("out of memory");
+
+	CountOpen();
+	FILE *fh = fopen(m_strControlFile.c_str(), "rb");	// binary mode is important! otherwise \015 is eaten on read and therefore
+	if (!fh)											// the computed offsets into the Control File are wrong, so the updating
+		throw CException("reading file " + m_strControlFile + " failed!");	// the Control File later would fail!
+	size_t ret = fread(m_pBuffer, 1, st.st_size, fh);
+	m_pBuffer[ret] = '\0';
+	CountRead(ret);
+	fclose(fh);
+
+	m_nBufferSize		= ret;
+	m_nBufferInode		= st.st_ino;
+	GetFileTimes(st, m_tBufferModified, m_tBufferChanged);
+
+	// the cache holds a single configuration
+	bool use_cache = m_bParseCache && !m_bMatrix;
+
+	string cache_key;
+	if (use_cache)
+	{
+		cache_key = GetParseCacheKey(m_pBuffer, ret);
+		if (LoadParseCache(cache_key))
+		{
+			if (g_bVerbose)
+				printf("using parsed Control File from %s\n", GetParseCacheFile().c_str());
+			return;
+		}
+	}
+
+	// all configurations are active outside of conditional blocks
+	m_nActive = m_vecConfigs.size() >= CConfiguration::MaxConfigurations ? ~0ULL : (1ULL << m_vecConfigs.size()) - 1;
+	m_vecIfStack.clear();
+	m_nGroups = 0;
+	m_nGroup = 0;
+
+	char *p = m_pBuffer;
+	while (*p)
+	{
+		SkipWhiteSpaces(p);
+		char c = *p;
+
+		if (c != '\012' && c != '\015')
+		{
+			p++;
+			if (c == '@')
+				ParseConstantDef(p);
+			else if (c == '&')
+				ParseReplacement(enRoText, p);
+			else if (c == '$')
+				ParseReplacement(enRoBinary, p);
+			else if (c == '~')
+				ParseReplacement(enRoRegex, p);
+			else if (c == '!')
+				ParseMessage(p);
+			else if (c == '%')
+				ParseCommand(p);
+			else if (c == '#')
+				SkipComment(p);
+			else
+				throw CParseException("unknown command in Control File", m_nCurrentLine);
+		}
+
+		SkipLine(p);
+	}
+
+	if (m_nGroup)
+		throw CParseException("missing %endgroup token for group-token", m_nCurrentLine);
+
+	if (use_cache)
+	{
+		try
+		{
+			SaveParseCache(cache_key);
+		}
+		catch (exception &e)
+		{
+			printf("WARNING: %s\n", e.what());
+		}
+	}
+
+	// do not free(m_pBuffer), because we will use it to update the Control File
+}
+
+
+// ===============================================================================
+//							CAutoVersion::LoadControlFile
+//
+// parses the Control File and expands the patterns. The daemon keeps the
+// result until the Control File or a directory walked by a pattern changes,
+// only the results of the last request are reset then.
+// ===============================================================================
+void CAutoVersion::LoadControlFile()
+{
+	if (m_pDaemon && m_pDaemon->m_bParsed)
+	{
+		for (auto &config : m_vecConfigs)
+		{
+			for (auto &it : config.m_mapFiles)
+				it.second.ResetState();
+		}
+		if (g_bVerbose)
+			printf("using the parsed Control File of the daemon\n");
+		return;
+	}
+
+	if (m_pDaemon)
+	{
+		free(m_pBuffer);
+		m_pBuffer		= NULL;
+		m_nCurrentLine	= 1;
+		m_vecConfigs.assign(1, CConfiguration());
+		m_StringPool.Clear();
+		m_pDaemon->m_vecPatternDirs.clear();
+	}
+
+	CPhaseStats stats = CPhaseStats::Begin();
+	ParseControlFile();
+	EndPhase("parse", stats);
+	ExpandPatterns();
+	CompactRules();
+
+	if (m_pDaemon)
+	{
+		m_pDaemon->m_bParsed	= true;
+		m_pDaemon->m_bWatched	= false;
+	}
+}
+
+
+// ===============================================================================
+//							CAutoVersion::ExpandPatterns
+//
+// Adds the replacements of the file patterns to the files matching them. A
+// pattern used by several configurations with the same base path is only
+// expanded once.
+// ===============================================================================
+void CAutoVersion::ExpandPatterns()
+{
+	CPhaseStats stats = CPhaseStats::Begin();
+	unordered_map<string, vector<string>> expanded;
+	bool has_patterns = false;
+
+	for (auto &config : m_vecConfigs)
+	{
+		for (auto &it : config.m_vecPatterns)
+		{
+			has_patterns = true;
+
+			auto ins = expanded.emplace(config.m_strBasePath + '\n' + it.first, vector<string>());
+			if (ins.second)
+			{
+				CGlob glob;
+				vector<string> dirs;
+				glob.Expand(config.m_strBasePath, it.first, m_nThreads, ins.first->second, m_pDaemon ? &dirs : NULL);
+				for (auto &dir : dirs)
+					m_pDaemon->m_vecPatternDirs.push_back(config.m_strBasePath + PATH_SEPARATOR + dir);
+			}
+
+			const vector<string> &files = ins.first->second;
+			if (files.empty())
+				throw CException("no file matches the pattern " + it.first);
+
+			if (g_bVerbose)
+				printf("pattern %s matches %d files\n", it.first.c_str(), (int)files.size());
+
+			for (auto &file : files)
+				config.m_mapFiles[file].AddRules(it.second);
+		}
+	}
+
+	if (has_patterns)
+		EndPhase("expand", stats);
+}
+
+
+// ===============================================================================
+//							CAutoVersion::CompactRules
+//
+// After parsing, the replacements of a file are stored without spare capacity.
+// Generated Control Files often give many files the same replacements, their
+// automaton is built once, when the second of them is found. The automaton
+// of a file with replacements of its own is built during the check phase.
+// ===============================================================================
+void CAutoVersion::CompactRules()
+{
+	unordered_map<string, CFileNode *> first;		// the first file with a key
+	for (auto &config : m_vecConfigs)
+	{
+		for (auto &it : config.m_mapFiles)
+		{
+			it.second.Compact();
+
+			string key = it.second.GetMatcherKey();
+			if (key.empty())
+				continue;
+
+			auto ins = first.emplace(std::move(key), &it.second);
+			if (!ins.second)
+				it.second.ShareMatcher(*ins.first->second);
+		}
+	}
+}
+
+
+// ===============================================================================
+//							CAutoVersion::GetParseCacheKey
+//
+// The parsed Control File depends on its contents and the defines only.
+// ===============================================================================
+string CAutoVersion::GetParseCacheKey(const char *buf, size_t size) const
+{
+	vector<string> defines(m_setDefines.begin(), m_setDefines.end());
+	sort(defines.begin(), defines.end());
+
+	string key;
+	PutNumber(key, size);
+	PutNumber(key, HashBuffer(buf, size));
+	PutNumber(key, defines.size());
+	for (auto &it : defines)
+		PutString(key, it);
+
+	return key;
+}
+
+
+// ===============================================================================
+//							CAutoVersion::LoadParseCache
+//
+// Loads the parsed Control File, if the cache exists and belongs to "key".
+// Otherwise false is returned and nothing is changed.
+// ===============================================================================
+static const char ParseCacheMagic[] = "AVPARSED3\n";
+
+bool CAutoVersion::LoadParseCache(const string &key)
+{
+	struct stat st;
+	if (stat(GetParseCacheFile().c_str(), &st) != 0)
+		return false;
+
+	CFileBuffer file;
+	try
+	{
+		file.Open(GetParseCacheFile());
+	}
+	catch (exception &)
+	{
+		return false;
+	}
+
+	const char *p = file.GetData();
+	const char *end = p + file.GetSize();
+
+	if (file.GetSize() < sizeof(ParseCacheMagic) - 1 + 8 || memcmp(p, ParseCacheMagic, sizeof(ParseCacheMagic) - 1) != 0)
+		return false;
+	p += sizeof(ParseCacheMagic) - 1;
+
+	// the hash of the contents is stored at the end
+	unsigned long long hash = 0;
+	const char *hash_pos = end - 8;
+	if (!GetNumber(hash_pos, end, hash) || hash != HashBuffer(p, end - 8 - p))
+		return false;
+	end -= 8;
+
+	string cache_key;
+	if (!GetString(p, end, cache_key) || cache_key != key)
+		return false;
+
+	string base_path;
+	unordered_map<string, string> constants;
+	unordered_map<string, CFileNode> files;
+	vector<pair<string, CFileNode>> patterns;
+	list<string> messages;
+	list<CCommandShell> commands;
+
+	size_t count = 0;
+	bool ok = GetString(p, end, base_path) && GetNumber(p, end, count);
+	for (size_t i = 0; ok && i < count; i++)
+	{
+		string name, value;
+		ok = GetString(p, end, name) && GetString(p, end, value);
+		constants[name] = value;
+	}
+
+	ok = ok && GetNumber(p, end, count);
+	for (size_t i = 0; ok && i < count; i++)
+	{
+		string name;
+		size_t replacements = 0;
+		ok = GetString(p, end, name) && GetNumber(p, end, replacements);
+
+		CFileNode &node = files[name];
+		for (size_t k = 0; ok && k < replacements; k++)
+		{
+			size_t op = 0, pos = 0;
+			string what, with;
+			ok = GetNumber(p, end, op) && GetString(p, end, what) && GetString(p, end, with) && GetNumber(p, end, pos);
+			node.Add(CReplace((EReplaceOp)op, m_StringPool.Intern(what), m_StringPool.Intern(with), pos));
+		}
+	}
+
+	ok = ok && GetNumber(p, end, count);
+	for (size_t i = 0; ok && i < count; i++)
+	{
+		string name;
+		size_t replacements = 0;
+		ok = GetString(p, end, name) && GetNumber(p, end, replacements);
+
+		patterns.emplace_back(name, CFileNode());
+		for (size_t k = 0; ok && k < replacements; k++)
+		{
+			size_t op = 0, pos = 0;
+			string what, with;
+			ok = GetNumber(p, end, op) && GetString(p, end, what) && GetString(p, end, with) && GetNumber(p, end, pos);
+			patterns.back().second.Add(CReplace((EReplaceOp)op, m_StringPool.Intern(what), m_StringPool.Intern(with), pos));
+		}
+	}
+
+	ok = ok && GetNumber(p, end, count);
+	for (size_t i = 0; ok && i < count; i++)
+	{
+		string msg;
+		ok = GetString(p, end, msg);
+		messages.push_back(msg);
+	}
+
+	ok = ok && GetNumber(p, end, count);
+	for (size_t i = 0; ok && i < count; i++)
+	{
+		CCommandShell cmd;
+		size_t args = 0, group = 0, parallel = 0;
+		ok = GetNumber(p, end, group) && GetNumber(p, end, parallel) && GetNumber(p, end, args);
+		cmd.m_nGroup = group;
+		cmd.m_nParallel = (int)parallel;
+		for (size_t k = 0; ok && k < args; k++)
+		{
+			string arg;
+			ok = GetString(p, end, arg);
+			cmd.AddArg(arg);
+		}
+		commands.push_back(cmd);
+	}
+
+	if (!ok || p != end)
+		return false;
+
+	CConfiguration &config = m_vecConfigs[0];
+	config.m_strBasePath			= base_path;
+	config.m_mapConstantDefs		= constants;
+	config.m_mapFiles				= files;
+	config.m_vecPatterns			= patterns;
+	config.m_listMessages			= messages;
+	config.m_listDelayedCommands	= commands;
+	return true;
+}
+
+
+// ===============================================================================
+//							CAutoVersion::SaveParseCache
+// ===============================================================================
+void CAutoVersion::SaveParseCache(const string &key) const
+{
+	const CConfiguration &config = m_vecConfigs[0];
+
+	string data;
+	PutString(data, key);
+	PutString(data, config.m_strBasePath);
+
+	PutNumber(data, config.m_mapConstantDefs.size());
+	for (auto &it : config.m_mapConstantDefs)
+	{
+		PutString(data, it.first);
+		PutString(data, it.second);
+	}
+
+	PutNumber(data, config.m_mapFiles.size());
+	for (auto &it : config.m_mapFiles)
+	{
+		const vector<CReplace> &replacements = it.second.GetReplacements();
+		PutString(data, it.first);
+		PutNumber(data, replacements.size());
+		for (auto &r : replacements)
+		{
+			PutNumber(data, r.GetOp());
+			PutString(data, r.GetWhat());
+			PutString(data, r.GetWith());
+			PutNumber(data, r.m_nControlFilePos);
+		}
+	}
+
+	PutNumber(data, config.m_vecPatterns.size());
+	for (auto &it : config.m_vecPatterns)
+	{
+		const vector<CReplace> &replacements = it.second.GetReplacements();
+		PutString(data, it.first);
+		PutNumber(data, replacements.size());
+		for (auto &r : replacements)
+		{
+			PutNumber(data, r.GetOp());
+			PutString(data, r.GetWhat());
+			PutString(data, r.GetWith());
+			PutNumber(data, r.m_nControlFilePos);
+		}
+	}
+
+	PutNumber(data, config.m_listMessages.size());
+	for (auto &it : config.m_listMessages)
+		PutString(data, it);
+
+	PutNumber(data, config.m_listDelayedCommands.size());
+	for (auto &it : config.m_listDelayedCommands)
+	{
+		PutNumber(data, it.m_nGroup);
+		PutNumber(data, it.m_nParallel);
+		PutNumber(data, it.GetArgs().size());
+		for (auto &arg : it.GetArgs())
+			PutString(data, arg);
+	}
+
+	PutNumber(data, HashBuffer(data.c_str(), data.length()));
+	data.insert(0, ParseCacheMagic, sizeof(ParseCacheMagic) - 1);
+	WriteFileContents(GetParseCacheFile(), data.c_str(), data.length());
+}
+
+
+// ===============================================================================
+//								CAutoVersion::UpdateControlFile
+//
+// In plan mode, the entry for the Control File is returned in "plan" and
+// nothing is written.
+// ===============================================================================
+void CAutoVersion::UpdateControlFile(CJournalEntry *plan)
+{
+	if (g_bVerbose)
+		printf("\nupdating Control File %s... ", m_strControlFile.c_str());
+
+	CConfiguration &config = m_vecConfigs[0];
+
+	// The Control File is still in m_pBuffer, the positions of the what-strings
+	// refer to it. So it must not have been changed since it was parsed. The
+	// time stamps may be too coarse for a change right after the parse, so the
+	// contents are compared as well.
+	struct stat st;
+	if (stat(m_strControlFile.c_str(), &st) != 0)
+		throw CException("stat failed for file " + m_strControlFile);
+
+	long long modified, changed;
+	GetFileTimes(st, modified, changed);
+
+	bool unchanged = (size_t)st.st_size == m_nBufferSize && (unsigned long long)st.st_ino == m_nBufferInode &&
+					 modified == m_tBufferModified && changed == m_tBufferChanged;
+	if (unchanged)
+	{
+		CFileBuffer file;
+		file.Open(m_strControlFile);
+		unchanged = file.GetSize() == m_nBufferSize && memcmp(file.GetData(), m_pBuffer, m_nBufferSize) == 0;
+	}
+
+	if (!unchanged)
+		throw CException("the Control File " + m_strControlFile + " was modified since it was parsed!");
+
+	const char *buf = m_pBuffer;
+	size_t size = m_nBufferSize;
+
+	// the replacements done, ascending by their position in the Control File. A
+	// regular expression stays as it is, it does not contain the old contents.
+	vector<const CReplace *> replacements;
+	for (auto &it : config.m_mapFiles)
+	{
+		for (auto &r : it.second.GetReplacements())
+		{
+			if (r.GetDidReplace() && !r.IsRegex())
+				replacements.push_back(&r);
+		}
+	}
+
+	sort(replacements.begin(), replacements.end(),
+		[](const CReplace *a, const CReplace *b) { return a->m_nControlFilePos < b->m_nControlFilePos; });
+
+	// the files matching a pattern share its replacements, each is updated once
+	replacements.erase(unique(replacements.begin(), replacements.end(),
+		[](const CReplace *a, const CReplace *b) { return a->m_nControlFilePos == b->m_nControlFilePos; }), replacements.end());
+
+	// check the what-strings and compute the new size first, then build the
+	// new Control File in a single pass
+	vector<size_t> what_len(replacements.size());
+	size_t newsize = size;
+	size_t next = 0;
+	for (size_t i = 0; i < replacements.size(); i++)
+	{
+		const CReplace *r = replacements[i];
+		size_t pos = r->m_nControlFilePos;
+
+		if (pos >= next && pos < size)
+			what_len[i] = MatchLiteral(buf + pos, buf + size, r->GetWhat());
+		if (!what_len[i])
+			throw CException("updating control file failed! The what-string '" + r->GetWhat() + "' was not found at the expected position!");
+
+		next = pos + what_len[i];
+		newsize = newsize - what_len[i] + EscapedLength(r->GetWith());
+	}
+
+	CountAllocation();
+	char *newbuf = (char *)malloc(newsize ? newsize : 1);
+	if (!newbuf)
+		throw CException("out of memory");
+
+	CEditPass pass;
+	char *dst = newbuf;
+	size_t src = 0;
+	for (size_t i = 0; i < replacements.size(); i++)
+	{
+		size_t pos = replacements[i]->m_nControlFilePos;
+
+		memcpy(dst, buf + src, pos - src);
+		dst += pos - src;
+
+		char *end = Escape(dst, replacements[i]->GetWith());
+		pass.Add(dst - newbuf, end - dst, buf + pos, what_len[i]);
+		dst = end;
+		src = pos + what_len[i];
+	}
+	memcpy(dst, buf + src, size - src);
+
+	CJournalEntry entry;
+	entry.m_strFileName	= m_strControlFile;
+	entry.m_nOldSize	= size;
+	entry.m_nOldHash	= HashBuffer(buf, size);
+	if (!pass.IsEmpty())
+		entry.m_vecPasses.push_back(pass);
+	entry.m_nNewSize	= newsize;
+	entry.m_nNewHash	= HashBuffer(newbuf, newsize);
+
+	if (plan)
+	{
+		for (size_t i = 0; i < pass.m_vecOffset.size(); i++)
+			entry.m_strNew.append(newbuf + pass.m_vecOffset[i], pass.m_vecNewLength[i]);
+		if (pass.IsEmpty())
+			entry.m_vecPasses.push_back(pass);		// a plan entry always has a single pass
+
+		*plan = entry;
+		free(newbuf);
+		if (g_bVerbose)
+			printf("planned.\n");
+		return;
+	}
+
+	m_Journal.Append(entry);
+
+	// Datei schreiben
+	try
+	{
+		WriteFileContents(m_strControlFile, newbuf, newsize);
+	}
+	catch (...)
+	{
+		free(newbuf);
+		throw;
+	}
+
+	free(newbuf);
+	if (g_bVerbose)
+		printf("done.\n");
+}
+
+
+// ===============================================================================
+//								CAutoVersion::Replace
+// ===============================================================================
+void CAutoVersion::Replace()
+{
+	printf("\nscanning for replacement actions...\n");
+	LoadControlFile();
+
+	// Testen, ob ein Journal existiert. Falls ja, dann Fehler.
+	if (CJournal::Exists(GetJournalFile()))
+		throw CException("the journal " + GetJournalFile() + " already exists. Please perform a clean or a rollback first.");
+	// Dump();
+
+	CConfiguration &config = m_vecConfigs[0];
+
+	// the files are processed in parallel, but always in the order of m_mapFiles
+	vector<pair<const string, CFileNode> *> files;
+	for (auto &it : config.m_mapFiles)
+		files.push_back(&it);
+
+	vector<char> must_replace;
+	CThreadPool pool(m_nThreads);
+	if (CheckFiles(files, must_replace, pool) > 0)
+	{
+		if (m_bInteractive)
+		{
+			printf("perform replacements (y/n)?");
+			char c = (char)_getch();
+			if (c == 'n')
+				return;
+			printf("\n");
+		}
+	}
+	else
+	{
+		printf("nothing to replace\n");
+		return;
+	}
+
+	CPhaseStats stats = CPhaseStats::Begin();
+	m_Journal.Create(GetJournalFile(), config.m_listDelayedCommands);
+
+	// F�r jede Datei:
+	printf("replacing...\n");
+	pool.Run(files.size(), [&](size_t i)
+	{
+		// Replacements durchf�hren
+		string fname = config.m_strBasePath + PATH_SEPARATOR + files[i]->first;		// file name
+		files[i]->second.DoReplacments(fname, m_Journal);
+	});
+	EndPhase("replace", stats);
+
+	stats = CPhaseStats::Begin();
+	UpdateControlFile();
+	EndPhase("update", stats);
+	printf("replacement finished.\n");
+}
+
+
+// ===============================================================================
+//								CAutoVersion::CheckFiles
+//
+// The check phase of Replace and Plan: checks the files for replacements,
+// sets "must_replace" for each and returns the number of files with
+// replacements.
+// ===============================================================================
+size_t CAutoVersion::CheckFiles(vector<pair<const string, CFileNode> *> &files, vector<char> &must_replace, CThreadPool &pool)
+{
+	CPhaseStats stats = CPhaseStats::Begin();
+	CConfiguration &config = m_vecConfigs[0];
+	size_t count = 0;
+	atomic<size_t> cache_budget(m_nScanCacheLimit);
+
+	must_replace.assign(files.size(), 0);
+
+	// incremental mode: the state of the files from the last run. The daemon
+	// keeps it in memory, a file in a watched directory is unchanged as long
+	// as no event arrived for it.
+	bool incremental = m_bIncremental || m_pDaemon;
+	vector<CScanCacheEntry> scan_states;
+	vector<char> not_watched(files.size(), 0);
+	const vector<char> &watched = m_pDaemon ? m_pDaemon->WatchFiles(config.m_strBasePath, files) : not_watched;
+	vector<char> checked(files.size(), 0);
+	CScanCache file_cache;
+	CScanCache &scan_cache = m_pDaemon ? m_pDaemon->m_ScanCache : file_cache;
+	if (m_bIncremental && !m_pDaemon)
+		scan_cache.Load(GetScanCacheFile());
+
+	if (incremental)
+	{
+		scan_states.resize(files.size());
+		string fname = config.m_strBasePath + PATH_SEPARATOR;
+		size_t base_len = fname.length();
+		for (size_t i = 0; i < files.size(); i++)
+		{
+			fname.resize(base_len);
+			fname += files[i]->first;
+			const CScanCacheEntry *entry = scan_cache.Find(fname);
+			if (entry)
+				scan_states[i] = *entry;
+		}
+	}
+
+	// Small files are read in batches, where the system supports it. Not in
+	// incremental mode, most files are not read then.
+	unique_ptr<CBatchReader> batch_reader;
+	if (m_bBatchIO && !incremental)
+	{
+		batch_reader.reset(new CBatchReader());
+		if (!batch_reader->IsAvailable())
+			batch_reader.reset();
+	}
+
+	// F�r jede Datei:
+	size_t batch_size = batch_reader ? (size_t)CBatchReader::BatchFiles : max(files.size(), (size_t)1);
+	vector<CBatchReader::SFile> batch;
+	for (size_t first = 0; first < files.size(); first += batch_size)
+	{
+		size_t count = min(batch_size, files.size() - first);
+		if (batch_reader)
+		{
+			batch.assign(count, CBatchReader::SFile());
+			for (size_t k = 0; k < count; k++)
+				batch[k].m_strFileName = config.m_strBasePath + PATH_SEPARATOR + files[first + k]->first;
+			batch_reader->Read(batch);
+		}
+
+		pool.Run(count, [&](size_t k)
+		{
+			// Auf Replacements pr�fen
+			size_t i = first + k;
+			if (watched[i] && files[i]->second.IsUnchanged(scan_states[i]))
+				return;
+
+			checked[i] = 1;
+			string fname = config.m_strBasePath + PATH_SEPARATOR + files[i]->first;		// file name
+			const CBatchReader::SFile *prefetched = batch_reader && batch[k].m_bRead ? &batch[k] : NULL;
+			must_replace[i] = files[i]->second.CheckReplacements(fname, cache_budget, m_nStreamWindow, incremental ? &scan_states[i] : NULL, prefetched);
+		});
+	}
+	batch.clear();
+
+	// Only files without replacements are kept in the cache, they are not written
+	// in this run. The cache is written now, as it does not depend on the rest of the run.
+	// The daemon only updates the files checked now, the others are unchanged.
+	if (m_pDaemon)
+	{
+		for (size_t i = 0; i < files.size(); i++)
+		{
+			if (!checked[i])
+				continue;
+
+			string fname = config.m_strBasePath + PATH_SEPARATOR + files[i]->first;
+			if (scan_states[i].m_bValid)
+				scan_cache.Set(fname, scan_states[i]);
+			else
+				scan_cache.Erase(fname);
+		}
+	}
+	else if (incremental)
+	{
+		scan_cache.Clear();
+		for (size_t i = 0; i < files.size(); i++)
+		{
+			if (scan_states[i].m_bValid)
+				scan_cache.Set(config.m_strBasePath + PATH_SEPARATOR + files[i]->first, scan_states[i]);
+		}
+		try
+		{
+			scan_cache.Save(GetScanCacheFile());
+		}
+		catch (exception &e)
+		{
+			printf("WARNING: %s\n", e.what());
+		}
+	}
+
+	for (auto it : must_replace)
+	{
+		if (it)
+			count++;
+	}
+
+	EndPhase("check", stats);
+	printf("\nscanning finished. (%d files will have replacements)\n\n", (int)count);
+	return count;
+}
+
+
+// ===============================================================================
+//								SplicePass
+//
+// Applies a single pass with the new bytes "new_bytes" to "buf", see class
+// CJournal. Returns the new contents in a malloc'd buffer, or NULL if the
+// spans do not fit to "buf".
+// ===============================================================================
+static char *SplicePass(const char *buf, size_t size, const CEditPass &pass, const string &new_bytes, size_t new_size)
+{
+	CountAllocation();
+	char *newbuf = (char *)malloc(new_size ? new_size : 1);
+	if (!newbuf)
+		throw CException("out of memory");
+
+	size_t src = 0;			// in buf
+	size_t dst = 0;			// in newbuf
+	size_t old = 0;			// in pass.m_strOld
+	size_t pos = 0;			// in new_bytes
+	bool ok = true;
+	for (size_t i = 0; ok && i < pass.m_vecOffset.size(); i++)
+	{
+		size_t offset = pass.m_vecOffset[i];
+		size_t new_len = pass.m_vecNewLength[i];
+		size_t old_len = pass.m_vecOldLength[i];
+
+		ok = offset >= dst && offset - dst <= size - src && old_len <= size - src - (offset - dst) &&
+			 offset + new_len <= new_size && pos + new_len <= new_bytes.length() &&
+			 memcmp(buf + src + offset - dst, pass.m_strOld.c_str() + old, old_len) == 0;
+		if (ok)
+		{
+			memcpy(newbuf + dst, buf + src, offset - dst);
+			src += offset - dst + old_len;
+			memcpy(newbuf + offset, new_bytes.c_str() + pos, new_len);
+			dst = offset + new_len;
+			old += old_len;
+			pos += new_len;
+		}
+	}
+
+	if (!ok || size - src != new_size - dst)
+	{
+		free(newbuf);
+		return NULL;
+	}
+
+	memcpy(newbuf + dst, buf + src, size - src);
+	return newbuf;
+}
+
+
+// ===============================================================================
+//								CAutoVersion::Plan
+//
+// The first half of Replace: checks the files and writes the replacements
+// to "plan_file", together with the update of the Control File, the delayed
+// commands and the messages. Nothing else is written. See Apply.
+// ===============================================================================
+void CAutoVersion::Plan(const string &plan_file)
+{
+	printf("\nscanning for replacement actions...\n");
+	LoadControlFile();
+
+	CConfiguration &config = m_vecConfigs[0];
+
+	vector<pair<const string, CFileNode> *> files;
+	for (auto &it : config.m_mapFiles)
+		files.push_back(&it);
+
+	vector<char> must_replace;
+	CThreadPool pool(m_nThreads);
+	size_t count = CheckFiles(files, must_replace, pool);
+
+	// the entries are collected first, so the plan does not depend on the
+	// order the files are processed in
+	CPhaseStats stats = CPhaseStats::Begin();
+	printf("planning...\n");
+	vector<CJournalEntry> entries(files.size());
+	vector<char> planned(files.size(), 0);
+	pool.Run(files.size(), [&](size_t i)
+	{
+		string fname = config.m_strBasePath + PATH_SEPARATOR + files[i]->first;		// file name
+		planned[i] = files[i]->second.PlanReplacements(fname, entries[i]);
+	});
+
+	CJournal plan;
+	plan.CreatePlan(plan_file, config.m_listDelayedCommands, config.m_listMessages);
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		if (planned[i])
+			plan.Append(entries[i]);
+	}
+	entries.clear();
+
+	if (count > 0)
+	{
+		CJournalEntry entry;
+		UpdateControlFile(&entry);
+		plan.Append(entry);
+	}
+
+	plan.EndPlan();
+	plan.Close();
+	EndPhase("plan", stats);
+	printf("plan %s written.\n", plan_file.c_str());
+}
+
+
+// ===============================================================================
+//								CAutoVersion::Apply
+//
+// The second half of Replace: performs the replacements of a plan. All files
+// must have the contents they had, when the plan was made. They are not
+// searched again, the spans of the plan are spliced in.
+// ===============================================================================
+void CAutoVersion::Apply(const string &plan_file)
+{
+	printf("\napplying plan %s...\n", plan_file.c_str());
+
+	if (CJournal::Exists(GetJournalFile()))
+		throw CException("the journal " + GetJournalFile() + " already exists. Please perform a clean or a rollback first.");
+
+	CPhaseStats stats = CPhaseStats::Begin();
+	CConfiguration &config = m_vecConfigs[0];
+	vector<CJournalEntry> entries;
+	config.m_listDelayedCommands.clear();
+	config.m_listMessages.clear();
+	CJournal::LoadPlan(plan_file, config.m_listDelayedCommands, config.m_listMessages, entries);
+
+	// Check all files first, none is written, if one of them was modified.
+	// The contents are kept as far as the budget allows.
+	CThreadPool pool(m_nThreads);
+	vector<shared_ptr<CFileBuffer>> contents(entries.size());
+	vector<CFileState> states(entries.size());
+	atomic<size_t> cache_budget(m_nScanCacheLimit);
+	pool.Run(entries.size(), [&](size_t i)
+	{
+		const CJournalEntry &entry = entries[i];
+		if (g_bVerbose)
+			Print("\nchecking file %s\n", entry.m_strFileName.c_str());
+
+		struct stat st;
+		if (stat(entry.m_strFileName.c_str(), &st) != 0)
+			throw CException("stat failed for file " + entry.m_strFileName);
+
+		shared_ptr<CFileBuffer> file = make_shared<CFileBuffer>();
+		file->Open(entry.m_strFileName);
+		if (file->GetSize() != entry.m_nOldSize || HashBuffer(file->GetData(), file->GetSize()) != entry.m_nOldHash)
+			throw CException("the file " + entry.m_strFileName + " was modified since the plan was made!");
+
+		states[i].Set(st, entry.m_nOldHash);
+
+		size_t size = file->GetSize();
+		size_t budget = cache_budget;
+		while (size <= budget && !cache_budget.compare_exchange_weak(budget, budget - size))
+			;
+		if (size <= budget)
+			contents[i] = file;
+	});
+	EndPhase("check", stats);
+	printf("\nchecking finished. (%d files will have replacements)\n\n", (int)entries.size());
+
+	if (entries.empty())
+	{
+		printf("nothing to replace\n");
+		return;
+	}
+
+	if (m_bInteractive)
+	{
+		printf("perform replacements (y/n)?");
+		char c = (char)_getch();
+		if (c == 'n')
+			return;
+		printf("\n");
+	}
+
+	stats = CPhaseStats::Begin();
+	m_Journal.Create(GetJournalFile(), config.m_listDelayedCommands);
+
+	printf("replacing...\n");
+	pool.Run(entries.size(), [&](size_t i)
+	{
+		CJournalEntry &entry = entries[i];
+		const string &fname = entry.m_strFileName;
+		if (g_bVerbose)
+			Print("\nreplacing in file %s\n", fname.c_str());
+
+		shared_ptr<CFileBuffer> file = contents[i];
+		contents[i].reset();
+
+		struct stat st;
+		if (stat(fname.c_str(), &st) != 0)
+			throw CException("stat failed for file " + fname);
+
+		if (states[i].IsModified(fname, st, file))
+			throw CException("the file " + fname + " was modified since it was checked!");
+
+		if (!file)
+		{
+			file = make_shared<CFileBuffer>();
+			file->Open(fname);
+			if (file->GetSize() != entry.m_nOldSize || HashBuffer(file->GetData(), file->GetSize()) != entry.m_nOldHash)
+				throw CException("the file " + fname + " was modified since it was checked!");
+		}
+
+		char *buf = SplicePass(file->GetData(), file->GetSize(), entry.m_vecPasses[0], entry.m_strNew, entry.m_nNewSize);
+		if (!buf || HashBuffer(buf, entry.m_nNewSize) != entry.m_nNewHash)
+		{
+			free(buf);
+			throw CException("the plan " + plan_file + " does not fit to the file " + fname + "!");
+		}
+
+		// the file must not be mapped any more, when it is written
+		file.reset();
+
+		// the journal gets the pass only, the new bytes are not needed for a rollback
+		entry.m_strNew.clear();
+		m_Journal.Append(entry);
+
+		try
+		{
+			WriteFileContents(fname, buf, entry.m_nNewSize);
+		}
+		catch (...)
+		{
+			free(buf);
+			throw;
+		}
+
+		free(buf);
+	});
+	EndPhase("replace", stats);
+	printf("replacement finished.\n");
+}
+
+
+// ===============================================================================
+//								CAutoVersion::AddConfiguration
+//
+// Matrix mode: adds a configuration, its results are written below
+// "output_root".
+// ===============================================================================
+void CAutoVersion::AddConfiguration(const string &output_root, const vector<string> &defines)
+{
+	if (!m_bMatrix)
+	{
+		m_vecConfigs.clear();
+		m_bMatrix = true;
+	}
+
+	if (m_vecConfigs.size() >= CConfiguration::MaxConfigurations)
+		throw CException("too many configurations");
+
+	if (output_root.empty())
+		throw CException("the output root of a configuration is missing");
+
+	m_vecConfigs.emplace_back();
+	m_vecConfigs.back().m_strOutputRoot = output_root;
+	m_vecConfigs.back().m_setDefines.insert(defines.begin(), defines.end());
+}
+
+
+// ===============================================================================
+//								CAutoVersion::ReplaceMatrix
+//
+// Matrix mode: the Control File is parsed once for all configurations. Each
+// file is read and scanned once for all configurations which list it, and
+// the results of each configuration are written to its output root. The
+// files and the Control File themselves are not changed.
+// ===============================================================================
+void CAutoVersion::ReplaceMatrix()
+{
+	printf("\nscanning for replacement actions (%d configurations)...\n", (int)m_vecConfigs.size());
+	LoadControlFile();
+
+	struct STarget
+	{
+		string					m_strFileName;	// file name incl. base path
+		vector<size_t>			m_vecConfigs;	// the configurations which list the file
+		vector<pair<const string, CFileNode> *>	m_vecNodes;		// the entries of the file in their m_mapFiles
+		shared_ptr<CFileBuffer>	m_pCache;		// the file contents, if they fit into the cache budget
+		CFileState				m_State;		// the file at check time
+	};
+
+	// the files are processed in the order of the configurations and their m_mapFiles
+	vector<STarget> targets;
+	unordered_map<string, size_t> index;
+	for (size_t c = 0; c < m_vecConfigs.size(); c++)
+	{
+		for (auto &it : m_vecConfigs[c].m_mapFiles)
+		{
+			string fname = m_vecConfigs[c].m_strBasePath + PATH_SEPARATOR + it.first;
+			auto ins = index.emplace(fname, targets.size());
+			if (ins.second)
+			{
+				targets.emplace_back();
+				targets.back().m_strFileName = fname;
+			}
+
+			STarget &target = targets[ins.first->second];
+			target.m_vecConfigs.push_back(c);
+			target.m_vecNodes.push_back(&it);
+		}
+	}
+
+	// reads a target and finds the matches of all its configurations
+	auto scan = [](STarget &target, shared_ptr<CFileBuffer> &file)
+	{
+		struct stat st;
+		if (stat(target.m_strFileName.c_str(), &st) != 0)
+			throw CException("stat failed for file " + target.m_strFileName);
+
+		file = make_shared<CFileBuffer>();
+		file->Open(target.m_strFileName);
+
+		vector<CFileNode *> nodes;
+		for (auto it : target.m_vecNodes)
+			nodes.push_back(&it->second);
+		CFileNode::FindMatches(target.m_strFileName, file->GetData(), file->GetSize(), nodes);
+
+		return st;
+	};
+
+	CPhaseStats stats = CPhaseStats::Begin();
+	vector<vector<char>> must_replace(targets.size());
+	atomic<size_t> cache_budget(m_nScanCacheLimit);
+	CThreadPool pool(m_nThreads);
+
+	pool.Run(targets.size(), [&](size_t i)
+	{
+		STarget &target = targets[i];
+		if (g_bVerbose)
+			Print("\nchecking file %s\n", target.m_strFileName.c_str());
+
+		shared_ptr<CFileBuffer> file;
+		struct stat st = scan(target, file);
+		target.m_State.Set(st, HashBuffer(file->GetData(), file->GetSize()));
+
+		for (auto it : target.m_vecNodes)
+			must_replace[i].push_back(it->second.CheckMatches(target.m_strFileName));
+
+		size_t size = file->GetSize();
+		size_t budget = cache_budget;
+		while (size <= budget && !cache_budget.compare_exchange_weak(budget, budget - size))
+			;
+
+		if (size <= budget)
+			target.m_pCache = file;
+		else
+		{
+			for (auto it : target.m_vecNodes)
+				it->second.ClearMatches();
+		}
+	});
+
+	EndPhase("check", stats);
+	printf("\nscanning finished.\n");
+	for (size_t c = 0; c < m_vecConfigs.size(); c++)
+	{
+		int count = 0;
+		for (size_t i = 0; i < targets.size(); i++)
+		{
+			for (size_t k = 0; k < targets[i].m_vecConfigs.size(); k++)
+			{
+				if (targets[i].m_vecConfigs[k] == c && must_replace[i][k])
+					count++;
+			}
+		}
+
+		printf("%s: %d of %d files will have replacements\n", m_vecConfigs[c].m_strOutputRoot.c_str(), count, (int)m_vecConfigs[c].m_mapFiles.size());
+	}
+	printf("\n");
+
+	if (m_bInteractive)
+	{
+		printf("write the files to the output roots (y/n)?");
+		char c = (char)_getch();
+		if (c == 'n')
+			return;
+		printf("\n");
+	}
+
+	printf("writing...\n");
+	stats = CPhaseStats::Begin();
+	pool.Run(targets.size(), [&](size_t i)
+	{
+		STarget &target = targets[i];
+
+		shared_ptr<CFileBuffer> file = target.m_pCache;
+		target.m_pCache.reset();
+
+		struct stat st;
+		if (stat(target.m_strFileName.c_str(), &st) != 0)
+			throw CException("stat failed for file " + target.m_strFileName);
+
+		bool modified = target.m_State.IsModified(target.m_strFileName, st, file);
+		if (!modified && !file)
+		{
+			scan(target, file);
+			modified = HashBuffer(file->GetData(), file->GetSize()) != target.m_State.m_nHash;
+		}
+
+		if (modified)
+			throw CException("the file " + target.m_strFileName + " was modified since it was scanned!");
+
+		for (size_t k = 0; k < target.m_vecNodes.size(); k++)
+		{
+			const CConfiguration &config = m_vecConfigs[target.m_vecConfigs[k]];
+			string out_name = config.m_strOutputRoot + PATH_SEPARATOR + target.m_vecNodes[k]->first;
+			target.m_vecNodes[k]->second.WriteResult(file->GetData(), file->GetSize(), out_name);
+		}
+	});
+
+	EndPhase("replace", stats);
+	printf("writing finished.\n");
 }
 
 
 // ===============================================================================
-//							CReplace::UpdateControlFile
+//								CAutoVersion::ExecDelayedCommands
 //
-// Replacement auf das Control File anwenden
+// The commands run one after another, except for the consecutive commands of
+// a %group block, which run on a CThreadPool. Their output is printed in the
+// order of the commands. The first failed command fails the run; the commands
+// behind it are not started, if they are not running already.
 // ===============================================================================
-char *CReplace::UpdateControlFile(char *buf, size_t &size, int &offset)
+void CAutoVersion::ExecDelayedCommands()
 {
-	if (m_bDidReplace)
+	CPhaseStats stats = CPhaseStats::Begin();
+	for (auto &config : m_vecConfigs)
 	{
-		// we must expand backslash to double-backslash and " to \"
-		string what = FindReplace(m_strWhat, "\\", "\\\\");
-		what = FindReplace(what, "\"", "\\\"");
-
-		string with = FindReplace(m_strWith, "\\", "\\\\");
-		with = FindReplace(with, "\"", "\\\"");
-
-		size_t pos = m_nControlFilePos + offset;
-		size_t what_len = what.length();
-		size_t with_len = with.length();
-
-		// printf("updating at pos = %ld (offset %ld) - >%s< with >%s<\n", pos, offset, what.c_str(), with.c_str());
-		if (strncmp(buf + pos, what.c_str(), what_len) != 0)
-			throw CException("updating control file failed! The what-string '" + what + "' was not found at the expected position!");
-
-		size_t newsize = size - what_len + with_len;
-		char *newbuf = (char *)malloc(newsize);
-		if (!newbuf)
-			throw CException("out of memory");
+		if (g_bVerbose && config.m_listDelayedCommands.size() > 0)
+			printf("\nexecuting delayed commands\n");
 
-		memcpy(newbuf, buf, pos);
-		memcpy(newbuf + pos, with.c_str(), with_len);
-		memcpy(newbuf + pos + with_len, buf + pos + what_len, size - pos - what_len);
-
-		free(buf);
-		buf = newbuf;
-		size = newsize;
-		offset += (int)((int)with_len - (int)what_len);
+		auto it = config.m_listDelayedCommands.begin();
+		while (it != config.m_listDelayedCommands.end())
+		{
+			vector<CCommandShell *> group(1, &*it);
+			size_t id = it->m_nGroup;
+			for (++it; id && it != config.m_listDelayedCommands.end() && it->m_nGroup == id; ++it)
+				group.push_back(&*it);
+
+			int parallel = group[0]->m_nParallel;
+			if (parallel < 1)
+				parallel = max((int)thread::hardware_concurrency(), 1);
+
+			fflush(stdout);
+			CThreadPool pool(parallel);
+			pool.Run(group.size(), [&](size_t i)
+			{
+				if (!group[i]->Execute())
+					throw CException("a delayed command failed");
+			});
+		}
 	}
-
-	return buf;
+	EndPhase("commands", stats);
 }
 
 
 // ===============================================================================
-//							CFileNode::CheckReplacements
+//								CAutoVersion::RescueRollback
 //
-// checks, if any replacement for this file will occur
+// Wird im Fehlerfall aufgerufen, f�hrt nur Rollback f�r die w�hrend des
+// Programmablaufs ge�nderten Dateien durch.
 // ===============================================================================
-bool CFileNode::CheckReplacements(const string &file_name)
+void CAutoVersion::RescueRollback()
 {
-	if (g_bVerbose)
-		printf("\nchecking file %s\n", file_name.c_str());
-
-	// Testen, ob eine .avbak Datei fr diese Datei existiert. Falls ja, dann Fehler.
-	string bak = file_name + ".avbak";
-	struct stat st;
-	if (stat(bak.c_str(), &st) == 0)
-		throw CException("the file " + bak + " already exists. Please perform a clean or a rollback first.");
-
-	// Datei in den Speicher lesen
-	if (stat(file_name.c_str(), &st) != 0)
-		throw CException("stat failed for file " + file_name);
+	if (!m_Journal.IsOpen())
+		return;
 
-	size_t size = st.st_size;
-	char *buf = (char *)malloc(size);
-	if (!buf)
-		throw CException("out of memory");
+	printf("\nperforming rescue rollback...\n");
+	m_Journal.Close();
 
-	FILE *fh = fopen(file_name.c_str(), "rb");
-	size_t ret = fread(buf, 1, size, fh);
-	fclose(fh);
-	if (ret != size)
-		throw CException("reading file " + file_name + " failed!");
+	list<CCommandShell> commands;
+	vector<CJournalEntry> entries;
+	CJournal::Load(GetJournalFile(), commands, entries);
 
-	// Dann testen, ob ein Replacement durchgefhrt wird, Replacements anzeigen.
-	for (auto &it : m_listReplacements)
-	{
-		if (it.CheckReplace(file_name, buf, size))
-			m_bMustReplace = true;
-	}
+	if (CJournal::Rollback(entries))
+		_unlink(GetJournalFile().c_str());
 
-	free(buf);
-	return m_bMustReplace;
+	printf("done.\n");
 }
 
 
 // ===============================================================================
-//							CFileNode::DoReplacments
+//								CAutoVersion::Rollback
 //
-// performs all replacements for this file
+// Normale Rollback-Funktion. Alle im Journal verzeichneten Dateien werden
+// zur�ckgesetzt, die Delayed Commands werden aus dem Journal �bernommen.
+// Ohne Journal wurde nichts ge�ndert, die Delayed Commands kommen dann wie
+// fr�her aus dem Control File.
 // ===============================================================================
-void CFileNode::DoReplacments(const string &file_name)
+void CAutoVersion::Rollback()
 {
-	if (m_bMustReplace)
+	if (!CJournal::Exists(GetJournalFile()))
 	{
-		if (g_bVerbose)
-			printf("\nreplacing in file %s\n", file_name.c_str());
-
-		// Datei in den Speicher lesen
-		struct stat st;
-		if (stat(file_name.c_str(), &st) != 0)
-			throw CException("stat failed for file " + file_name);
-
-		size_t size = st.st_size;
-		char *buf = (char *)malloc(size);
-		if (!buf)
-			throw CException("out of memory");
+		printf("\nthe journal %s does not exist. Nothing to roll back.\n", GetJournalFile().c_str());
+		LoadControlFile();
+		return;
+	}
 
-		FILE *fh = fopen(file_name.c_str(), "rb");
-		size_t ret = fread(buf, 1, size, fh);
-		fclose(fh);
-		if (ret != size)
-			throw CException("reading file " + file_name + " failed!");
+	if (m_bInteractive)
+	{
+		printf("perform rollback (y/n)?");
+		char c = (char)_getch();
+		if (c == 'n')
+			return;
+	}
 
-		// Replacements durchfhren
-		for (auto &it : m_listReplacements)
-			buf = it.DoReplace(buf, size);
+	printf("\nperforming rollback...\n");
+	CPhaseStats stats = CPhaseStats::Begin();
 
-		// Backup erzeugen
-		Backup(file_name);
-		m_bDidReplace = true;
+	vector<CJournalEntry> entries;
+	list<CCommandShell> &commands = m_vecConfigs[0].m_listDelayedCommands;
+	commands.clear();
+	CJournal::Load(GetJournalFile(), commands, entries);
 
-		// Datei schreiben
-		fh = fopen(file_name.c_str(), "wb");
-		int i = errno;
-		if (!fh)
-			throw CException("fopen for writing file " + file_name + " failed! " + strerror(errno));
-		if (fwrite(buf, 1, size, fh) != size)
-			throw CException("writing file " + file_name + " failed!");
-		fclose(fh);
+	if (!CJournal::Rollback(entries))
+		throw CException("rollback failed for some files, the journal " + GetJournalFile() + " is kept.");
 
-		free(buf);
-	}
+	_unlink(GetJournalFile().c_str());
+	EndPhase("rollback", stats);
+	printf("done.\n");
 }
 
 
 // ===============================================================================
-//							CFileNode::Rollback
-//
-// performs a rollback for this file
+//								CAutoVersion::Clean
 // ===============================================================================
-void CFileNode::Rollback(const string &file_name)
+void CAutoVersion::Clean()
 {
-	if (m_bDidReplace)
-		::Rollback(file_name);
+	if (m_bInteractive)
+	{
+		printf("remove rollback files (y/n)?");
+		char c = (char)_getch();
+		if (c == 'n')
+			return;
+	}
+
+	printf("\nremoving rollback files...\n");
+	CPhaseStats stats = CPhaseStats::Begin();
+
+	if (CJournal::Exists(GetJournalFile()))
+	{
+		if (g_bVerbose)
+			printf("deleting %s\n", GetJournalFile().c_str());
+		_unlink(GetJournalFile().c_str());
+	}
+
+	EndPhase("clean", stats);
+	printf("done.\n");
 }
 
 
 // ===============================================================================
-//							CAutoVersion::SkipWhiteSpaces
+//								CAutoVersion::Check
+//
+// daemon request "check": reports the replacements, nothing is written
 // ===============================================================================
-void CAutoVersion::SkipWhiteSpaces(char *&p)
+void CAutoVersion::Check()
 {
-	while (*p == ' ' || *p == '\t')
-		p++;
+	printf("\nscanning for replacement actions...\n");
+	LoadControlFile();
+
+	vector<pair<const string, CFileNode> *> files;
+	for (auto &it : m_vecConfigs[0].m_mapFiles)
+		files.push_back(&it);
+
+	vector<char> must_replace;
+	CThreadPool pool(m_nThreads);
+	if (CheckFiles(files, must_replace, pool) == 0)
+		printf("nothing to replace\n");
 }
 
 
 // ===============================================================================
-//								CAutoVersion::SkipLine
-// 
-// only_white_spaces: if true, only white spaces and comments may appear
+//								CDaemon::GetDirectory
+//
+// the directory part of a file name, empty or ending with a separator
 // ===============================================================================
-void CAutoVersion::SkipLine(char *&p, bool only_white_spaces)
+string CDaemon::GetDirectory(const string &file_name)
 {
-	bool is_comment = false;
-
-	while (*p && *p != '\012' && *p != '\015')
-	{
-		if (*p == '#')
-			is_comment = true;
-
-		if (only_white_spaces && !is_comment && *p != ' ' && *p != '\t')
-		{
-			char c = *p;
-			throw CParseException((string)"unexpected character '" + c + 
-				(string)"'. Expected white-space or newline while scanning for end of line", m_nCurrentLine);
-		}
-
-		p++;
-	}
+	size_t pos = file_name.find_last_of("/\\");
+	return pos == string::npos ? string() : file_name.substr(0, pos + 1);
+}
 
-	if (*p)
-		m_nCurrentLine++;
 
-	if (*p == '\015')	// Dos / Windows: 0x0d / 0x0a sequence
-		p++;
+#ifdef __linux__
+static volatile sig_atomic_t s_bStopDaemon = 0;		// set by SIGINT and SIGTERM
 
-	if (*p)
-		p++;
+static void StopDaemon(int)
+{
+	s_bStopDaemon = 1;
 }
 
 
 // ===============================================================================
-//								CAutoVersion::SkipComment
+//								GetSocketAddress
 // ===============================================================================
-void CAutoVersion::SkipComment(char *&p)
+static void GetSocketAddress(const string &socket_file, struct sockaddr_un &addr)
 {
-	while (*p && *p != '\012' && *p != '\015')
-		p++;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (socket_file.length() >= sizeof(addr.sun_path))
+		throw CException("the path of the socket " + socket_file + " is too long");
+	memcpy(addr.sun_path, socket_file.c_str(), socket_file.length());
 }
 
 
 // ===============================================================================
-//								CAutoVersion::Scan
-//
-// Search for given string at the *beginning* of a new line.
+//								CDaemon::~CDaemon
 // ===============================================================================
-void CAutoVersion::Scan(char *&p, const char *token)
+CDaemon::~CDaemon()
 {
-	size_t token_len = strlen(token);
-
-	while (*p)
-	{
-		SkipLine(p, false);
+	Close();
 
-		SkipWhiteSpaces(p);
-		if (strncmp(p, token, token_len) == 0)
-			return;
-	}
+	if (m_nInotify >= 0)
+		close(m_nInotify);
 }
 
 
 // ===============================================================================
-//							CAutoVersion::GetIdentifier
+//								CDaemon::Close
+//
+// closes and removes the socket, no more requests are accepted
 // ===============================================================================
-string CAutoVersion::GetIdentifier(char *&p)
+void CDaemon::Close()
 {
-	SkipWhiteSpaces(p);
-
-	const int MaxIdentLen = 256;
-	char ident[MaxIdentLen + 1];
-
-	int i = 0;
-	while (*p && *p != ' ' && *p != '\t' && *p != '\012' && *p != '\015')
+	if (m_nSocket >= 0)
 	{
-		ident[i++] = *p++;
-		if (i >= MaxIdentLen)
-			throw CParseException("name for contant too long", m_nCurrentLine);
+		close(m_nSocket);
+		m_nSocket = -1;
+		if (!m_strSocketFile.empty())
+			unlink(m_strSocketFile.c_str());
 	}
-
-	if (i == 0)
-		throw CParseException("expected identifier", m_nCurrentLine);
-
-	ident[i] = '\0';
-
-	return ident;
 }
 
 
 // ===============================================================================
-//							CAutoVersion::GetLiteral
+//								CDaemon::Open
 //
-// returns the position of the literal in "offset"
+// creates the socket and starts watching the directory of the Control File.
+// A socket left behind by a daemon, which was killed, is replaced.
 // ===============================================================================
-string CAutoVersion::GetLiteral(char *&p, size_t *offset)
+void CDaemon::Open(const string &control_file, const string &socket_file)
 {
-	SkipWhiteSpaces(p);
-
-	if (*p++ != '"')
-		throw CParseException("\" expected", m_nCurrentLine);
-
-	if (offset)
-		*offset = (p - m_pBuffer);
+	m_strControlFile = control_file;
 
-	const int MaxIdentLen = 256;
-	char ident[MaxIdentLen + 1];
+	struct sockaddr_un addr;
+	GetSocketAddress(socket_file, addr);
 
-	int i = 0;
-	while (*p && *p != '"' && *p != '\012' && *p != '\015')
+	int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (probe >= 0)
 	{
-		if (*p == '\\' && *(p + 1) == '"')			// this is an escaped "
-			p++;
-		else if (*p == '\\' && *(p + 1) == '\\')	// this is an escaped backslash
-			p++;
-
-		ident[i++] = *p++;
-		if (i >= MaxIdentLen)
-			throw CParseException("literal too long", m_nCurrentLine);
+		bool running = connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+		close(probe);
+		if (running)
+			throw CException("a daemon is already running for " + control_file);
 	}
+	unlink(socket_file.c_str());
 
-	if (*p++ != '"')
-		throw CParseException("missing \"", m_nCurrentLine);
+	m_nSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (m_nSocket < 0 || bind(m_nSocket, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+		throw CException("can not create the socket " + socket_file);
+	m_strSocketFile = socket_file;
 
-	if (i == 0)
-		throw CParseException("empty literal not allowed", m_nCurrentLine);
+	if (listen(m_nSocket, 16) != 0)
+		throw CException("can not create the socket " + socket_file);
 
-	ident[i] = '\0';
+	m_nInotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (m_nInotify < 0)
+		throw CException("inotify is not available");
 
-	return ident;
+	if (Watch(GetDirectory(control_file), false) < 0)
+		throw CException("can not watch the directory of " + control_file);
+
+	// a client going away must not stop the daemon
+	signal(SIGPIPE, SIG_IGN);
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = StopDaemon;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
 }
 
 
 // ===============================================================================
-//							CAutoVersion::GetLiteralOrSymbol
+//								CDaemon::Watch
+//
+// Returns the watch descriptor of a directory, -1 if it can not be watched.
 // ===============================================================================
-string CAutoVersion::GetLiteralOrSymbol(char *&p)
+int CDaemon::Watch(const string &dir, bool pattern)
 {
-	SkipWhiteSpaces(p);
-
-	if (*p == '"')
-		return GetLiteral(p);
-
-	string ident = GetIdentifier(p);
+	auto it = m_mapDirs.find(dir);
+	if (it == m_mapDirs.end())
+	{
+		int wd = inotify_add_watch(m_nInotify, dir.empty() ? "." : dir.c_str(),
+								   IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+								   IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+		it = m_mapDirs.emplace(dir, wd).first;
+		if (wd >= 0)
+		{
+			SWatch &watch = m_mapWatches[wd];		// the same directory may be named in several ways
+			if (watch.m_vecDirs.empty())
+				watch.m_bPattern = false;
+			watch.m_vecDirs.push_back(dir);
+		}
+		else if (g_bVerbose)
+			printf("WARNING: can not watch directory %s\n", dir.empty() ? "." : dir.c_str());
+	}
 
-	auto it = m_mapConstantDefs.find(ident);
-	if (it == m_mapConstantDefs.end())
-		throw CParseException("symbol " + ident + " undefined", m_nCurrentLine);
+	if (it->second >= 0 && pattern)
+		m_mapWatches[it->second].m_bPattern = true;
 
 	return it->second;
 }
 
 
 // ===============================================================================
-//							CAutoVersion::ParseConstantDef
+//								CDaemon::WatchFiles
+//
+// Watches the directories of the files and of the patterns. Returns for each
+// file, if its directory is watched. A file in a directory, which was not
+// watched before, has no valid state yet. The result is kept, until the
+// Control File is parsed again or a watch is removed.
 // ===============================================================================
-void CAutoVersion::ParseConstantDef(char *&p)
+const vector<char> &CDaemon::WatchFiles(const string &base_path, const vector<pair<const string, CFileNode> *> &files)
 {
-	string ident = GetIdentifier(p);
-	string what = GetLiteralOrSymbol(p);
+	if (m_bWatched && m_vecWatched.size() == files.size())
+		return m_vecWatched;
+
+	for (auto &dir : m_vecPatternDirs)
+		Watch(dir, true);
 
-	auto it = m_mapConstantDefs.find(ident);
-	if (it != m_mapConstantDefs.end())
-		throw CParseException("duplicate symbol " + ident, m_nCurrentLine);
+	m_vecWatched.assign(files.size(), 0);
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		string dir = GetDirectory(base_path + PATH_SEPARATOR + files[i]->first);
+		if (m_mapDirs.find(dir) == m_mapDirs.end())
+			m_ScanCache.EraseDirectory(dir);
+		m_vecWatched[i] = Watch(dir, false) >= 0;
+	}
 
-	pair<string, string> cd(ident, what);
-	m_mapConstantDefs.insert(cd);
+	m_bWatched = true;
+	return m_vecWatched;
 }
 
 
 // ===============================================================================
-//							CAutoVersion::ParseReplacement
+//								CDaemon::ReadEvents
+//
+// Processes the pending inotify events: a changed file loses its state, the
+// Control File is parsed again, if it changed or a directory walked by a
+// pattern got or lost a file.
 // ===============================================================================
-void CAutoVersion::ParseReplacement(EReplaceOp op, char *&p)
+void CDaemon::ReadEvents()
 {
-	size_t offset;
-	string file_name = GetLiteral(p);		// file name
-	string what = GetLiteral(p, &offset);	// what to replace
+	alignas(struct inotify_event) char buf[65536];
+	for (;;)
+	{
+		ssize_t len = read(m_nInotify, buf, sizeof(buf));
+		if (len <= 0)
+			break;		// EAGAIN, no more events
 
-	SkipWhiteSpaces(p);
-	if (*p != '@')
-		throw CParseException("@ symbol missing", m_nCurrentLine);
+		for (char *p = buf; p < buf + len;)
+		{
+			const struct inotify_event *event = (const struct inotify_event *)p;
+			p += sizeof(struct inotify_event) + event->len;
 
-	string ident = GetIdentifier(++p);		// get replace with (this is a constant name)
+			if (event->mask & IN_Q_OVERFLOW)
+			{
+				// events were lost, nothing is known any more
+				m_ScanCache.Clear();
+				m_bParsed = false;
+				m_bWatched = false;
+				continue;
+			}
 
-	// get the value of the constant
-	string with;
-	auto it = m_mapConstantDefs.find(ident);
-	if (it == m_mapConstantDefs.end())
-		throw CParseException("constant '" + ident + "' not found", m_nCurrentLine);
+			auto it = m_mapWatches.find(event->wd);
+			if (it == m_mapWatches.end())
+				continue;
+
+			SWatch &watch = it->second;
+			if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+			{
+				// the directory is gone, it is watched again when needed
+				for (auto &dir : watch.m_vecDirs)
+				{
+					m_ScanCache.EraseDirectory(dir);
+					m_mapDirs.erase(dir);
+					if (GetDirectory(m_strControlFile) == dir)
+						m_bParsed = false;
+				}
+				if (watch.m_bPattern)
+					m_bParsed = false;
+				if (!(event->mask & IN_IGNORED))
+					inotify_rm_watch(m_nInotify, event->wd);
+				m_mapWatches.erase(it);
+				m_bWatched = false;
+				continue;
+			}
 
-	with = it->second;
-	if (op == enRoBinary && what.length() != with.length())
-		throw CParseException("for binary replacements the length of the find string must be equal to the length of the replace string", m_nCurrentLine);
+			if (event->len == 0)
+				continue;
 
-	CReplace replace(op, what, with, offset);
+			for (auto &dir : watch.m_vecDirs)
+			{
+				string file_name = dir + event->name;
+				m_ScanCache.Erase(file_name);
+				if (file_name == m_strControlFile)
+					m_bParsed = false;
+			}
 
-	auto itf = m_mapFiles.find(file_name);
-	if (itf != m_mapFiles.end())
-	{
-		itf->second.Add(replace);
-	}
-	else
-	{
-		CFileNode node;
-		node.Add(replace);
-		pair<string, CFileNode> mf(file_name, node);
-		m_mapFiles.insert(mf);
+			if (watch.m_bPattern && (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)))
+				m_bParsed = false;
+		}
 	}
 }
 
 
 // ===============================================================================
-//							CAutoVersion::ParseMessage
+//								CDaemon::Accept
+//
+// Waits for the next client and processes the events meanwhile. Returns the
+// socket of the client, or -1 if the daemon is to stop.
 // ===============================================================================
-void CAutoVersion::ParseMessage(char *&p)
+int CDaemon::Accept()
 {
-	const int MaxIdentLen = 2048;
-	char ident[MaxIdentLen + 1];
+	struct pollfd fds[2];
+	fds[0].fd		= m_nSocket;
+	fds[0].events	= POLLIN;
+	fds[1].fd		= m_nInotify;
+	fds[1].events	= POLLIN;
 
-	int i = 0;
-	while (*p && *p != '\012' && *p != '\015')
+	while (!s_bStopDaemon)
 	{
-		ident[i++] = *p++;
-		if (i >= MaxIdentLen)
-			throw CParseException("message too long", m_nCurrentLine);
-	}
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw CException("waiting for requests failed");
+		}
+
+		if (fds[1].revents & POLLIN)
+			ReadEvents();
 
-	ident[i] = '\0';
+		if (fds[0].revents & POLLIN)
+		{
+			int client = accept4(m_nSocket, NULL, NULL, SOCK_CLOEXEC);
+			if (client >= 0)
+			{
+				// all changes up to the request are seen by it
+				ReadEvents();
+				return client;
+			}
+		}
+	}
 
-	m_listMessages.push_back(ident);
+	return -1;
 }
 
 
 // ===============================================================================
-//							CAutoVersion::ParseCommand
+//								CDaemon::Request
+//
+// Client side: sends a request to the daemon and copies its output to stdout.
+// The output ends with a zero byte and the exit status of the request, which
+// is returned.
 // ===============================================================================
-void CAutoVersion::ParseCommand(char *&p)
+int CDaemon::Request(const string &socket_file, const string &request)
 {
-	string ident = GetIdentifier(p);
+	struct sockaddr_un addr;
+	GetSocketAddress(socket_file, addr);
 
-	if (ident == "Basepath")
-	{
-		if (!m_strBasePath.empty())
-			throw CParseException("basepath already defined", m_nCurrentLine);
-
-		m_strBasePath = GetLiteral(p);
-	}
-	else if (ident == "if")
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
 	{
-		ident = GetIdentifier(p);
-
-		auto it = m_setDefines.find(ident);
-		if (it == m_setDefines.end())
-		{
-			// condition failed, search matching %else or %end token
-			int if_count = 1;
-
-			while (if_count > 0)
-			{
-				// search next command token
-				Scan(p, "%");
-				if (!p)
-					throw CParseException("missing %end token for if-token", m_nCurrentLine);
-
-				if (strncmp(p, "%if", 3) == 0)
-				{
-					if_count++;
-					p += 3;
-				}
-				else if (strncmp(p, "%else", 5) == 0)
-				{
-					if (if_count == 1)
-						if_count--;
-					p += 5;
-				}
-				else if (strncmp(p, "%end", 4) == 0)
-				{
-					if_count--;
-					p += 4;
-				}
-				else
-					p++;
-			}
-		}
+		if (fd >= 0)
+			close(fd);
+		throw CException("no daemon is running for " + socket_file);
 	}
-	else if (ident == "else")
-	{
-		// skip until matching %end token
-		int if_count = 1;
-
-		while (if_count > 0)
-		{
-			// search next command token
-			Scan(p, "%");
-			if (!p)
-				throw CParseException("missing %end token for if-token", m_nCurrentLine);
 
-			if (strncmp(p, "%if", 3) == 0)
-			{
-				if_count++;
-				p += 3;
-			}
-			else if (strncmp(p, "%end", 4) == 0)
-			{
-				if_count--;
-				p += 4;
-			}
-			else
-				p++;
-		}
-	}
-	else if (ident == "end")
+	string line = request + "\n";
+	if (write(fd, line.c_str(), line.length()) != (ssize_t)line.length())
 	{
-		// do nothing, just overread
+		close(fd);
+		throw CException("sending the request to " + socket_file + " failed!");
 	}
-	else if (ident == "shell")
-	{
-		// get the shell command-string
-		string arg = GetLiteral(p);
 
-		// Create the delayed command
-		CCommandShell cmd;
-		cmd.AddArg(arg);
-		m_listDelayedCommands.push_back(cmd);
+	char buf[65536];
+	string tail;		// the last two bytes received
+	for (;;)
+	{
+		ssize_t len = read(fd, buf, sizeof(buf));
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			break;
+
+		tail.append(buf, len);
+		if (tail.length() > 2)
+		{
+			fwrite(tail.c_str(), 1, tail.length() - 2, stdout);
+			tail.erase(0, tail.length() - 2);
+		}
 	}
-	else
-		throw CParseException("unkown %-command", m_nCurrentLine);
+	close(fd);
+	fflush(stdout);
+
+	if (tail.length() != 2 || tail[0] != '\0')
+		throw CException("the daemon did not complete the request");
+
+	return (unsigned char)tail[1];
 }
 
 
 // ===============================================================================
-//							CAutoVersion::ParseControlFile
+//								CAutoVersion::ServeRequest
+//
+// performs a request of a client, its output goes to the client. Returns the
+// exit status.
 // ===============================================================================
-void CAutoVersion::ParseControlFile()
+int CAutoVersion::ServeRequest(const string &request, int client)
 {
-	struct stat st;
-	if (stat(m_strControlFile.c_str(), &st) != 0)
-		throw CException("stat failed for file " + m_strControlFile);
-
-	m_pBuffer = (char *)malloc(st.st_size + 1);
-	if (!m_pBuffer)
-		throw CException("out of memory");
-
-	FILE *fh = fopen(m_strControlFile.c_str(), "rb");	// binary mode is important! otherwise \015 is eaten on read and therefore
-	size_t ret = fread(m_pBuffer, 1, st.st_size, fh);	// the computed offsets into the Control File are wrong, so the updating
-	m_pBuffer[ret] = '\0';								// the Control File later would fail!
-	fclose(fh);
+	fflush(stdout);
+	int saved = dup(STDOUT_FILENO);
+	dup2(client, STDOUT_FILENO);
 
-	char *p = m_pBuffer;
-	while (*p)
+	// Rollback and clean do not use the parsed Control File, but replace its commands
+	m_vecPhases.clear();
+	if (request == "rollback" || request == "clean")
 	{
-		SkipWhiteSpaces(p);
-		char c = *p;
+		m_pDaemon->m_bParsed = false;
+		m_vecConfigs.assign(1, CConfiguration());
+	}
 
-		if (c != '\012' && c != '\015')
+	int status = 0;
+	try
+	{
+		if (request == "check")
 		{
-			p++;
-			if (c == '@')
-				ParseConstantDef(p);
-			else if (c == '&')
-				ParseReplacement(enRoText, p);
-			else if (c == '$')
-				ParseReplacement(enRoBinary, p);
-			else if (c == '!')
-				ParseMessage(p);
-			else if (c == '%')
-				ParseCommand(p);
-			else if (c == '#')
-				SkipComment(p);
-			else
-				throw CParseException("unknown command in Control File", m_nCurrentLine);
+			Check();
+		}
+		else if (request == "replace")
+		{
+			Replace();
+			ExecDelayedCommands();
+			ShowMessages();
+		}
+		else if (request == "rollback")
+		{
+			Rollback();
+			ExecDelayedCommands();
+		}
+		else if (request == "clean")
+		{
+			Clean();
 		}
+		else
+			throw CException("unknown request " + request);
 
-		SkipLine(p);
+		WriteTimings(request.c_str());
+		WriteStats(request.c_str());
+	}
+	catch (exception &e)
+	{
+		printf("\nError: %s\n", e.what());
+		RescueRollback();
+		status = 1;
 	}
 
-	// do not free(m_pBuffer), because we will use it to update the Control File
+	m_Journal.Close();
+
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+	return status;
 }
 
 
 // ===============================================================================
-//								CAutoVersion::UpdateControlFile
+//								CAutoVersion::Serve
+//
+// Daemon mode: performs the requests of the clients one after another, until
+// a client sends "stop" or the daemon gets SIGINT or SIGTERM. The questions
+// are answered with yes, the clients can not be asked.
 // ===============================================================================
-void CAutoVersion::UpdateControlFile()
+void CAutoVersion::Serve()
 {
-	if (g_bVerbose)
-		printf("\nupdating Control File %s... ", m_strControlFile.c_str());
+	if (m_bMatrix)
+		throw CException("the daemon does not support matrix mode");
 
-	// Datei in den Speicher lesen
-	struct stat st;
-	if (stat(m_strControlFile.c_str(), &st) != 0)
-		throw CException("stat failed for file " + m_strControlFile);
+	CDaemon daemon;
+	daemon.Open(m_strControlFile, GetSocketFile());
+	m_pDaemon		= &daemon;
+	m_bInteractive	= false;
 
-	size_t size = st.st_size;
-	char *buf = (char *)malloc(size);
-	if (!buf)
-		throw CException("out of memory");
+	printf("\ndaemon waiting for requests on %s\n", GetSocketFile().c_str());
+	fflush(stdout);
 
-	FILE *fh = fopen(m_strControlFile.c_str(), "rb");
-	size_t ret = fread(buf, 1, size, fh);
-	fclose(fh);
-	if (ret != size)
-		throw CException("reading file " + m_strControlFile + " failed!");
+	int client;
+	while ((client = daemon.Accept()) >= 0)
+	{
+		// the request is a single line
+		string request;
+		char c;
+		while (request.length() < 64 && read(client, &c, 1) == 1 && c != '\n')
+			request += c;
+
+		bool stop = request == "stop";
+		int status = 0;
+		if (!stop)
+		{
+			auto start = chrono::steady_clock::now();
+			status = ServeRequest(request, client);
+			printf("%s: %s (%.3f s)\n", request.c_str(), status ? "failed" : "done",
+				   chrono::duration<double>(chrono::steady_clock::now() - start).count());
+			fflush(stdout);
+		}
 
-	// Wir mssen die Replacements aufsteigend nach CReplace::m_nControlFilePos sortieren, da
-	// durch Ersetzungen krzere oder lngere Strings entstehen knnen und wir mit einem Korrektur-Offset arbeiten.
+		// the socket is gone, when the client of "stop" returns
+		if (stop)
+			daemon.Close();
 
-	// Fr jede Datei:
-	vector<CReplace> replacements;
-	for (auto it : m_mapFiles)
-	{
-		// Alle Replacements auf das Control File anwenden
-		list<CReplace> &listReplacements = it.second.GetReplacements();
-		for (auto it : listReplacements)
-			replacements.push_back(it);
+		char end[2] = { '\0', (char)status };
+		if (write(client, end, sizeof(end)) != sizeof(end) && g_bVerbose)
+			printf("WARNING: the client of the request %s is gone\n", request.c_str());
+		close(client);
+
+		if (stop)
+			break;
 	}
 
-	sort(replacements.begin(), replacements.end(), 
-		[](CReplace const &a, CReplace const &b) { return a.m_nControlFilePos < b.m_nControlFilePos; });
+	m_pDaemon = NULL;
+	printf("daemon stopped.\n");
+}
+#else
+CDaemon::~CDaemon()
+{
+}
+void CDaemon::Close()
+{
+}
 
-	int offset = 0;
-	for (auto it : replacements)
-		buf = it.UpdateControlFile(buf, size, offset);
+void CDaemon::Open(const string &, const string &)
+{
+	throw CException("the daemon is only supported on Linux");
+}
 
-	Backup(m_strControlFile);
-	m_bControlFileSaved	= true;
+int CDaemon::Watch(const string &, bool)
+{
+	return -1;
+}
 
-	// Datei schreiben
-	fh = fopen(m_strControlFile.c_str(), "wb");
-	if (fwrite(buf, 1, size, fh) != size)
-		throw CException("writing file " + m_strControlFile + " failed!");
-	fclose(fh);
+const vector<char> &CDaemon::WatchFiles(const string &, const vector<pair<const string, CFileNode> *> &files)
+{
+	m_vecWatched.assign(files.size(), 0);
+	return m_vecWatched;
+}
 
-	free(buf);
-	if (g_bVerbose)
-		printf("done.\n");
+void CDaemon::ReadEvents()
+{
 }
 
+int CDaemon::Accept()
+{
+	return -1;
+}
 
-// ===============================================================================
-//								CAutoVersion::Replace
-// ===============================================================================
-void CAutoVersion::Replace()
+int CDaemon::Request(const string &, const string &)
 {
-	printf("\nscanning for replacement actions...\n");
-	ParseControlFile();
-	// Dump();
+	throw CException("the daemon is only supported on Linux");
+}
 
-	int  count = 0;
-	bool has_replacements = false;
+int CAutoVersion::ServeRequest(const string &, int)
+{
+	return 1;
+}
 
-	// Fr jede Datei:
-	for (auto &it : m_mapFiles)
-	{
-		// Auf Replacements prfen
-		string fname = m_strBasePath + "\\" + it.first;		// file name
-		if (it.second.CheckReplacements(fname))
-		{
-			count++;
-			has_replacements = true;
-		}
-	}
+void CAutoVersion::Serve()
+{
+	throw CException("the daemon is only supported on Linux");
+}
+#endif
 
-	printf("\nscanning finished. (%d files will have replacements)\n\n", count);
 
-	if (has_replacements)
+// ===============================================================================
+//										GetProcessUsage
+//
+// the user and system time of the process in seconds and its peak resident
+// set size in bytes
+// ===============================================================================
+static void GetProcessUsage(double &cpu, unsigned long long &peak_rss)
+{
+#ifdef WIN32
+	FILETIME creation, exit, kernel, user;
+	cpu = 0;
+	if (GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
 	{
-		if (m_bInteractive)
-		{
-			printf("perform replacements (y/n)?");
-			char c = (char)_getch();
-			if (c == 'n')
-				return;
-			printf("\n");
-		}
+		unsigned long long ticks = ((unsigned long long)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) +
+								   ((unsigned long long)user.dwHighDateTime << 32 | user.dwLowDateTime);
+		cpu = ticks / 1e7;		// 100 ns units
 	}
-	else
+
+	PROCESS_MEMORY_COUNTERS pmc;
+	peak_rss = GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)) ? pmc.PeakWorkingSetSize : 0;
+#else
+	struct rusage ru;
+	cpu = 0;
+	peak_rss = 0;
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
 	{
-		printf("nothing to replace\n");
-		return;
+		cpu = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+		peak_rss = (unsigned long long)ru.ru_maxrss * 1024;		// KB
 	}
+#endif
+}
 
-	// Fr jede Datei:
-	printf("replacing...\n");
-	for (auto &it : m_mapFiles)
+
+// ===============================================================================
+//							CPhaseStats::Begin
+// ===============================================================================
+CPhaseStats CPhaseStats::Begin()
+{
+	CPhaseStats stats;
+	stats.m_tStart = chrono::steady_clock::now();
+
+	if (g_bStats)
 	{
-		// Replacements durchfhren
-		string fname = m_strBasePath + "\\" + it.first;		// file name
-		it.second.DoReplacments(fname);
+		GetProcessUsage(stats.m_dCpu, stats.m_nPeakRss);
+		stats.m_nBytesRead		= g_nBytesRead;
+		stats.m_nBytesWritten	= g_nBytesWritten;
+		stats.m_nFilesOpened	= g_nFilesOpened;
+		stats.m_nAllocations	= g_nAllocations;
 	}
 
-	UpdateControlFile();
-	printf("replacement finished.\n");
+	return stats;
 }
 
 
 // ===============================================================================
-//								CAutoVersion::RescueRollback
-//
-// Wird im Fehlerfall aufgerufen, fhrt nur Rollback fr die whrend des
-// Programmablaufs erzeugten .avbak Dateien durch.
+//							CPhaseStats::End
 // ===============================================================================
-void CAutoVersion::RescueRollback()
+void CPhaseStats::End(const char *phase)
 {
-	printf("\nperforming rescue rollback...\n");
+	m_strPhase	= phase;
+	m_dWall		= chrono::duration<double>(chrono::steady_clock::now() - m_tStart).count();
 
-	for (auto it : m_mapFiles)
+	if (g_bStats)
 	{
-		// Rollback durchfhren
-		string fname = m_strBasePath + "\\" + it.first;		// file name
-		it.second.Rollback(fname);
+		double cpu;
+		GetProcessUsage(cpu, m_nPeakRss);
+		m_dCpu			= cpu - m_dCpu;
+		m_nBytesRead	= g_nBytesRead - m_nBytesRead;
+		m_nBytesWritten	= g_nBytesWritten - m_nBytesWritten;
+		m_nFilesOpened	= g_nFilesOpened - m_nFilesOpened;
+		m_nAllocations	= g_nAllocations - m_nAllocations;
 	}
+}
 
-	if (m_bControlFileSaved)
-		::Rollback(m_strControlFile);
 
-	printf("done.\n");
+// ===============================================================================
+//								CAutoVersion::EndPhase
+//
+// records the phase, which started with "stats"
+// ===============================================================================
+void CAutoVersion::EndPhase(const char *phase, CPhaseStats &stats)
+{
+	stats.End(phase);
+	m_vecPhases.push_back(stats);
+
+	if (g_bVerbose)
+		printf("%s: %.3f s\n", phase, stats.m_dWall);
 }
 
 
 // ===============================================================================
-//								CAutoVersion::Rollback
+//										JsonString
 //
-// Normale Rollback-Funktion
+// "s" as a quoted JSON string
 // ===============================================================================
-void CAutoVersion::Rollback()
+static string JsonString(const string &s)
 {
-	if (m_bInteractive)
+	string out = "\"";
+	for (unsigned char c : s)
 	{
-		printf("perform rollback (y/n)?");
-		char c = (char)_getch();
-		if (c == 'n')
-			return;
+		if (c == '"' || c == '\\')
+		{
+			out += '\\';
+			out += (char)c;
+		}
+		else if (c < 0x20)
+		{
+			char buf[8];
+			sprintf(buf, "\\u%04x", c);
+			out += buf;
+		}
+		else
+			out += (char)c;
 	}
+	out += '"';
 
-	printf("\nperforming rollback...\n");
-	ParseControlFile();
+	return out;
+}
+
+
+// ===============================================================================
+//								CAutoVersion::WriteTimings
+//
+// Appends the durations of the phases of the run to the timing file as a
+// single line of JSON, so the runs of different releases can be compared:
+// {"version":"2.00","operation":"replace","control_file":"...","threads":1,
+//  "configurations":1,"files":4,"phases":{"parse":0.001,...}}
+// ===============================================================================
+void CAutoVersion::WriteTimings(const char *operation)
+{
+	if (m_strTimingFile.empty())
+		return;
+
+	size_t files = 0;
+	for (auto &config : m_vecConfigs)
+		files += config.m_mapFiles.size();
 
-	// Fr jede Datei testen, ob eine .avbak Datei besteht.
-	// Falls ja, dann Rollback fr diese Datei durchfhren.
-	for (auto it : m_mapFiles)
+	string line = "{\"version\":" + JsonString(Version) +
+				  ",\"operation\":" + JsonString(operation) +
+				  ",\"control_file\":" + JsonString(m_strControlFile) +
+				  ",\"threads\":" + ToString(m_nThreads) +
+				  ",\"configurations\":" + ToString(m_vecConfigs.size()) +
+				  ",\"files\":" + ToString(files) +
+				  ",\"phases\":{";
+
+	for (size_t i = 0; i < m_vecPhases.size(); i++)
 	{
-		string fname = m_strBasePath + "\\" + it.first;		// file name
-		if (CanRollback(fname))
-			::Rollback(fname);
+		char seconds[32];
+		sprintf(seconds, "%.6f", m_vecPhases[i].m_dWall);
+		line += (i > 0 ? "," : "") + JsonString(m_vecPhases[i].m_strPhase) + ":" + seconds;
 	}
+	line += "}}\n";
 
-	// Zum Schlu das Control File testen
-	if (CanRollback(m_strControlFile))
-		::Rollback(m_strControlFile);
-
-	printf("done.\n");
+	FILE *fh = fopen(m_strTimingFile.c_str(), "ab");
+	if (!fh || fwrite(line.c_str(), 1, line.length(), fh) != line.length())
+		printf("WARNING: writing the timings to %s failed\n", m_strTimingFile.c_str());
+	if (fh)
+		fclose(fh);
 }
 
 
 // ===============================================================================
-//								CAutoVersion::Clean
+//								CAutoVersion::WriteStats
+//
+// Prints the statistics report of the run, a table per phase and the number
+// of occurrences replaced per replacement, or the same as JSON.
 // ===============================================================================
-void CAutoVersion::Clean()
+void CAutoVersion::WriteStats(const char *operation)
 {
-	if (m_bInteractive)
+	if (m_enStats == enStatsNone)
+		return;
+
+	CPhaseStats total;
+	for (auto &it : m_vecPhases)
 	{
-		printf("remove rollback files (y/n)?");
-		char c = (char)_getch();
-		if (c == 'n')
-			return;
+		total.m_dWall			+= it.m_dWall;
+		total.m_dCpu			+= it.m_dCpu;
+		total.m_nBytesRead		+= it.m_nBytesRead;
+		total.m_nBytesWritten	+= it.m_nBytesWritten;
+		total.m_nFilesOpened	+= it.m_nFilesOpened;
+		total.m_nAllocations	+= it.m_nAllocations;
+		total.m_nPeakRss		= max(total.m_nPeakRss, it.m_nPeakRss);
 	}
+	total.m_strPhase = "total";
 
-	printf("\nremoving rollback files...\n");
-	ParseControlFile();
-
-	// Fr jede Datei testen, ob eine .avbak Datei besteht.
-	// Falls ja, dann diese Datei lschen.
-	for (auto it : m_mapFiles)
+	if (m_enStats == enStatsTable)
 	{
-		string fname = m_strBasePath + "\\" + it.first;		// file name
-		if (CanRollback(fname))
+		printf("\n%-10s %10s %10s %12s %12s %8s %12s %12s\n", "phase", "wall s", "cpu s", "read MB", "written MB", "files", "allocations", "peak RSS MB");
+
+		vector<const CPhaseStats *> rows;
+		for (auto &it : m_vecPhases)
+			rows.push_back(&it);
+		rows.push_back(&total);
+
+		for (auto it : rows)
 		{
-			fname += ".avbak";
-			if (g_bVerbose)
-				printf("deleting %s\n", fname.c_str());
-			_unlink(fname.c_str());
+			printf("%-10s %10.3f %10.3f %12.2f %12.2f %8llu %12llu %12.1f\n", it->m_strPhase.c_str(), it->m_dWall, it->m_dCpu,
+				it->m_nBytesRead / 1048576.0, it->m_nBytesWritten / 1048576.0, it->m_nFilesOpened, it->m_nAllocations, it->m_nPeakRss / 1048576.0);
+		}
+
+		printf("\nreplaced:\n");
+		for (auto &config : m_vecConfigs)
+		{
+			for (auto &it : config.m_mapFiles)
+			{
+				for (auto &r : it.second.GetReplacements())
+				{
+					printf("%8llu  %s%s%s: '%s' -> '%s'\n", (unsigned long long)r.GetReplaced(), config.m_strOutputRoot.c_str(),
+						m_bMatrix ? ": " : "", it.first.c_str(), r.GetWhat().c_str(), r.GetWith().c_str());
+				}
+			}
 		}
+		return;
 	}
 
-	// Zum Schlu das Control File testen
-	if (CanRollback(m_strControlFile))
+	string json = "{\"version\":" + JsonString(Version) + ",\"operation\":" + JsonString(operation) + ",\"phases\":[";
+	for (size_t i = 0; i <= m_vecPhases.size(); i++)
 	{
-		string fname = m_strControlFile + ".avbak";
-		if (g_bVerbose)
-			printf("deleting %s\n", fname.c_str());
-		_unlink(fname.c_str());
+		const CPhaseStats &it = i < m_vecPhases.size() ? m_vecPhases[i] : total;
+
+		char numbers[256];
+		sprintf(numbers, ",\"wall\":%.6f,\"cpu\":%.6f,\"bytes_read\":%llu,\"bytes_written\":%llu,\"files_opened\":%llu,\"allocations\":%llu,\"peak_rss\":%llu}",
+			it.m_dWall, it.m_dCpu, it.m_nBytesRead, it.m_nBytesWritten, it.m_nFilesOpened, it.m_nAllocations, it.m_nPeakRss);
+		json += (i > 0 ? ",{\"phase\":" : "{\"phase\":") + JsonString(it.m_strPhase) + numbers;
 	}
+	json += "],\"replacements\":[";
 
-	printf("done.\n");
+	bool first = true;
+	for (auto &config : m_vecConfigs)
+	{
+		for (auto &it : config.m_mapFiles)
+		{
+			for (auto &r : it.second.GetReplacements())
+			{
+				json += first ? "{" : ",{";
+				if (m_bMatrix)
+					json += "\"output_root\":" + JsonString(config.m_strOutputRoot) + ",";
+				json += "\"file\":" + JsonString(it.first) + ",\"what\":" + JsonString(r.GetWhat()) +
+						",\"with\":" + JsonString(r.GetWith()) + ",\"replaced\":" + ToString(r.GetReplaced()) + "}";
+				first = false;
+			}
+		}
+	}
+	json += "]}\n";
+
+	if (m_strStatsFile.empty())
+		printf("\n%s", json.c_str());
+	else
+		WriteFileContents(m_strStatsFile, json.c_str(), json.length());
 }
 
 
+#ifndef AV_NO_MAIN
 // ===============================================================================
 //										main
+//
+// AV_NO_MAIN leaves it out, when the tests include this file.
 // ===============================================================================
 int main(int argc, char* argv[])
 {
-	printf("\nAutoVersion v2.00 - Copyright (c) 2024 T. Radde\n");
+	printf("\nAutoVersion v%s - Copyright (c) 2024 T. Radde\n", Version);
 
-	if (argc < 2 || argc > 6 )
+	if (argc < 2)
 	{
-		cerr << "Syntax: " << argv[0] << " [-r | -c] [-d<ident>] [-v] [-y] ControlFile"
+		cerr << "Syntax: " << argv[0] << " [-r | -c] [-d<ident>] [-x<dir>[=<ident>,...]] [-i] [-j<N>] [-m<MB>] [-w<MB>] [-p] [-s] [-t<file>] [--stats | --stats-json[=<file>]] [--plan=<file> | --apply=<file>] [--daemon | --request=<op>] [-v] [-y] ControlFile"
 			 << endl;
 		cerr << "        -r: Rollback" << endl;
 		cerr << "        -c: Clean (delete backups)" << endl;
 		cerr << "        -d: define ident for conditional replace" << endl;
+		cerr << "        -x: matrix mode, adds a configuration with the given idents defined, its" << endl;
+		cerr << "            results are written below dir, the files and the Control File are not changed" << endl;
+		cerr << "        -i: incremental, skip files unchanged since the last run" << endl;
+		cerr << "        -j: number of files processed in parallel, default 1" << endl;
+		cerr << "        -m: memory (in MB) for keeping scanned files until they are replaced, default 256" << endl;
+		cerr << "        -w: files larger than this (in MB) are processed in windows of this size, default 64, 0 = never" << endl;
+		cerr << "        -p: keep the parsed Control File in a cache" << endl;
+		cerr << "        -s: read all files one by one, no batches (io_uring on Linux)" << endl;
+		cerr << "        -t: append the durations of the phases of the run to file (JSON, one line per run)" << endl;
+		cerr << "        --stats: print time, I/O and memory used per phase and the replacements done" << endl;
+		cerr << "        --stats-json: the same as JSON, to stdout or to file" << endl;
+		cerr << "        --plan: scan only, write the replacements to file, nothing else is changed" << endl;
+		cerr << "        --apply: perform the replacements of a plan, the files are not searched again" << endl;
+		cerr << "        --daemon: keep the Control File and the state of the files in memory, serve the requests (Linux)" << endl;
+		cerr << "        --request: send a request to the daemon: check, replace, rollback, clean or stop" << endl;
 		cerr << "        -v: Verbose" << endl;
 		cerr << "        -y: automatically answer all questions with 'yes'" << endl;
 		exit(1);
@@ -994,11 +8347,17 @@ int main(int argc, char* argv[])
 		REPLACE_OP,
 		ROLLBACK_OP,
 		CLEAN_OP,
+		PLAN_OP,
+		APPLY_OP,
+		DAEMON_OP,
+		REQUEST_OP,
 	};
 
 	CAutoVersion AutoVersion;
 	AutoVersion.SetControlFile(argv[argc - 1]);
 	int operation = REPLACE_OP;
+	string plan_file;		// see --plan and --apply
+	string request;			// see --request
 	g_bVerbose = false;
 
 	try
@@ -1016,6 +8375,14 @@ int main(int argc, char* argv[])
 					operation = CLEAN_OP;
 				else if ( argv[i][1] == 'y' )
 					AutoVersion.SetInteractive(false);
+				else if ( argv[i][1] == 'i' )
+					AutoVersion.SetIncremental(true);
+				else if ( argv[i][1] == 'p' )
+					AutoVersion.SetParseCache(true);
+				else if ( argv[i][1] == 's' )
+					AutoVersion.SetBatchIO(false);
+				else if ( argv[i][1] == 'j' && i + 1 < argc - 1 )
+					AutoVersion.SetThreads(atoi(argv[++i]));
 				else
 				{
 					cerr << "Invalid option " << argv[i] << endl;
@@ -1026,6 +8393,71 @@ int main(int argc, char* argv[])
 			{
 				AutoVersion.AddDefine(argv[i] + 2);
 			}
+			else if (argv[i][0] == '-' && argv[i][1] == 'x' && strlen(argv[i]) > 2)
+			{
+				// -x<dir>=<ident>,<ident>...
+				string arg = argv[i] + 2;
+				string output_root = arg.substr(0, arg.find('='));
+				vector<string> defines;
+				if (output_root.length() < arg.length())
+				{
+					stringstream idents(arg.substr(output_root.length() + 1));
+					string ident;
+					while (getline(idents, ident, ','))
+					{
+						if (!ident.empty())
+							defines.push_back(ident);
+					}
+				}
+				AutoVersion.AddConfiguration(output_root, defines);
+			}
+			else if (argv[i][0] == '-' && argv[i][1] == 'j' && strlen(argv[i]) > 2)
+			{
+				AutoVersion.SetThreads(atoi(argv[i] + 2));
+			}
+			else if (strcmp(argv[i], "--stats") == 0)
+			{
+				AutoVersion.SetStats(enStatsTable);
+			}
+			else if (strcmp(argv[i], "--stats-json") == 0)
+			{
+				AutoVersion.SetStats(enStatsJson);
+			}
+			else if (strncmp(argv[i], "--stats-json=", 13) == 0)
+			{
+				AutoVersion.SetStats(enStatsJson, argv[i] + 13);
+			}
+			else if (strcmp(argv[i], "--daemon") == 0)
+			{
+				operation = DAEMON_OP;
+			}
+			else if (strncmp(argv[i], "--request=", 10) == 0 && strlen(argv[i]) > 10)
+			{
+				operation = REQUEST_OP;
+				request = argv[i] + 10;
+			}
+			else if (strncmp(argv[i], "--plan=", 7) == 0 && strlen(argv[i]) > 7)
+			{
+				operation = PLAN_OP;
+				plan_file = argv[i] + 7;
+			}
+			else if (strncmp(argv[i], "--apply=", 8) == 0 && strlen(argv[i]) > 8)
+			{
+				operation = APPLY_OP;
+				plan_file = argv[i] + 8;
+			}
+			else if (argv[i][0] == '-' && argv[i][1] == 't' && strlen(argv[i]) > 2)
+			{
+				AutoVersion.SetTimingFile(argv[i] + 2);
+			}
+			else if (argv[i][0] == '-' && argv[i][1] == 'm' && strlen(argv[i]) > 2)
+			{
+				AutoVersion.SetScanCacheLimit((size_t)atoi(argv[i] + 2) * 1024 * 1024);
+			}
+			else if (argv[i][0] == '-' && argv[i][1] == 'w' && strlen(argv[i]) > 2)
+			{
+				AutoVersion.SetStreamWindow((size_t)atoi(argv[i] + 2) * 1024 * 1024);
+			}
 			else
 			{
 				cerr << "Invalid option!" << endl;
@@ -1033,21 +8465,56 @@ int main(int argc, char* argv[])
 			}
 		}
 
+		if (g_bVerbose)
+			printf("search: %s\n", GetFindPatternName());
+
 		switch (operation)
 		{
 			case REPLACE_OP:
-				AutoVersion.Replace();
+				if (AutoVersion.GetMatrix())
+					AutoVersion.ReplaceMatrix();
+				else
+					AutoVersion.Replace();
+				AutoVersion.ExecDelayedCommands();
+				AutoVersion.ShowMessages();
+				AutoVersion.WriteTimings("replace");
+				AutoVersion.WriteStats("replace");
+				break;
+
+			case PLAN_OP:
+				if (AutoVersion.GetMatrix())
+					throw CException("a plan can not be made in matrix mode");
+				AutoVersion.Plan(plan_file);
+				AutoVersion.WriteTimings("plan");
+				AutoVersion.WriteStats("plan");
+				break;
+
+			case APPLY_OP:
+				AutoVersion.Apply(plan_file);
 				AutoVersion.ExecDelayedCommands();
 				AutoVersion.ShowMessages();
+				AutoVersion.WriteTimings("apply");
+				AutoVersion.WriteStats("apply");
+				break;
+
+			case DAEMON_OP:
+				AutoVersion.Serve();
 				break;
 
+			case REQUEST_OP:
+				return AutoVersion.SendRequest(request);
+
 			case ROLLBACK_OP:
 				AutoVersion.Rollback();
 				AutoVersion.ExecDelayedCommands();
+				AutoVersion.WriteTimings("rollback");
+				AutoVersion.WriteStats("rollback");
 				break;
 
 			case CLEAN_OP:
 				AutoVersion.Clean();
+				AutoVersion.WriteTimings("clean");
+				AutoVersion.WriteStats("clean");
 				break;
 
 			default:
@@ -1070,3 +8537,4 @@ int main(int argc, char* argv[])
 
 	return 0;
 }
+#endif	// AV_NO_MAIN
@@ -23,6 +23,12 @@
 //                            Globals
 // ========================================================================
 extern 	bool g_bVerbose;	// program is verbose
+extern	bool g_bStats;		// collect statistics, see --stats
+
+void	Print(const char *format, ...);		// printf, which is safe to use in CThreadPool tasks
+
+const char	*FindPattern(const char *buf, size_t size, const string &pattern);	// vectorized substring search
+const char	*GetFindPatternName();												// the variant used by FindPattern
 
 
 // ========================================================================
@@ -83,6 +89,469 @@ public:
 };
 
 
+// ===============================================================================
+//									class CThreadPool
+//
+// Runs independent tasks on a number of worker threads (work stealing).
+// ===============================================================================
+class CThreadPool
+{
+protected:
+	int		m_nThreads;		// number of worker threads
+
+public:
+	CThreadPool(int threads)
+	{
+		m_nThreads = threads;
+	}
+
+	// Runs task(0) ... task(count - 1) and waits until all are done. The console output of
+	// the tasks (see Print) is printed in the order of the tasks. If a task throws, the
+	// tasks behind it are cancelled and the exception is rethrown.
+	void	Run(size_t count, const function<void(size_t)> &task);
+};
+
+
+// ===============================================================================
+//									class CFileBuffer
+//
+// The read-only contents of a file. Memory mapped if possible, except for
+// small files, for which a mapping costs more than reading them. A mapping is
+// no snapshot: a later change of the file shows through it.
+// ===============================================================================
+class CFileBuffer
+{
+public:
+	enum { SmallFileSize = 64 * 1024 };	// files up to this size are read, not mapped
+
+protected:
+	char	*m_pData;		// the contents, NULL for an empty file
+	size_t	m_nSize;		// size of the contents
+	bool	m_bMapped;		// true if m_pData is a mapping, otherwise it is malloc'd
+
+public:
+	CFileBuffer()
+	{
+		m_pData		= NULL;
+		m_nSize		= 0;
+		m_bMapped	= false;
+	}
+
+	CFileBuffer(const CFileBuffer &) = delete;
+	CFileBuffer &operator=(const CFileBuffer &) = delete;
+
+	~CFileBuffer()
+	{
+		Close();
+	}
+
+	const char	*GetData() const { return m_pData; }
+	size_t		GetSize() const { return m_nSize; }
+	bool		IsMapped() const { return m_bMapped; }
+
+	void	Open(const string &file_name);
+	void	Attach(char *data, size_t size);		// takes over the malloc'd "data"
+	void	Close();
+};
+
+
+// ===============================================================================
+//									class CBatchReader
+//
+// Reads many small files at once. On Linux the open, stat, read and close
+// requests of the files are passed to the kernel through an io_uring, a
+// bounded number of them in flight, so the per-file system calls do not
+// dominate the check phase. Where io_uring is not available, IsAvailable()
+// returns false and the files are read the usual way by CFileNode.
+// ===============================================================================
+class CBatchReader
+{
+public:
+	enum
+	{
+		MaxFileSize	= CFileBuffer::SmallFileSize,	// larger files are read the usual way, they are mapped
+		BatchFiles	= 1024,			// the files read in one batch
+		QueueDepth	= 64,			// requests in flight
+	};
+
+	struct SFile
+	{
+		string					m_strFileName;
+		bool					m_bRead;		// true if m_Stat and m_pBuffer are valid
+		struct stat				m_Stat;
+		shared_ptr<CFileBuffer>	m_pBuffer;
+
+		SFile()
+		{
+			m_bRead = false;
+			memset(&m_Stat, 0, sizeof(m_Stat));
+		}
+	};
+
+protected:
+	int			m_nRing;			// io_uring descriptor, -1 if not available
+	void		*m_pSqRing;			// the mapped rings
+	size_t		m_nSqRingSize;
+	void		*m_pCqRing;
+	size_t		m_nCqRingSize;
+	void		*m_pSqes;
+	size_t		m_nSqesSize;
+	unsigned	*m_pSqHead, *m_pSqTail, *m_pSqMask, *m_pSqArray;
+	unsigned	*m_pCqHead, *m_pCqTail, *m_pCqMask;
+	void		*m_pCqes;
+
+public:
+	CBatchReader();
+	~CBatchReader();
+
+	CBatchReader(const CBatchReader &) = delete;
+	CBatchReader &operator=(const CBatchReader &) = delete;
+
+	bool	IsAvailable() const { return m_nRing >= 0; }
+
+	// reads the regular files of "files" up to MaxFileSize, m_bRead is false for all others
+	void	Read(vector<SFile> &files);
+};
+
+
+// ===============================================================================
+//									class CStream
+//
+// A stage of a processing chain, which gets the contents of a file piece by
+// piece, so the file never has to be held in memory as a whole.
+// ===============================================================================
+class CStream
+{
+public:
+	enum { DefaultWindow = 1024 * 1024 };		// size of the pieces, if the memory is not limited otherwise
+
+	virtual ~CStream() {}
+
+	virtual void	Write(const char *buf, size_t size) = 0;
+	virtual void	Finish() = 0;								// called after the last Write
+};
+
+
+// ===============================================================================
+//									class CFileStream
+//
+// Writes the new contents of a file to a temporary file, which replaces the
+// file on Commit.
+// ===============================================================================
+class CFileStream : public CStream
+{
+protected:
+	string				m_strFileName;	// the file to replace
+	string				m_strTempName;	// the temporary file written
+	FILE				*m_pFile;
+	bool				m_bFailed;		// a write failed
+	size_t				m_nSize;		// bytes written
+	unsigned long long	m_nHash;		// hash of the bytes written
+
+public:
+	CFileStream()
+	{
+		m_pFile		= NULL;
+		m_bFailed	= false;
+		m_nSize		= 0;
+		m_nHash		= 0;
+	}
+
+	CFileStream(const CFileStream &) = delete;
+	CFileStream &operator=(const CFileStream &) = delete;
+
+	~CFileStream()
+	{
+		Discard();
+	}
+
+	size_t				GetSize() const { return m_nSize; }
+	unsigned long long	GetHash() const { return m_nHash; }
+
+	void	Open(const string &file_name);
+	virtual void	Write(const char *buf, size_t size) override;
+	virtual void	Finish() override {}
+	void	Commit();			// replaces the file by the written contents
+	void	Discard();			// removes the temporary file
+};
+
+
+// ===============================================================================
+//									class CMultiMatcher
+//
+// Aho-Corasick automaton. Finds all occurrences of a set of patterns in a
+// single pass over a buffer. The transition table is fully expanded, but the
+// alphabet is compressed to the bytes that actually occur in the patterns.
+// ===============================================================================
+class CMultiMatcher
+{
+protected:
+	int				m_nClasses;			// number of byte classes, class 0 is "byte not in any pattern"
+	unsigned char	m_aClass[256];		// byte -> class
+	vector<int>		m_vecDelta;			// transition table, m_nClasses entries per state
+	vector<int>		m_vecOutHead;		// per state: first entry of its output chain, -1 if none
+	vector<int>		m_vecOutPattern;	// output chain entry: pattern index
+	vector<int>		m_vecOutLink;		// output chain entry: next entry, -1 if none
+	vector<size_t>	m_vecLength;		// length of each pattern
+
+public:
+	CMultiMatcher()
+	{
+		m_nClasses = 0;
+	}
+
+	bool	IsEmpty() const { return m_vecDelta.empty(); }
+	void	Build(const vector<string> &patterns);
+
+	// calls on_match(pattern_index, offset) for every occurrence, in order of the
+	// occurrence's end position. If on_match returns false, scanning stops after
+	// the current byte. "pos" and "state" are updated, so the scan can be resumed.
+	template<class F>
+	void Scan(const char *buf, size_t size, size_t &pos, int &state, F on_match) const
+	{
+		const int *delta = m_vecDelta.data();
+
+		while (pos < size)
+		{
+			state = delta[state * m_nClasses + m_aClass[(unsigned char)buf[pos]]];
+
+			bool go_on = true;
+			for (int o = m_vecOutHead[state]; o >= 0; o = m_vecOutLink[o])
+			{
+				int pattern = m_vecOutPattern[o];
+				if (!on_match(pattern, pos + 1 - m_vecLength[pattern]))
+					go_on = false;
+			}
+
+			pos++;
+			if (!go_on)
+				return;
+		}
+	}
+
+	template<class F>
+	void Scan(const char *buf, size_t size, F on_match) const
+	{
+		size_t pos = 0;
+		int state = 0;
+		Scan(buf, size, pos, state, on_match);
+	}
+};
+
+
+// ===============================================================================
+//									class CRuleOverlaps
+//
+// For the literal replacements of a file: the later replacements whose "what"
+// can match at a position overlapping the "with" of a replacement, no matter
+// what surrounds it. The pairs are found by looking up the
+// prefixes of the strings in sorted lists, not by comparing all pairs. Built
+// on first use, once for all files which share the rules.
+// ===============================================================================
+class CRuleOverlaps
+{
+public:
+	enum { MaxListed = 64 };	// a rule overlapping more rules is assumed to overlap all of them
+
+protected:
+	once_flag		m_Built;
+	vector<int>		m_vecFirst;			// per rule: its first entry in m_vecLater, one more entry for the end
+	vector<int>		m_vecLater;			// the later rules, which overlap a rule
+	vector<char>	m_vecAllLater;		// per rule: it overlaps all later rules
+	vector<char>	m_vecAllEarlier;	// per rule: all earlier rules overlap it
+
+	void	Build(const vector<const string *> &what, const vector<const string *> &with);
+
+public:
+	// true, if a rule with "must" set overlaps a later one with "must" set.
+	// "what" and "with" are the strings of the rules, the same for every call.
+	bool	Overlap(const vector<const string *> &what, const vector<const string *> &with, const vector<char> &must);
+};
+
+
+// ===============================================================================
+//									class CRegex
+//
+// Regular expression, compiled to a program for a Pike VM: all alternatives
+// are followed in parallel, so the time is linear in the size of the text,
+// there is no backtracking. The leftmost match is found, among the matches
+// starting there the one preferred by the greedy or lazy quantifiers, as in
+// Perl. As there, an empty iteration ends a loop, once the minimum count is
+// reached. Supported are . [] [^] () (?:) | * + ? {n,m}, the lazy quantifiers,
+// ^ $ at line ends, \b \B \d \D \w \W \s \S \t \n \r \xHH.
+// ===============================================================================
+class CRegex
+{
+protected:
+	enum EOp
+	{
+		enOpSet,				// consumes a byte of the set m_nX, continues at m_nY
+		enOpSplit,				// continues at m_nX and, with lower priority, at m_nY
+		enOpJmp,				// continues at m_nX
+		enOpSave,				// stores the position in capture slot m_nX
+		enOpMatch,
+		enOpLineStart,			// assertions, they consume nothing
+		enOpLineEnd,
+		enOpWordBoundary,
+		enOpNotWordBoundary,
+	};
+
+	struct SInst
+	{
+		EOp		m_enOp;
+		int		m_nX;
+		int		m_nY;
+	};
+
+	// the parsed expression, it is compiled to m_vecProgram
+	struct SNode
+	{
+		enum EType { enEmpty, enSet, enCat, enAlt, enRepeat, enGroup, enAssert };
+
+		EType			m_enType;
+		int				m_nArg;			// enSet: the set, enGroup: the group, enAssert: the EOp
+		int				m_nMin;			// enRepeat
+		int				m_nMax;			// enRepeat, -1 for no limit
+		bool			m_bGreedy;		// enRepeat
+		vector<SNode>	m_vecChildren;
+
+		SNode(EType type = enEmpty, int arg = 0)
+		{
+			m_enType	= type;
+			m_nArg		= arg;
+			m_nMin		= 0;
+			m_nMax		= 0;
+			m_bGreedy	= true;
+		}
+	};
+
+	string					m_strPattern;
+	vector<SInst>			m_vecProgram;
+	vector<unsigned char>	m_vecSets;		// 256 entries per byte set, 1 if the byte is in the set
+	int						m_nGroups;		// number of capture groups, group 0 (the whole match) not counted
+	unsigned char			m_aFirst[256];	// 1 for the bytes a match can start with
+	int						m_nFirstByte;	// the only byte a match can start with, or -1
+	bool					m_bSkip;		// a match can not be empty, so m_aFirst can be used to skip the text
+	const char				*m_pParse;		// the parse position, during the compilation
+
+	int		AddSet(const unsigned char *set);
+	SNode	ParseAlternative();
+	SNode	ParseSequence();
+	SNode	ParseRepeat();
+	SNode	ParseAtom();
+	SNode	ParseClass();
+	int		ParseEscape(unsigned char *set, bool &is_set);
+	int		Emit(EOp op, int x = 0, int y = 0);
+	void	Compile(const SNode &node);
+	void	CompileIteration(const SNode &child, vector<int> &exits);
+	static bool	CanBeEmpty(const SNode &node);
+	void	ComputeFirst();
+
+public:
+	enum ESearch
+	{
+		enSrFound,		// a match was found
+		enSrNone,		// there is no match
+		enSrMore,		// no decision possible without the data behind "buf"
+	};
+
+	// the thread lists of a search, kept between searches to avoid allocations
+	struct SWorkspace
+	{
+		vector<int>			m_vecPc[2];			// the threads of the current and the next position, by priority
+		vector<size_t>		m_vecCaps[2];		// the capture slots of the threads, per instruction
+		vector<unsigned>	m_vecMark[2];		// instructions already added for the position
+		unsigned			m_nGeneration[2];
+		vector<size_t>		m_vecSlots;			// the capture slots of a new thread
+		vector<pair<int, size_t>>	m_vecStack;	// AddThread: instruction, or capture slot (-1 - slot) to restore
+
+		SWorkspace()
+		{
+			m_nGeneration[0] = m_nGeneration[1] = 0;
+		}
+	};
+
+	CRegex(const string &pattern);
+
+	const string	&GetPattern() const { return m_strPattern; }
+	int				GetGroups() const { return m_nGroups; }
+
+	// Searches the leftmost match in buf[start, size). buf[0, start) is only
+	// looked at by the assertions. "caps" gets the start and end of the match and
+	// each group, npos for a group not taking part. If "final" is false, more
+	// data may follow, then enSrMore is returned when the result depends on
+	// it, "keep" is the position from which the data is still needed.
+	ESearch	Search(const char *buf, size_t size, size_t start, bool final, SWorkspace &work, vector<size_t> &caps, size_t &keep) const;
+
+	// replaces $0 to $9 in "with" by the groups of a match, $$ by $
+	void	Expand(const string &with, const char *buf, const vector<size_t> &caps, string &out) const;
+	static int	GetMaxReference(const string &with);	// the highest group referenced in "with", -1 if none
+
+protected:
+	void	AddThread(SWorkspace &work, int list, int pc, size_t *slots, const char *buf, size_t size, size_t pos) const;
+};
+
+
+// ===============================================================================
+//									class CEditPass
+//
+// The spans changed by one pass over a file, e.g. one replacement. Together
+// with the replaced bytes this allows to revert the pass.
+// ===============================================================================
+class CEditPass
+{
+public:
+	vector<size_t>	m_vecOffset;		// offset of each span in the output of the pass, ascending
+	vector<size_t>	m_vecNewLength;		// length of each span in the output of the pass
+	vector<size_t>	m_vecOldLength;		// length of each span in the input of the pass
+	string			m_strOld;			// the replaced bytes of all spans, concatenated
+
+	bool	IsEmpty() const { return m_vecOffset.empty(); }
+
+	void Add(size_t offset, size_t new_len, const char *old, size_t old_len)
+	{
+		m_vecOffset.push_back(offset);
+		m_vecNewLength.push_back(new_len);
+		m_vecOldLength.push_back(old_len);
+		m_strOld.append(old, old_len);
+	}
+
+};
+
+
+// ===============================================================================
+//									class CUndoStream
+//
+// Reverts a CEditPass: gets the output of the pass and passes its input on.
+// ===============================================================================
+class CUndoStream : public CStream
+{
+protected:
+	const CEditPass	&m_Pass;
+	CStream			&m_Next;
+	size_t			m_nPos;			// position in the output of the pass
+	size_t			m_nSpan;		// the next span
+	size_t			m_nOld;			// position of the old bytes of the next span in m_Pass.m_strOld
+	bool			m_bFailed;		// the spans do not fit to the data
+
+	void	EndSpan();
+
+public:
+	CUndoStream(const CEditPass &pass, CStream &next) : m_Pass(pass), m_Next(next)
+	{
+		m_nPos		= 0;
+		m_nSpan		= 0;
+		m_nOld		= 0;
+		m_bFailed	= false;
+	}
+
+	bool	Failed() const { return m_bFailed; }
+
+	virtual void	Write(const char *buf, size_t size) override;
+	virtual void	Finish() override;
+};
+
+
 // ===============================================================================
 //									class CReplace
 //
@@ -92,36 +561,109 @@ enum EReplaceOp
 {
 	enRoText,		// text replacement
 	enRoBinary,		// binary replacement
+	enRoRegex,		// regular expression, see class CRegex
+};
+
+
+enum EEncoding
+{
+	enEncBytes,		// the strings are matched as they are: ASCII, UTF-8 and the 8 bit code pages
+	enEncUtf16LE,	// UTF-16, little endian
+	enEncUtf16BE,	// UTF-16, big endian
+};
+
+
+// ===============================================================================
+//									class CStringPool
+//
+// Interned strings: each distinct string is stored once and keeps its address,
+// so the rules of a generated Control File share their what- and with-strings,
+// and equal strings can be compared by their address.
+// Not thread safe, strings are only added while parsing.
+// ===============================================================================
+class CStringPool
+{
+protected:
+	unordered_set<string>	m_setStrings;
+
+public:
+	const string	*Intern(string str) { return &*m_setStrings.insert(std::move(str)).first; }
+	void			Clear() { m_setStrings.clear(); }
 };
 
 
 class CReplace
 {
 protected:
-	EReplaceOp	m_enReplaceOp;		// the operation, either text or binary
-	string		m_strWhat;			// what to replace
-	string		m_strWith;			// to replace with
+	const string	*m_pWhat;		// what to replace, interned in a CStringPool
+	const string	*m_pWith;		// to replace with, interned in a CStringPool
+	EReplaceOp	m_enReplaceOp;		// the operation, text, binary or regular expression
+	EEncoding	m_enEncoding;		// the encoding of the file, "what" and "with" are matched in it
 	bool		m_bMustReplace;		// true if "what" was found
 	bool		m_bDidReplace;		// true if replacement was done
+	bool		m_bRegexFound;		// enRoRegex, check phase: the expression matches
+	bool		m_bRegexChanges;	// enRoRegex, check phase: a match differs from its replacement
+	vector<size_t>	m_vecMatches;	// offsets of all occurrences of "what", found during the check phase
+	size_t		m_nReplaced;		// number of occurrences replaced
+	shared_ptr<const CRegex>	m_pRegex;	// the compiled "what", for enRoRegex
+	shared_ptr<const pair<string, string>>	m_pEncoded;	// "what" and "with" in m_enEncoding, NULL for enEncBytes
+
+	char	*DoReplaceRegex(const char *buf, size_t &size, CEditPass &pass);
 
 public:
 	size_t		m_nControlFilePos;	// offset-position (in bytes) within the Control File, where the "what" string is found
 									// this is used to update the Control File
 
 public:
-	CReplace(EReplaceOp op, const string &what, const string &with, size_t nControlFilePos)
+	// "what" and "with" must outlive the replacement, see CStringPool.
+	// "regex" is the compiled "what" for enRoRegex, it is compiled here if not given
+	CReplace(EReplaceOp op, const string *what, const string *with, size_t nControlFilePos, shared_ptr<const CRegex> regex = nullptr)
 	{
 		m_enReplaceOp		= op;
-		m_strWhat			= what;
-		m_strWith			= with;
+		m_pWhat				= what;
+		m_pWith				= with;
 		m_nControlFilePos	= nControlFilePos;
 		m_bMustReplace		= false;
 		m_bDidReplace		= false;
+		m_nReplaced			= 0;
+		m_pRegex			= regex;
+		m_bRegexFound		= false;
+		m_bRegexChanges		= false;
+		m_enEncoding		= enEncBytes;
+
+		if (op == enRoRegex && !m_pRegex)
+			m_pRegex = make_shared<const CRegex>(*m_pWhat);
 	}
 
-	bool	CheckReplace(const string &file_name, char *buf, size_t size);	// checks, if a replacement will occur
-	char	*DoReplace(char *buf, size_t &size);							// performs the replacement
-	char	*UpdateControlFile(char *buf, size_t &size, int &offset);		// Alle Replacements auf das Control File anwenden
+	EReplaceOp		GetOp() const { return m_enReplaceOp; }
+	const string	&GetWhat() const { return *m_pWhat; }
+	const string	&GetWith() const { return *m_pWith; }
+	bool			GetMustReplace() const { return m_bMustReplace; }
+	bool			GetDidReplace() const { return m_bDidReplace; }
+	size_t			GetReplaced() const { return m_nReplaced; }
+	bool			IsRegex() const { return m_enReplaceOp == enRoRegex; }
+	const CRegex	*GetRegex() const { return m_pRegex.get(); }
+	const string	&GetWhatBytes() const { return m_pEncoded ? m_pEncoded->first : *m_pWhat; }	// "what" as searched in the file
+	const string	&GetWithBytes() const { return m_pEncoded ? m_pEncoded->second : *m_pWith; }	// "with" as written to the file
+	size_t			GetUnitSize() const { return m_enEncoding == enEncBytes ? 1 : 2; }
+	bool			IsAligned(size_t offset) const { return offset % GetUnitSize() == 0; }		// a match may start at this file offset
+	bool			GetRegexFound() const { return m_bRegexFound; }
+	bool			GetRegexChanges() const { return m_bRegexChanges; }
+
+	const vector<size_t>	&GetMatches() const { return m_vecMatches; }
+	void	AddMatch(size_t pos) { m_vecMatches.push_back(pos); }
+	void	ClearMatches() { vector<size_t>().swap(m_vecMatches); }
+	void	SelectMatches(vector<size_t> &selected) const;					// the matches DoReplace would replace in the unmodified file
+
+	void	SetEncoding(EEncoding encoding);
+	const char	*FindWhat(const char *buf, size_t size, size_t offset = 0) const;	// the first aligned match, "offset" is the file offset of buf
+	void	SetRegexResult(bool found, bool changes) { m_bRegexFound = found; m_bRegexChanges = changes; }
+	void	ResetState() { m_bMustReplace = m_bDidReplace = m_bRegexFound = m_bRegexChanges = false; m_nReplaced = 0; ClearMatches(); }
+	void	ScanRegex(const char *buf, size_t size);						// enRoRegex: sets the results of the check phase
+
+	bool	CheckReplace(const string &file_name, bool found, bool changes = true);	// checks, if a replacement will occur
+	void	Replaced(size_t count);											// marks the replacement as done
+	char	*DoReplace(const char *buf, size_t &size, CEditPass &pass);		// performs the replacement
 
 #ifdef _DEBUG
 	void	Dump()		// show parsed structures of Control File
@@ -131,13 +673,15 @@ public:
 			op = "text";
 		else if (m_enReplaceOp == enRoBinary)
 			op = "binary";
+		else if (m_enReplaceOp == enRoRegex)
+			op = "regex";
 		else
 			throw CException("unknown type of m_enReplaceOp");
 
 		printf("Type: %s --- What: %s --- With: %s --- Must Replace: %s --- Did Replace: %s\n",
 			op.c_str(),
-			m_strWhat.c_str(),
-			m_strWith.c_str(),
+			m_pWhat->c_str(),
+			m_pWith->c_str(),
 			m_bMustReplace ? "yes" : "no",
 			m_bDidReplace ? "yes" : "no");
 	}
@@ -145,33 +689,256 @@ public:
 };
 
 
+// ===============================================================================
+//									class CReplaceStream
+//
+// Performs a replacement on a stream, with the same result as
+// CReplace::DoReplace. The data written is searched in place, only its last
+// what_len - 1 bytes are held back, as they may be the start of a match.
+// ===============================================================================
+class CReplaceStream : public CStream
+{
+protected:
+	CReplace	&m_Replace;
+	CEditPass	&m_Pass;			// the replaced spans are recorded here
+	CStream		&m_Next;
+	string		m_strPending;		// bytes not yet searched completely, less than what_len
+	size_t		m_nInput;			// the offset of m_strPending in the input
+	size_t		m_nOutput;			// bytes passed on
+	size_t		m_nCount;			// number of replacements
+
+	size_t	GetHold() const { return m_Replace.GetWhatBytes().empty() ? 0 : m_Replace.GetWhatBytes().length() - 1; }
+	size_t	Process(const char *buf, size_t size, size_t end);
+
+public:
+	CReplaceStream(CReplace &replace, CEditPass &pass, CStream &next) : m_Replace(replace), m_Pass(pass), m_Next(next)
+	{
+		m_nInput	= 0;
+		m_nOutput	= 0;
+		m_nCount	= 0;
+	}
+
+	virtual void	Write(const char *buf, size_t size) override;
+	virtual void	Finish() override;
+};
+
+
+// ===============================================================================
+//									class CRegexStream
+//
+// Performs a replacement with a regular expression on a stream, with the same
+// result as CReplace::DoReplace. The data written is searched in place, only
+// the bytes from the start of a possible match on are held back, until the
+// match is decided. Without "next", the stream
+// only checks, if the expression matches and if that changes anything, see
+// CReplace::SetRegexResult.
+// ===============================================================================
+class CRegexStream : public CStream
+{
+protected:
+	CReplace	&m_Replace;
+	const CRegex	&m_Regex;
+	CEditPass	*m_pPass;			// the replaced spans are recorded here
+	CStream		*m_pNext;
+	CRegex::SWorkspace	m_Work;
+	vector<size_t>	m_vecCaps;
+	string		m_strWith;			// the replacement of the current match
+	string		m_strPending;		// bytes not yet searched completely, behind a byte kept for the assertions
+	size_t		m_nStart;			// where the search continues in m_strPending
+	size_t		m_nOutput;			// bytes passed on
+	size_t		m_nCount;			// number of replacements
+	bool		m_bFound;
+	bool		m_bChanges;
+
+	enum { MinPiece = 4096 };		// Write: the least appended to the pending bytes at a time
+
+	void	Output(const char *buf, size_t size);
+	size_t	Process(const char *buf, size_t size, size_t pos, bool final);
+
+public:
+	CRegexStream(CReplace &replace, CEditPass *pass, CStream *next) : m_Replace(replace), m_Regex(*replace.GetRegex())
+	{
+		m_pPass		= pass;
+		m_pNext		= next;
+		m_nStart	= 0;
+		m_nOutput	= 0;
+		m_nCount	= 0;
+		m_bFound	= false;
+		m_bChanges	= false;
+	}
+
+	bool	IsDecided() const { return !m_pNext && m_bFound && m_bChanges; }	// check only: the rest of the data does not matter
+
+	virtual void	Write(const char *buf, size_t size) override;
+	virtual void	Finish() override;
+};
+
+
+// ===============================================================================
+//									class CPatchStream
+//
+// Compares the new contents of a file with the old ones, which are read in
+// step, and collects the changed spans, so only these have to be written.
+// Only for replacements which do not change the length.
+// ===============================================================================
+class CPatchStream : public CStream
+{
+protected:
+	FILE				*m_pFile;		// the old contents
+	vector<char>		m_vecOld;		// buffer for the old contents
+	size_t				m_nPos;			// bytes compared
+	bool				m_bFailed;		// the lengths differ
+	unsigned long long	m_nHash;		// hash of the new contents
+
+	void	AddSpan(size_t offset, const char *old, const char *data, size_t len);
+
+public:
+	CEditPass	m_Pass;				// the changed spans with their old bytes
+	string		m_strNew;			// the new bytes of the spans, concatenated
+
+	CPatchStream()
+	{
+		m_pFile		= NULL;
+		m_nPos		= 0;
+		m_bFailed	= false;
+		m_nHash		= 0;
+	}
+
+	CPatchStream(const CPatchStream &) = delete;
+	CPatchStream &operator=(const CPatchStream &) = delete;
+
+	~CPatchStream()
+	{
+		if (m_pFile)
+			fclose(m_pFile);
+	}
+
+	bool				Failed() const { return m_bFailed; }
+	unsigned long long	GetHash() const { return m_nHash; }
+
+	void	Open(const string &file_name);
+	virtual void	Write(const char *buf, size_t size) override;
+	virtual void	Finish() override;
+};
+
+
 // ===============================================================================
 //									class CFileNode
 //
 // This represents a file where replacements shall be performed.
 // All replacement operations for a single file are held in a list here.
 // ===============================================================================
+class CJournal;
+class CJournalEntry;
+
+// the state of a file at the end of a run, see class CScanCache
+class CScanCacheEntry
+{
+public:
+	bool				m_bValid;
+	size_t				m_nSize;
+	long long			m_tModified;
+	long long			m_tChanged;		// st_ctime, can not be set by the user
+	unsigned long long	m_nInode;
+	unsigned long long	m_nHash;		// content hash
+	unsigned long long	m_nRulesHash;	// hash of the what-strings of all replacements of the file
+
+	CScanCacheEntry()
+	{
+		m_bValid		= false;
+		m_nSize			= 0;
+		m_tModified		= 0;
+		m_tChanged		= 0;
+		m_nInode		= 0;
+		m_nHash			= 0;
+		m_nRulesHash	= 0;
+	}
+};
+
+
+// the state of a file at check time, to see if it was changed before it is
+// written, see IsModified
+class CFileState
+{
+public:
+	size_t				m_nSize;
+	unsigned long long	m_nInode;
+	long long			m_tModified;	// in ns
+	long long			m_tChanged;		// st_ctime in ns, can not be set by the user
+	unsigned long long	m_nHash;		// content hash
+
+	CFileState()
+	{
+		Reset();
+	}
+
+	void	Reset() { m_nSize = 0; m_nInode = 0; m_tModified = m_tChanged = 0; m_nHash = 0; }
+	void	Set(const struct stat &st, unsigned long long hash);
+	bool	IsModified(const string &file_name, const struct stat &st, shared_ptr<CFileBuffer> &contents) const;
+};
+
+
 class CFileNode
 {
+public:
+	enum { MaxSingleSearchReplacements = 4 };	// up to this number of replacements, FindPattern is used instead of m_pMatcher
+
 protected:
-	list<CReplace>	m_listReplacements;		// All replacement operations for a single file are held in a list here.
+	vector<CReplace>	m_vecReplacements;	// All replacement operations for a single file are held here, in their order.
+	shared_ptr<const CMultiMatcher>	m_pMatcher;	// finds the "what" strings of all replacements in one pass, shared by the files of a pattern
+	shared_ptr<CRuleOverlaps>	m_pOverlaps;	// for SpliceMatches, shared together with m_pMatcher
 	bool			m_bMustReplace;			// true if anything must be replaced in this file
 	bool			m_bDidReplace;			// true if replacement was done
+	EEncoding		m_enEncoding;			// the encoding of the file, as detected by the check phase
+
+	// state kept from the check phase for the replace phase
+	shared_ptr<CFileBuffer>	m_pCache;		// the file contents, empty if they did not fit into the cache budget
+	CFileState		m_State;				// the file at check time
+	size_t			m_nWindow;				// window size, if the file is processed in streaming mode, otherwise 0
+
+	void	BuildMatcher();
+	void	SetEncoding(const string &file_name, EEncoding encoding);
+	char	*SpliceMatches(const char *buf, size_t &size, CEditPass &pass);
+	char	*ReplaceAll(const char *data, size_t &size, vector<CEditPass> &passes);
+	unsigned long long	GetRulesHash() const;
+	unsigned long long	ScanStream(const string &file_name, vector<char> &found, bool need_hash);
+	unsigned long long	StreamReplacements(const string &file_name, size_t window, CStream &out, vector<CEditPass> &passes, size_t &size);
+	void	ReplaceStream(const string &file_name, CJournal &journal);
+	char	*ReplaceContents(const string &file_name, shared_ptr<CFileBuffer> &file, size_t &size, CJournalEntry &entry);
+	bool	CanPatch() const;
+	void	PatchInPlace(const string &file_name, unsigned long long hash, CJournal &journal);
+	void	Rescan(const string &file_name);
 
 public:
 	CFileNode()
 	{
 		m_bMustReplace	= false;
 		m_bDidReplace	= false;
+		m_enEncoding	= enEncBytes;
+		m_nWindow		= 0;
 	}
 
-	list<CReplace>	&GetReplacements() { return m_listReplacements; }
+	vector<CReplace>	&GetReplacements() { return m_vecReplacements; }
+	const vector<CReplace>	&GetReplacements() const { return m_vecReplacements; }
 
-	void	Add(CReplace r)	{ m_listReplacements.push_back(r); }
+	void	Add(CReplace r);
+	void	AddRules(CFileNode &rules);		// adds the replacements of a file pattern
+	void	ResetState();					// forgets the results of a run, the daemon uses the parsed nodes again
+	void	Compact() { m_vecReplacements.shrink_to_fit(); }
+	string	GetMatcherKey() const;			// the strings of an automaton, empty if none is needed or it is shared already
+	void	ShareMatcher(CFileNode &node);	// uses the automaton and the overlaps of "node", which has the same key
 
-	bool	CheckReplacements(const string &file_name);					// checks, if any replacement for this file will occur
-	void	DoReplacments(const string &file_name);						// performs all replacements for this file
-	void	Rollback(const string &file_name);							// performs a rollback for this file
+	bool	CheckReplacements(const string &file_name, atomic<size_t> &cache_budget, size_t stream_window, CScanCacheEntry *scan_state = NULL,
+							  const CBatchReader::SFile *prefetched = NULL);	// checks, if any replacement for this file will occur
+	void	DoReplacments(const string &file_name, CJournal &journal);	// performs all replacements for this file
+	bool	PlanReplacements(const string &file_name, CJournalEntry &entry);	// the replacements as a plan entry, nothing is written
+	bool	IsUnchanged(const CScanCacheEntry &last) const;		// incremental mode: the result of the last run applies, if the file was not changed
+
+	// matrix mode: a file shared by several configurations is scanned once for all of them
+	static void	FindMatches(const string &file_name, const char *buf, size_t size, const vector<CFileNode *> &nodes);
+	bool	CheckMatches(const string &file_name);							// checks the matches found by FindMatches
+	void	WriteResult(const char *buf, size_t size, const string &out_name);	// writes the file with the replacements to out_name
+	void	ClearMatches();
 
 #ifdef _DEBUG
 	void	Dump()		// show parsed structures of Control File
@@ -179,7 +946,7 @@ public:
 		printf("Must Replace %s\n", m_bMustReplace ? "yes" : "no");
 		printf("Did Replace %s\n", m_bDidReplace ? "yes" : "no");
 
-		for (auto it : m_listReplacements)
+		for (auto &it : m_vecReplacements)
 			it.Dump();
 	}
 #endif
@@ -200,26 +967,308 @@ public:
 		m_listArgs.push_back(s);
 	}
 
+	const list<string>	&GetArgs() const { return m_listArgs; }
+
 	virtual bool Execute() = 0;
 };
 
 
 // ===============================================================================
 //									class CCommandShell
+//
+// A %shell command. A command without shell syntax is started directly, the
+// others through /bin/sh. The consecutive commands of a %group block may run
+// concurrently, see CAutoVersion::ExecDelayedCommands.
 // ===============================================================================
 class CCommandShell : public CCommand
 {
 public:
-	virtual bool Execute() override
+	size_t	m_nGroup;		// the %group block of the command, 0 if none
+	int		m_nParallel;	// the number of commands of the group running at once, 0: one per processor
+
+	CCommandShell()
+	{
+		m_nGroup	= 0;
+		m_nParallel	= 1;
+	}
+
+	virtual bool Execute() override;
+};
+
+
+// ===============================================================================
+//									class CJournal
+//
+// The journal of a run. Before a file is written, an entry with the hashes of
+// the old and the new contents and the edits of each pass is appended, so all
+// files written by a run can be reverted by a single rollback, even if the
+// program was aborted.
+//
+// A plan (see CAutoVersion::Plan) has the same records, but a different magic.
+// Each entry holds a single pass, which turns the old contents into the new
+// ones, and the new bytes of its spans. A plan ends with an end record, as it
+// is only valid if complete.
+// ===============================================================================
+class CJournalEntry
+{
+public:
+	string				m_strFileName;
+	size_t				m_nOldSize;
+	unsigned long long	m_nOldHash;
+	size_t				m_nNewSize;
+	unsigned long long	m_nNewHash;
+	vector<CEditPass>	m_vecPasses;		// in the order they were applied
+	bool				m_bInPlace;			// the file was patched in place, m_vecPasses holds a single pass
+	string				m_strNew;			// if patched in place or in a plan: the new bytes of the spans, concatenated
+
+	CJournalEntry()
+	{
+		m_bInPlace	= false;
+		m_nOldSize	= 0;
+		m_nOldHash	= 0;
+		m_nNewSize	= 0;
+		m_nNewHash	= 0;
+	}
+};
+
+
+class CJournal
+{
+protected:
+	string	m_strFileName;
+	FILE	*m_pFile;
+	mutex	m_Lock;
+	bool	m_bPlan;			// the file is a plan
+	size_t	m_nEntries;			// the entries appended
+
+	void	Open(const string &file_name, const char *magic, size_t magic_len, const list<CCommandShell> &commands);
+	void	Write(char type, const string &record);
+	static void	Load(const string &file_name, bool plan, list<CCommandShell> &commands, list<string> *messages, vector<CJournalEntry> &entries);
+
+public:
+	CJournal()
+	{
+		m_pFile		= NULL;
+		m_bPlan		= false;
+		m_nEntries	= 0;
+	}
+
+	~CJournal()
 	{
-		string cmd = m_listArgs.front();
+		Close();
+	}
+
+	CJournal(const CJournal &) = delete;
+	CJournal &operator=(const CJournal &) = delete;
+
+	bool	IsOpen() const { return m_pFile != NULL; }
 
-		if (g_bVerbose)
-			printf("shell: %s\n", cmd.c_str());
+	void	Create(const string &file_name, const list<CCommandShell> &commands);
+	void	CreatePlan(const string &file_name, const list<CCommandShell> &commands, const list<string> &messages);
+	void	Append(const CJournalEntry &entry);
+	void	EndPlan();
+	void	Close();
 
-		int ret = system(cmd.c_str());
-		return ret == 0;
+	static bool	Exists(const string &file_name);
+	static void	Load(const string &file_name, list<CCommandShell> &commands, vector<CJournalEntry> &entries)
+	{
+		Load(file_name, false, commands, NULL, entries);
+	}
+	static void	LoadPlan(const string &file_name, list<CCommandShell> &commands, list<string> &messages, vector<CJournalEntry> &entries)
+	{
+		Load(file_name, true, commands, &messages, entries);
 	}
+	static bool	Rollback(const vector<CJournalEntry> &entries);
+	static bool	RollbackPatch(const CJournalEntry &entry, size_t size, unsigned long long hash);
+};
+
+
+// ===============================================================================
+//									class CScanCache
+//
+// Incremental mode: the files, which had nothing to replace in the last run.
+// A file is skipped, if it is unchanged since then and the what-strings of its
+// replacements are the same. The cache can be deleted at any time.
+// ===============================================================================
+class CScanCache
+{
+protected:
+	unordered_map<string, CScanCacheEntry>	m_mapEntries;
+
+public:
+	void	Load(const string &file_name);
+	void	Save(const string &file_name) const;
+
+	const CScanCacheEntry *Find(const string &file_name) const
+	{
+		auto it = m_mapEntries.find(file_name);
+		return it != m_mapEntries.end() ? &it->second : NULL;
+	}
+
+	void	Set(const string &file_name, const CScanCacheEntry &entry) { m_mapEntries[file_name] = entry; }
+	void	Erase(const string &file_name) { m_mapEntries.erase(file_name); }
+	void	EraseDirectory(const string &dir);		// the files directly in dir, which ends with a separator
+	void	Clear() { m_mapEntries.clear(); }
+};
+
+
+// ===============================================================================
+//									class CGlob
+//
+// Expands a file pattern like "src/**/version.rc". * and ? match within a
+// name, ** matches any number of directories. Names starting with a dot are
+// only matched by a pattern starting with a dot. The directory tree is
+// walked in parallel, below the first levels each task walks a subtree and
+// opens the directories relative to their parent.
+// ===============================================================================
+class CGlob
+{
+protected:
+	struct SDir
+	{
+		string			m_strPath;		// relative to the base path, empty or ending with a separator
+		string			m_strName;		// the last component of m_strPath
+		vector<size_t>	m_vecStates;	// the segments the names in the directory are matched against
+	};
+
+	string			m_strBasePath;
+	vector<string>	m_vecSegments;		// the pattern split at the path separators
+
+	void	AddState(vector<size_t> &states, size_t segment) const;
+	void	List(const SDir &dir, int fd, vector<string> &files, vector<SDir> &subdirs) const;
+	void	Walk(const SDir &dir, int fd, vector<string> &files, vector<string> *dirs) const;
+
+public:
+	static bool	IsPattern(const string &file_name) { return file_name.find_first_of("*?") != string::npos; }
+
+	// "dirs" gets the directories walked, relative to the base path like the files
+	void	Expand(const string &base_path, const string &pattern, int threads, vector<string> &files, vector<string> *dirs = NULL);
+};
+
+
+// ===============================================================================
+//									class CConfiguration
+//
+// The Control File evaluated for one set of defines. Normally there is only
+// one configuration. In matrix mode (-x switch) there is one for each define
+// set, and the Control File is parsed for all of them in a single pass.
+// ===============================================================================
+class CConfiguration
+{
+public:
+	enum { MaxConfigurations = 64 };	// the configurations a line applies to are kept in a bit mask
+
+	string								m_strOutputRoot;		// matrix mode: the results are written below this directory
+	string								m_strBasePath;			// the base path, see %Basepath command in Control File
+	unordered_set<string>				m_setDefines;			// defines through -x switch, in addition to CAutoVersion::m_setDefines
+	unordered_map<string, string>		m_mapConstantDefs;		// definitions of constants in Control File
+	unordered_map<string, CFileNode>	m_mapFiles;				// the files listed in the Control File
+	vector<pair<string, CFileNode>>		m_vecPatterns;			// the file patterns in the Control File, see CGlob
+	list<string>						m_listMessages;			// messages in the Control File
+	list<CCommandShell>					m_listDelayedCommands;	// Commands executed after replacement has done, e.g. "copy"
+};
+
+
+// ===============================================================================
+//									class CDaemon
+//
+// Daemon mode, see --daemon (Linux only): keeps the parsed Control File and the
+// state of the files in memory between runs. inotify watches the directories
+// of the files. A file is only checked again after it was changed, the Control
+// File is only parsed again after it was changed or a file was created,
+// deleted or renamed in a directory walked by a pattern. A file in a
+// directory which can not be watched is checked like in incremental mode.
+// Clients send their requests through a Unix socket, see --request.
+// ===============================================================================
+class CDaemon
+{
+protected:
+	struct SWatch
+	{
+		vector<string>	m_vecDirs;		// the directory as in the file names, empty or ending with a separator
+		bool			m_bPattern;		// walked by a pattern
+	};
+
+	int		m_nInotify;
+	int		m_nSocket;
+	string	m_strSocketFile;
+	string	m_strControlFile;
+	unordered_map<int, SWatch>	m_mapWatches;	// by watch descriptor
+	unordered_map<string, int>	m_mapDirs;		// the watch descriptor of a directory, -1 if it can not be watched
+	vector<char>	m_vecWatched;		// for each file of the last WatchFiles: its directory is watched
+
+	int		Watch(const string &dir, bool pattern);
+	void	ReadEvents();
+
+public:
+	bool			m_bParsed;			// the parsed Control File in CAutoVersion is valid, the patterns expanded
+	bool			m_bWatched;			// the result of the last WatchFiles is valid for the parsed files
+	vector<string>	m_vecPatternDirs;	// the directories walked by the patterns
+	CScanCache		m_ScanCache;		// the state of the files without replacements
+
+	CDaemon()
+	{
+		m_nInotify	= -1;
+		m_nSocket	= -1;
+		m_bParsed	= false;
+		m_bWatched	= false;
+	}
+
+	~CDaemon();
+
+	CDaemon(const CDaemon &) = delete;
+	CDaemon &operator=(const CDaemon &) = delete;
+
+	void	Open(const string &control_file, const string &socket_file);
+	void	Close();
+	int		Accept();
+	const vector<char>	&WatchFiles(const string &base_path, const vector<pair<const string, CFileNode> *> &files);
+
+	static string	GetDirectory(const string &file_name);
+	static int		Request(const string &socket_file, const string &request);
+};
+
+
+// ===============================================================================
+//									class CPhaseStats
+//
+// The resources used by a phase of a run, see --stats. Begin() takes a
+// snapshot of the counters when the phase starts, End() turns it into the
+// usage since then. Unless g_bStats is set, only the wall time is measured.
+// ===============================================================================
+enum EStatsFormat
+{
+	enStatsNone,	// no statistics report
+	enStatsTable,	// human-readable table, see --stats
+	enStatsJson,	// JSON, see --stats-json
+};
+class CPhaseStats
+{
+public:
+	string				m_strPhase;
+	double				m_dWall;			// seconds
+	double				m_dCpu;				// user and system time of the process in seconds
+	unsigned long long	m_nBytesRead;
+	unsigned long long	m_nBytesWritten;
+	unsigned long long	m_nFilesOpened;
+	unsigned long long	m_nAllocations;		// calls of operator new, malloc and realloc
+	unsigned long long	m_nPeakRss;			// peak resident set size of the process at the end of the phase, in bytes
+
+	chrono::steady_clock::time_point	m_tStart;
+
+	CPhaseStats()
+	{
+		m_dWall			= 0;
+		m_dCpu			= 0;
+		m_nBytesRead	= 0;
+		m_nBytesWritten	= 0;
+		m_nFilesOpened	= 0;
+		m_nAllocations	= 0;
+		m_nPeakRss		= 0;
+	}
+
+	static CPhaseStats	Begin();
+	void	End(const char *phase);
 };
 
 
@@ -231,43 +1280,135 @@ class CAutoVersion
 protected:
 	bool	m_bInteractive;		// program is interactive, if false, all questions are answered by default with yes
 	string	m_strControlFile;	// the name of the Control File
-	bool	m_bControlFileSaved;// true, if a rollback file for the Control File was created
-	string	m_strBasePath;		// the base path, see %Basepath command in Control File
+	CJournal	m_Journal;		// the journal of the current run
+	CDaemon	*m_pDaemon;			// the daemon serving the requests, see --daemon
 	int		m_nCurrentLine;		// Current Line number while parsing Control File
 	char	*m_pBuffer;			// holds the Control File while parsing
+	size_t	m_nBufferSize;		// the size of the Control File in m_pBuffer
+	long long	m_tBufferModified;	// the modification time of the Control File in ns, when it was read
+	long long	m_tBufferChanged;	// its status change time in ns
+	unsigned long long	m_nBufferInode;
+	string	m_strKey;			// scratch buffer for map lookups while parsing
+	size_t	m_nScanCacheLimit;	// max. bytes of file contents kept from the check phase for the replace phase
+	int		m_nThreads;			// number of files processed in parallel, see -j switch
+	bool	m_bIncremental;		// skip files unchanged since the last run, see -i switch
+	size_t	m_nStreamWindow;	// files larger than this are processed in windows of this size, 0 = never, see -w switch
+	bool	m_bParseCache;		// keep the parsed Control File in a cache, see -p switch
+	bool	m_bBatchIO;			// read small files in batches, if the system supports it, see -s switch
+	bool	m_bMatrix;			// matrix mode, see -x switch
+	string	m_strTimingFile;	// the durations of the phases of the run are appended to this file, see -t switch
+	EStatsFormat	m_enStats;	// the statistics report, see --stats switch
+	string	m_strStatsFile;		// the JSON statistics are written to this file, stdout if empty
 
-	unordered_set<string>				m_setDefines;			// defines through -d switch
-	unordered_map<string, string>		m_mapConstantDefs;		// definitions of constants in Control File
-	unordered_map<string, CFileNode>	m_mapFiles;				// the files listed in the Control File
-	list<string>						m_listMessages;			// messages in the Control File
-	list<CCommandShell>					m_listDelayedCommands;	// Commands executed after replacement has done, e.g. "copy"
+	vector<CPhaseStats>		m_vecPhases;	// the phases of the current run
+
+	unordered_set<string>	m_setDefines;	// defines through -d switch, they apply to all configurations
+	CStringPool				m_StringPool;	// the what- and with-strings of the replacements in m_vecConfigs
+	vector<CConfiguration>	m_vecConfigs;	// only m_vecConfigs[0] without matrix mode
+
+	// state of the conditional blocks while parsing
+	unsigned long long		m_nActive;		// bit n set: the current line applies to m_vecConfigs[n]
+	vector<pair<unsigned long long, unsigned long long>>	m_vecIfStack;	// the enclosing %if blocks: (m_nActive before the block, configurations with the condition met)
+
+	// state of the %group blocks while parsing
+	size_t					m_nGroups;		// the number of %group blocks so far
+	size_t					m_nGroup;		// the current %group block, 0 if none
+	int						m_nGroupParallel;	// the parallelism of the current %group block
+
+	// calls f for each configuration the current line applies to
+	template <class F>
+	void	ForEachActive(F f)
+	{
+		for (size_t i = 0; i < m_vecConfigs.size(); i++)
+		{
+			if (m_nActive & (1ULL << i))
+				f(m_vecConfigs[i]);
+		}
+	}
 
 	void	SkipWhiteSpaces(char *&p);
 	void	SkipLine(char *&p, bool only_white_spaces = true);
 	void	SkipComment(char *&p);
 	void	Scan(char *&p, const char *token);
-	string	GetIdentifier(char *&p);
-	string	GetLiteral(char *&p, size_t *offset = NULL);
-	string	GetLiteralOrSymbol(char *&p);
+	bool	SkipBlock(char *&p, bool stop_at_else);
+	string_view	GetIdentifier(char *&p);
+	string_view	GetLiteral(char *&p, size_t *offset = NULL);		// the literal as in the Control File, see Unescape
+	const string	*FindConstant(const CConfiguration &config, string_view ident);
 	void	ParseConstantDef(char *&p);
 	void	ParseReplacement(EReplaceOp op, char *&p);
 	void	ParseMessage(char *&p);
 	void	ParseCommand(char *&p);
-	void	UpdateControlFile();
+	void	LoadControlFile();
+	void	ExpandPatterns();
+	void	CompactRules();
+	size_t	CheckFiles(vector<pair<const string, CFileNode> *> &files, vector<char> &must_replace, CThreadPool &pool);
+	void	UpdateControlFile(CJournalEntry *plan = NULL);
+	string	GetJournalFile() const { return m_strControlFile + ".avjournal"; }
+	string	GetScanCacheFile() const { return m_strControlFile + ".avcache"; }
+	string	GetParseCacheFile() const { return m_strControlFile + ".avparsed"; }
+	string	GetSocketFile() const { return m_strControlFile + ".avsock"; }
+	void	Check();
+	int		ServeRequest(const string &request, int client);
+	string	GetParseCacheKey(const char *buf, size_t size) const;
+	bool	LoadParseCache(const string &key);
+	void	SaveParseCache(const string &key) const;
+	void	EndPhase(const char *phase, CPhaseStats &stats);
 
 public:
 	CAutoVersion()
 	{
 		m_bInteractive		= true;
-		m_bControlFileSaved	= false;
 		m_nCurrentLine		= 1;
+		m_pDaemon			= NULL;
 		m_pBuffer			= NULL;
+		m_nBufferSize		= 0;
+		m_tBufferModified	= 0;
+		m_tBufferChanged	= 0;
+		m_nBufferInode		= 0;
+		m_nScanCacheLimit	= 256 * 1024 * 1024;
+		m_nThreads			= 1;
+		m_bIncremental		= false;
+		m_nStreamWindow		= 64 * 1024 * 1024;
+		m_bParseCache		= false;
+		m_bBatchIO			= true;
+		m_bMatrix			= false;
+		m_enStats			= enStatsNone;
+		m_nActive			= 0;
+		m_nGroups			= 0;
+		m_nGroup			= 0;
+		m_nGroupParallel	= 1;
+		m_vecConfigs.resize(1);
 	}
 
 	bool	GetInteractive() const { return m_bInteractive; }
 	void	SetInteractive(bool val) { m_bInteractive = val; }
 
 	void	AddDefine(const string &d) { m_setDefines.insert(d); }
+	void	AddConfiguration(const string &output_root, const vector<string> &defines);
+	bool	GetMatrix() const { return m_bMatrix; }
+
+	size_t	GetScanCacheLimit() const { return m_nScanCacheLimit; }
+	void	SetScanCacheLimit(size_t val) { m_nScanCacheLimit = val; }
+
+	int		GetThreads() const { return m_nThreads; }
+	void	SetThreads(int val) { m_nThreads = val < 1 ? 1 : val; }
+
+	bool	GetIncremental() const { return m_bIncremental; }
+	void	SetIncremental(bool val) { m_bIncremental = val; }
+
+	size_t	GetStreamWindow() const { return m_nStreamWindow; }
+	void	SetStreamWindow(size_t val) { m_nStreamWindow = val; }
+
+	bool	GetParseCache() const { return m_bParseCache; }
+	void	SetParseCache(bool val) { m_bParseCache = val; }
+
+	bool	GetBatchIO() const { return m_bBatchIO; }
+	void	SetBatchIO(bool val) { m_bBatchIO = val; }
+
+	const	string	&GetTimingFile() const { return m_strTimingFile; }
+	void			SetTimingFile(const string &val) { m_strTimingFile = val; }
+
+	void	SetStats(EStatsFormat format, const string &file = "") { m_enStats = format; m_strStatsFile = file; g_bStats = format != enStatsNone; }
 
 	const	string	&GetControlFile() const { return m_strControlFile; }
 	void			SetControlFile(const string &val) { m_strControlFile = val; }
@@ -276,55 +1417,72 @@ public:
 
 	void	ParseControlFile();
 	void	Replace();
+	void	Plan(const string &plan_file);
+	void	Apply(const string &plan_file);
+	void	ReplaceMatrix();
+	void	Serve();
+	int		SendRequest(const string &request) const { return CDaemon::Request(GetSocketFile(), request); }
 	void	RescueRollback();
 	void	Rollback();
 	void	Clean();
+	void	WriteTimings(const char *operation);
+	void	WriteStats(const char *operation);
 
 	void ShowMessages()
 	{
 		printf("\n\n");
-		for (auto it : m_listMessages)
-			printf("%s\n", it.c_str());
-	}
-
-	void ExecDelayedCommands()
-	{
-		if (g_bVerbose && m_listDelayedCommands.size() > 0)
-			printf("\nexecuting delayed commands\n");
-
-		for (auto it : m_listDelayedCommands)
+		for (auto &config : m_vecConfigs)
 		{
-			if (!it.Execute())
-				throw CException("a delayed command failed");
+			if (m_bMatrix && config.m_listMessages.size() > 0)
+				printf("%s:\n", config.m_strOutputRoot.c_str());
+
+			for (auto &it : config.m_listMessages)
+				printf("%s\n", it.c_str());
 		}
 	}
 
+	void	ExecDelayedCommands();
+
 #ifdef _DEBUG
 	void Dump()		// show parsed structures of Control File
 	{
 		printf("Verbose %s\n", g_bVerbose ? "yes" : "no");
 		printf("Interactive %s\n", m_bInteractive ? "yes" : "no");
 		printf("Control File %s\n", m_strControlFile.c_str());
-		printf("Base Path %s\n", m_strBasePath.c_str());
 
 		printf("\nCommand-Line Defines:\n");
-		for (auto it : m_setDefines)
+		for (auto &it : m_setDefines)
 			printf("%s\n", it.c_str());
 
-		printf("\nConstants:\n");
-		for (auto it : m_mapConstantDefs)
-			printf("%s\t\t%s\n", it.first.c_str(), it.second.c_str());
-
-		printf("\nReplacement-Definitions:\n");
-		for (auto it : m_mapFiles)
+		for (auto &config : m_vecConfigs)
 		{
-			printf("\nFile: %s\n", it.first.c_str());
-			it.second.Dump();
-		}
+			printf("\nConfiguration %s\n", config.m_strOutputRoot.c_str());
+			printf("Base Path %s\n", config.m_strBasePath.c_str());
 
-		printf("\nMessages:\n");
-		for (auto it : m_listMessages)
-			printf("%s\n", it.c_str());
+			printf("\nDefines:\n");
+			for (auto &it : config.m_setDefines)
+				printf("%s\n", it.c_str());
+
+			printf("\nConstants:\n");
+			for (auto &it : config.m_mapConstantDefs)
+				printf("%s\t\t%s\n", it.first.c_str(), it.second.c_str());
+
+			printf("\nReplacement-Definitions:\n");
+			for (auto &it : config.m_vecPatterns)
+			{
+				printf("\nPattern: %s\n", it.first.c_str());
+				it.second.Dump();
+			}
+			for (auto &it : config.m_mapFiles)
+			{
+				printf("\nFile: %s\n", it.first.c_str());
+				it.second.Dump();
+			}
+
+			printf("\nMessages:\n");
+			for (auto &it : config.m_listMessages)
+				printf("%s\n", it.c_str());
+		}
 	}
 #endif
 };
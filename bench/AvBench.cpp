@@ -0,0 +1,869 @@
+/*
+* avbench.cpp
+* Copyright (C) 2024  T. Radde
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Benchmark of autoversion: a generator for synthetic trees and Control
+// Files, and a harness, which times the phases of autoversion runs on them.
+//
+//		g++ -std=c++17 -O2 bench/AvBench.cpp -o avbench
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <exception>
+#include <chrono>
+using namespace std;
+
+#ifdef WIN32
+	#include <windows.h>
+	#include <direct.h>
+	#include <psapi.h>
+
+	#define PATH_SEPARATOR	"\\"
+	#define _mkdir_p(dir)	_mkdir(dir)
+#else
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <sys/resource.h>
+	#include <sys/wait.h>
+
+	#define PATH_SEPARATOR	"/"
+	#define _unlink			unlink
+	#define _mkdir_p(dir)	mkdir(dir, 0777)
+#endif
+
+#include "AvBench.h"
+
+
+// ===============================================================================
+//										Helpers
+// ===============================================================================
+static string ToString(unsigned long long val)
+{
+	char buf[32];
+	sprintf(buf, "%llu", val);
+	return buf;
+}
+
+static string JsonString(const string &s)
+{
+	string out = "\"";
+	for (char c : s)
+	{
+		if (c == '"' || c == '\\')
+			out += '\\';
+		if ((unsigned char)c < 0x20)
+		{
+			char buf[8];
+			sprintf(buf, "\\u%04x", (unsigned char)c);
+			out += buf;
+		}
+		else
+			out += c;
+	}
+	return out + "\"";
+}
+
+// a number with an optional k, M or G suffix
+static bool ParseSize(const char *s, size_t &val)
+{
+	char *end;
+	unsigned long long n = strtoull(s, &end, 10);
+	if (end == s)
+		return false;
+
+	if (*end == 'k' || *end == 'K')
+		n *= 1024, end++;
+	else if (*end == 'M')
+		n *= 1024 * 1024, end++;
+	else if (*end == 'G')
+		n *= 1024ULL * 1024 * 1024, end++;
+
+	val = (size_t)n;
+	return *end == 0;
+}
+
+static void MakeDirectory(const string &dir)
+{
+	if (_mkdir_p(dir.c_str()) != 0 && errno != EEXIST)
+		throw CBenchException("can not create directory " + dir);
+}
+
+static void WriteFile(const string &file_name, const string &data)
+{
+	FILE *fh = fopen(file_name.c_str(), "wb");
+	if (!fh)
+		throw CBenchException("can not create file " + file_name);
+
+	bool failed = fwrite(data.data(), 1, data.length(), fh) != data.length();
+	if (fclose(fh) != 0 || failed)
+		throw CBenchException("writing file " + file_name + " failed");
+}
+
+static string ReadFile(const string &file_name)
+{
+	string data;
+	FILE *fh = fopen(file_name.c_str(), "rb");
+	if (!fh)
+		return data;
+
+	char buf[4096];
+	size_t len;
+	while ((len = fread(buf, 1, sizeof(buf), fh)) > 0)
+		data.append(buf, len);
+	fclose(fh);
+	return data;
+}
+
+static string GetAbsolutePath(const string &dir)
+{
+#ifdef WIN32
+	char buf[MAX_PATH];
+	if (GetFullPathNameA(dir.c_str(), sizeof(buf), buf, NULL) == 0)
+		throw CBenchException("invalid directory " + dir);
+	return buf;
+#else
+	char *path = realpath(dir.c_str(), NULL);
+	if (!path)
+		throw CBenchException("invalid directory " + dir);
+	string result = path;
+	free(path);
+	return result;
+#endif
+}
+
+// writes the dirty pages and empties the page cache, so a run reads from the disk
+static void DropCaches()
+{
+#ifdef __linux__
+	sync();
+	FILE *fh = fopen("/proc/sys/vm/drop_caches", "w");
+	bool failed = !fh || fputs("3", fh) < 0;
+	if (fh && fclose(fh) != 0)
+		failed = true;
+	if (failed)
+		throw CBenchException("can not drop the page cache, --cold needs root");
+#else
+	throw CBenchException("--cold is only supported on Linux");
+#endif
+}
+
+
+// ===============================================================================
+//							CTreeGenerator::ParseOption
+// ===============================================================================
+bool CTreeGenerator::ParseOption(const char *arg)
+{
+	struct SOption
+	{
+		const char	*m_pName;
+		size_t		*m_pValue;
+	};
+
+	size_t seed = m_nSeed;
+	SOption options[] =
+	{
+		{ "--files=",			&m_nFiles },
+		{ "--size=",			&m_nFileSize },
+		{ "--rules=",			&m_nRules },
+		{ "--matches=",			&m_nMatches },
+		{ "--nesting=",			&m_nNesting },
+		{ "--regex=",			&m_nRegex },
+		{ "--files-per-dir=",	&m_nFilesPerDir },
+		{ "--seed=",			&seed },
+	};
+
+	for (auto &option : options)
+	{
+		size_t len = strlen(option.m_pName);
+		if (strncmp(arg, option.m_pName, len) == 0)
+		{
+			if (!ParseSize(arg + len, *option.m_pValue))
+				throw CBenchException(string("invalid value in ") + arg);
+
+			m_nSeed = (unsigned)seed;
+			if (m_nFiles == 0 || m_nRules == 0 || m_nMatches == 0 || m_nFilesPerDir == 0 || m_nRegex > m_nRules)
+				throw CBenchException(string("invalid value in ") + arg);
+			return true;
+		}
+	}
+
+	if (strcmp(arg, "--binary") == 0)
+		m_bBinary = true;
+	else if (strcmp(arg, "--same-length") == 0)
+		m_bSameLength = true;
+	else if (strcmp(arg, "--unchanged") == 0)
+		m_bUnchanged = true;
+	else
+		return false;
+
+	return true;
+}
+
+
+// ===============================================================================
+//							CTreeGenerator::ToJson
+// ===============================================================================
+string CTreeGenerator::ToJson() const
+{
+	return "{\"files\":" + ToString(m_nFiles) +
+		   ",\"size\":" + ToString(m_nFileSize) +
+		   ",\"rules\":" + ToString(m_nRules) +
+		   ",\"matches\":" + ToString(m_nMatches) +
+		   ",\"nesting\":" + ToString(m_nNesting) +
+		   ",\"regex\":" + ToString(m_nRegex) +
+		   ",\"binary\":" + (m_bBinary ? "true" : "false") +
+		   ",\"same_length\":" + (m_bSameLength || m_bBinary ? "true" : "false") +
+		   ",\"unchanged\":" + (m_bUnchanged ? "true" : "false") +
+		   ",\"seed\":" + ToString(m_nSeed) + "}";
+}
+
+
+// ===============================================================================
+//							CTreeGenerator::GetControlFile
+// ===============================================================================
+string CTreeGenerator::GetControlFile(const string &dir)
+{
+	return dir + PATH_SEPARATOR + "control.txt";
+}
+
+
+// ===============================================================================
+//							CTreeGenerator::GetFileName
+// ===============================================================================
+string CTreeGenerator::GetFileName(size_t index) const
+{
+	char name[64];
+	sprintf(name, "d%04llu/f%07llu.txt", (unsigned long long)(index / m_nFilesPerDir), (unsigned long long)index);
+	return name;
+}
+
+
+// ===============================================================================
+//							CTreeGenerator::GetWhat
+//
+// The last m_nRegex rules are regular expressions, their files hold REG_
+// strings. A what-string is found as it is in the file; for a regular
+// expression, GetWhat is the text in the file, not the expression.
+// ===============================================================================
+string CTreeGenerator::GetWhat(size_t rule) const
+{
+	bool regex = rule >= m_nRules - m_nRegex;
+	return (regex ? "REG_" : "VER_") + ToString(rule) + "_v1.0";
+}
+
+string CTreeGenerator::GetWith(size_t rule) const
+{
+	bool regex = rule >= m_nRules - m_nRegex;
+	bool same_length = m_bSameLength || m_bBinary;
+	if (m_bUnchanged)
+		return regex ? "REG_" + ToString(rule) + "_v$1.$2" : GetWhat(rule);
+	if (regex)
+		return "REG_" + ToString(rule) + (same_length ? "_v$1.9" : "_v$1.99");
+
+	return "VER_" + ToString(rule) + (same_length ? "_v2.0" : "_v2.10");
+}
+
+
+// ===============================================================================
+//							CTreeGenerator::WriteControlFile
+// ===============================================================================
+void CTreeGenerator::WriteControlFile(const string &dir) const
+{
+	string base_path;
+	for (char c : GetAbsolutePath(dir))
+	{
+		if (c == '\\' || c == '"')
+			base_path += '\\';
+		base_path += c;
+	}
+
+	string data = "# generated by avbench " + ToJson() + "\n\n";
+	data += "%Basepath \"" + base_path + "\"\n\n";
+
+	for (size_t rule = 0; rule < m_nRules; rule++)
+		data += "@C" + ToString(rule) + "\t\"" + GetWith(rule) + "\"\n";
+	data += "\n";
+
+	string op = m_bBinary ? "$" : "&";
+	for (size_t i = 0; i < m_nFiles; i++)
+	{
+		string file_name = GetFileName(i);
+
+		// each level has a branch, which is skipped
+		string indent;
+		for (size_t level = 0; level < m_nNesting; level++)
+		{
+			data += indent + "%if avbench_skip" + ToString(level) + "\n";
+			data += indent + "\t" + op + "\"" + file_name + "\"\t\"VER_0_skipped\"\t@C0\n";
+			data += indent + "%else\n";
+			indent += "\t";
+		}
+
+		for (size_t rule = 0; rule < m_nRules; rule++)
+		{
+			if (rule >= m_nRules - m_nRegex)
+				data += indent + "~\"" + file_name + "\"\t\"REG_" + ToString(rule) + "_v(\\\\d+)\\\\.(\\\\d+)\"\t@C" + ToString(rule) + "\n";
+			else
+				data += indent + op + "\"" + file_name + "\"\t\"" + GetWhat(rule) + "\"\t@C" + ToString(rule) + "\n";
+		}
+
+		for (size_t level = m_nNesting; level-- > 0; )
+		{
+			indent.erase(0, 1);
+			data += indent + "%end\n";
+		}
+	}
+
+	WriteFile(GetControlFile(dir), data);
+}
+
+
+// ===============================================================================
+//							CTreeGenerator::WriteTarget
+//
+// filler text with the what-strings of all rules, each m_nMatches times,
+// at even distances
+// ===============================================================================
+void CTreeGenerator::WriteTarget(const string &file_name, size_t index) const
+{
+	// the filler of all files is cut from one block
+	static string filler;
+	static unsigned filler_seed = 0;
+	if (filler.empty() || filler_seed != m_nSeed)
+	{
+		filler.assign(256 * 1024, ' ');
+		unsigned long long state = m_nSeed * 6364136223846793005ULL + 1442695040888963407ULL;
+		for (size_t i = 0; i < filler.length(); i++)
+		{
+			state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+			unsigned r = (unsigned)(state >> 33) % 32;
+			filler[i] = r < 26 ? (char)('a' + r) : (r < 31 ? ' ' : '\n');
+		}
+		filler_seed = m_nSeed;
+	}
+
+	vector<string> tokens;
+	size_t tokens_len = 0;
+	for (size_t k = 0; k < m_nMatches; k++)
+	{
+		for (size_t rule = 0; rule < m_nRules; rule++)
+		{
+			tokens.push_back(" " + GetWhat(rule) + " ");
+			tokens_len += tokens.back().length();
+		}
+	}
+
+	size_t fill = m_nFileSize > tokens_len ? m_nFileSize - tokens_len : 0;
+	size_t gap = fill / (tokens.size() + 1);
+	size_t pos = (index * 7919) % filler.length();
+
+	string data;
+	data.reserve(max(m_nFileSize, tokens_len) + 1);
+	auto add_filler = [&](size_t len)
+	{
+		while (len > 0)
+		{
+			size_t n = min(len, filler.length() - pos);
+			data.append(filler, pos, n);
+			pos = (pos + n) % filler.length();
+			len -= n;
+		}
+	};
+
+	for (auto &token : tokens)
+	{
+		add_filler(gap);
+		data += token;
+	}
+	add_filler(fill - gap * tokens.size());
+
+	WriteFile(file_name, data);
+}
+
+
+// ===============================================================================
+//							CTreeGenerator::Generate
+// ===============================================================================
+void CTreeGenerator::Generate(const string &dir) const
+{
+	MakeDirectory(dir);
+
+	for (size_t i = 0; i < m_nFiles; i++)
+	{
+		string file_name = GetFileName(i);
+		if (i % m_nFilesPerDir == 0)
+			MakeDirectory(dir + PATH_SEPARATOR + file_name.substr(0, file_name.find('/')));
+		WriteTarget(dir + PATH_SEPARATOR + file_name, i);
+	}
+
+	WriteControlFile(dir);
+}
+
+
+// ===============================================================================
+//							CHarness::Execute
+//
+// runs the executable with "args", its output goes to avbench.log in the
+// tree, and measures it
+// ===============================================================================
+CHarness::SRun CHarness::Execute(const char *operation, const vector<string> &args)
+{
+	SRun run;
+	run.m_strOperation	= operation;
+	run.m_nExitCode		= -1;
+	run.m_dCpu			= 0;
+	run.m_nPeakRss		= 0;
+	run.m_nWritten		= 0;
+
+	string log_file = m_strDir + PATH_SEPARATOR + "avbench.log";
+	string timing_file = m_strDir + PATH_SEPARATOR + "avbench-timings.jsonl";
+	_unlink(timing_file.c_str());
+
+	vector<string> argv;
+	argv.push_back(m_strExecutable);
+	argv.insert(argv.end(), args.begin(), args.end());
+	if (m_bTimings)
+		argv.push_back("-t" + timing_file);
+	argv.push_back(CTreeGenerator::GetControlFile(m_strDir));
+
+	if (m_bColdCache)
+		DropCaches();
+
+	auto start = chrono::steady_clock::now();
+
+#ifdef WIN32
+	string cmd;
+	for (auto &it : argv)
+		cmd += (cmd.empty() ? "\"" : " \"") + it + "\"";
+
+	SECURITY_ATTRIBUTES sa = { sizeof(sa), NULL, TRUE };
+	HANDLE log = CreateFileA(log_file.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE, &sa, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (log == INVALID_HANDLE_VALUE)
+		throw CBenchException("can not create " + log_file);
+
+	STARTUPINFOA si;
+	memset(&si, 0, sizeof(si));
+	si.cb			= sizeof(si);
+	si.dwFlags		= STARTF_USESTDHANDLES;
+	si.hStdInput	= GetStdHandle(STD_INPUT_HANDLE);
+	si.hStdOutput	= log;
+	si.hStdError	= log;
+
+	PROCESS_INFORMATION pi;
+	if (!CreateProcessA(NULL, &cmd[0], NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi))
+	{
+		CloseHandle(log);
+		throw CBenchException("can not start " + m_strExecutable);
+	}
+
+	WaitForSingleObject(pi.hProcess, INFINITE);
+	run.m_dWall = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	DWORD exit_code;
+	if (GetExitCodeProcess(pi.hProcess, &exit_code))
+		run.m_nExitCode = (int)exit_code;
+
+	FILETIME creation, exit, kernel, user;
+	if (GetProcessTimes(pi.hProcess, &creation, &exit, &kernel, &user))
+	{
+		unsigned long long ticks = ((unsigned long long)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) +
+								   ((unsigned long long)user.dwHighDateTime << 32 | user.dwLowDateTime);
+		run.m_dCpu = ticks / 1e7;		// 100 ns units
+	}
+
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (GetProcessMemoryInfo(pi.hProcess, &pmc, sizeof(pmc)))
+		run.m_nPeakRss = pmc.PeakWorkingSetSize;
+
+	IO_COUNTERS io;
+	if (GetProcessIoCounters(pi.hProcess, &io))
+		run.m_nWritten = io.WriteTransferCount;
+
+	CloseHandle(pi.hThread);
+	CloseHandle(pi.hProcess);
+	CloseHandle(log);
+#else
+	vector<char *> cargv;
+	for (auto &it : argv)
+		cargv.push_back(const_cast<char *>(it.c_str()));
+	cargv.push_back(NULL);
+
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0)
+		throw CBenchException("fork failed");
+
+	if (pid == 0)
+	{
+		int fd = open(log_file.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666);
+		if (fd >= 0)
+		{
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+			close(fd);
+		}
+		execv(cargv[0], cargv.data());
+		_exit(127);
+	}
+
+	int status;
+	struct rusage ru;
+	while (wait4(pid, &status, 0, &ru) < 0)
+	{
+		if (errno != EINTR)
+			throw CBenchException("waiting for " + m_strExecutable + " failed");
+	}
+
+	run.m_dWall		= chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	run.m_nExitCode	= WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+	run.m_dCpu		= ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+	#ifdef __APPLE__
+		run.m_nPeakRss = (unsigned long long)ru.ru_maxrss;			// bytes
+	#else
+		run.m_nPeakRss = (unsigned long long)ru.ru_maxrss * 1024;	// KB
+	#endif
+	run.m_nWritten = (unsigned long long)ru.ru_oublock * 512;		// blocks
+#endif
+
+	// the tool writes one line per run
+	if (m_bTimings)
+	{
+		run.m_strTimings = ReadFile(timing_file);
+		while (!run.m_strTimings.empty() && (run.m_strTimings.back() == '\n' || run.m_strTimings.back() == '\r'))
+			run.m_strTimings.pop_back();
+	}
+
+	return run;
+}
+
+
+// ===============================================================================
+//							CHarness::Report
+//
+// appends the runs to the results, one JSON object per line
+// ===============================================================================
+void CHarness::Report(const vector<SRun> &runs, const CTreeGenerator &generator)
+{
+	string args = "[";
+	for (auto &it : m_vecArgs)
+		args += (args.length() > 1 ? "," : "") + JsonString(it);
+	args += "]";
+
+	string lines;
+	for (size_t i = 0; i < runs.size(); i++)
+	{
+		const SRun &run = runs[i];
+		char numbers[200];
+		sprintf(numbers, ",\"exit\":%d,\"wall\":%.6f,\"cpu\":%.6f,\"peak_rss\":%llu,\"written\":%llu",
+			run.m_nExitCode, run.m_dWall, run.m_dCpu, run.m_nPeakRss, run.m_nWritten);
+
+		lines += "{\"label\":" + JsonString(m_strLabel) +
+				 ",\"executable\":" + JsonString(m_strExecutable) +
+				 ",\"args\":" + args +
+				 ",\"cold\":" + (m_bColdCache ? "true" : "false") +
+				 ",\"tree\":" + generator.ToJson() +
+				 ",\"run\":" + ToString(i) +
+				 ",\"operation\":" + JsonString(run.m_strOperation) +
+				 numbers +
+				 ",\"timings\":" + (run.m_strTimings.empty() ? string("null") : run.m_strTimings) + "}\n";
+	}
+
+	if (m_strResults.empty())
+	{
+		fwrite(lines.data(), 1, lines.length(), stdout);
+		return;
+	}
+
+	FILE *fh = fopen(m_strResults.c_str(), "ab");
+	if (!fh || fwrite(lines.data(), 1, lines.length(), fh) != lines.length())
+		throw CBenchException("writing the results to " + m_strResults + " failed");
+	fclose(fh);
+}
+
+
+// ===============================================================================
+//							CHarness::Summary
+//
+// prints the median of each operation and of each phase the tool reported,
+// peak RSS is the maximum
+// ===============================================================================
+static double Median(vector<double> values)
+{
+	if (values.empty())
+		return 0;
+
+	sort(values.begin(), values.end());
+	size_t n = values.size();
+	return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+void CHarness::Summary(const vector<SRun> &runs)
+{
+	vector<string> operations;
+	for (auto &run : runs)
+	{
+		if (find(operations.begin(), operations.end(), run.m_strOperation) == operations.end())
+			operations.push_back(run.m_strOperation);
+	}
+
+	printf("\n%-10s %6s %10s %10s %12s %11s   %s\n", "operation", "runs", "wall s", "cpu s", "peak RSS MB", "written MB", "phases (median s)");
+	for (auto &op : operations)
+	{
+		vector<double> wall, cpu, written;
+		unsigned long long peak_rss = 0;
+		vector<pair<string, vector<double>>> phases;
+
+		for (auto &run : runs)
+		{
+			if (run.m_strOperation != op)
+				continue;
+
+			wall.push_back(run.m_dWall);
+			cpu.push_back(run.m_dCpu);
+			peak_rss = max(peak_rss, run.m_nPeakRss);
+			written.push_back((double)run.m_nWritten);
+
+			// "phases":{"parse":0.1,...} as written by -t
+			size_t pos = run.m_strTimings.find("\"phases\":{");
+			if (pos == string::npos)
+				continue;
+
+			const char *p = run.m_strTimings.c_str() + pos + 10;
+			while (*p == '"')
+			{
+				const char *end = strchr(p + 1, '"');
+				if (!end || end[1] != ':')
+					break;
+
+				string name(p + 1, end);
+				char *next;
+				double seconds = strtod(end + 2, &next);
+
+				auto it = find_if(phases.begin(), phases.end(), [&](const pair<string, vector<double>> &x) { return x.first == name; });
+				if (it == phases.end())
+				{
+					phases.push_back(make_pair(name, vector<double>()));
+					it = phases.end() - 1;
+				}
+				it->second.push_back(seconds);
+
+				p = *next == ',' ? next + 1 : next;
+			}
+		}
+
+		printf("%-10s %6d %10.3f %10.3f %12.1f %11.1f  ", op.c_str(), (int)wall.size(), Median(wall), Median(cpu), peak_rss / (1024.0 * 1024.0), Median(written) / (1024.0 * 1024.0));
+		for (auto &phase : phases)
+			printf(" %s %.3f", phase.first.c_str(), Median(phase.second));
+		printf("\n");
+	}
+}
+
+
+// ===============================================================================
+//							CHarness::SetSteps
+//
+// "steps" is a comma separated list of replace, rollback and clean. Returns
+// false, if it is invalid.
+// ===============================================================================
+bool CHarness::SetSteps(const string &steps)
+{
+	vector<string> list;
+	size_t pos = 0;
+	while (pos <= steps.length())
+	{
+		size_t end = steps.find(',', pos);
+		if (end == string::npos)
+			end = steps.length();
+
+		string step = steps.substr(pos, end - pos);
+		if (step != "replace" && step != "rollback" && step != "clean")
+			return false;
+
+		list.push_back(step);
+		pos = end + 1;
+	}
+
+	m_vecSteps = list;
+	return true;
+}
+
+
+// ===============================================================================
+//							CHarness::Run
+// ===============================================================================
+void CHarness::Run(const CTreeGenerator &generator)
+{
+	vector<SRun> runs;
+	for (size_t rep = 0; rep < m_nRepetitions; rep++)
+	{
+		if (rep > 0 || !m_bKeepTree)
+		{
+			printf("writing the tree to %s\n", m_strDir.c_str());
+			fflush(stdout);
+			generator.Generate(m_strDir);
+		}
+
+		// a failed run might have left its journal, steps without a clean leave the backups
+		string control_file = CTreeGenerator::GetControlFile(m_strDir);
+		_unlink((control_file + ".avjournal").c_str());
+		_unlink((control_file + ".avbak").c_str());
+		for (size_t i = 0; i < generator.m_nFiles; i++)
+			_unlink((m_strDir + PATH_SEPARATOR + generator.GetFileName(i) + ".avbak").c_str());
+
+		for (auto &step : m_vecSteps)
+		{
+			vector<string> args = m_vecArgs;
+			if (step == "rollback")
+				args.push_back("-r");
+			else if (step == "clean")
+				args.push_back("-c");
+			args.push_back("-y");
+
+			runs.push_back(Execute(step.c_str(), args));
+			const SRun &run = runs.back();
+			printf("%d: %-10s exit %d, %.3f s\n", (int)rep, step.c_str(), run.m_nExitCode, run.m_dWall);
+			fflush(stdout);
+
+			if (run.m_nExitCode != 0)
+			{
+				Report(runs, generator);
+				throw CBenchException(step + " failed, see " + m_strDir + PATH_SEPARATOR + "avbench.log");
+			}
+		}
+	}
+
+	Report(runs, generator);
+	Summary(runs);
+}
+
+
+// ===============================================================================
+//										main
+// ===============================================================================
+static void Usage(const char *name)
+{
+	cerr << "Syntax: " << name << " generate <dir> [tree options]" << endl;
+	cerr << "        " << name << " run <autoversion> <dir> [tree options] [run options] [-- autoversion options]" << endl;
+	cerr << "  tree options:" << endl;
+	cerr << "        --files=N: number of target files, default 1000" << endl;
+	cerr << "        --size=N: size of a target file in bytes (k, M, G), default 4k" << endl;
+	cerr << "        --rules=N: replacements per file, default 4" << endl;
+	cerr << "        --matches=N: occurrences of each what-string per file, default 1" << endl;
+	cerr << "        --nesting=N: %if nesting depth around the rules of a file, default 0" << endl;
+	cerr << "        --regex=N: how many of the rules are regular expressions (~), default 0" << endl;
+	cerr << "        --files-per-dir=N: default 1000" << endl;
+	cerr << "        --binary: $ rules instead of &" << endl;
+	cerr << "        --same-length: the replacements keep the length of the files" << endl;
+	cerr << "        --unchanged: the constants are the old versions, nothing is replaced" << endl;
+	cerr << "        --seed=N" << endl;
+	cerr << "  run options:" << endl;
+	cerr << "        --runs=N: repetitions of replace, rollback, replace and clean, default 3" << endl;
+	cerr << "        --steps=op,...: the operations of a repetition instead: replace, rollback, clean" << endl;
+	cerr << "        --label=name: names the build in the results" << endl;
+	cerr << "        --out=file: append the results (JSON, one line per run) to file, default stdout" << endl;
+	cerr << "        --keep-tree: use the existing tree for the first repetition" << endl;
+	cerr << "        --no-timings: do not pass -t, for builds which do not know it" << endl;
+	cerr << "        --cold: drop the page cache before each run (Linux, root)" << endl;
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 3)
+		Usage(argv[0]);
+
+	try
+	{
+		CTreeGenerator generator;
+		CHarness harness;
+
+		string mode = argv[1];
+		int first = 0;
+		if (mode == "generate")
+			first = 3;
+		else if (mode == "run" && argc >= 4)
+		{
+			harness.m_strExecutable = argv[2];
+			first = 4;
+		}
+		else
+			Usage(argv[0]);
+
+		string dir = argv[first - 1];
+
+		for (int i = first; i < argc; i++)
+		{
+			const char *arg = argv[i];
+			size_t val;
+			if (generator.ParseOption(arg))
+				continue;
+			else if (mode == "run" && strcmp(arg, "--") == 0)
+			{
+				harness.m_vecArgs.assign(argv + i + 1, argv + argc);
+				break;
+			}
+			else if (mode == "run" && strncmp(arg, "--runs=", 7) == 0 && ParseSize(arg + 7, val) && val > 0)
+				harness.m_nRepetitions = val;
+			else if (mode == "run" && strncmp(arg, "--steps=", 8) == 0 && harness.SetSteps(arg + 8))
+				;
+			else if (mode == "run" && strncmp(arg, "--label=", 8) == 0)
+				harness.m_strLabel = arg + 8;
+			else if (mode == "run" && strncmp(arg, "--out=", 6) == 0)
+				harness.m_strResults = arg + 6;
+			else if (mode == "run" && strcmp(arg, "--keep-tree") == 0)
+				harness.m_bKeepTree = true;
+			else if (mode == "run" && strcmp(arg, "--no-timings") == 0)
+				harness.m_bTimings = false;
+			else if (mode == "run" && strcmp(arg, "--cold") == 0)
+				harness.m_bColdCache = true;
+			else
+			{
+				cerr << "Invalid option " << arg << endl;
+				exit(1);
+			}
+		}
+
+		if (mode == "generate")
+		{
+			generator.Generate(dir);
+			printf("%s written\n", CTreeGenerator::GetControlFile(dir).c_str());
+		}
+		else
+		{
+			MakeDirectory(dir);
+			harness.m_strDir = GetAbsolutePath(dir);
+			harness.Run(generator);
+		}
+	}
+	catch (exception &e)
+	{
+		printf("\nError: %s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
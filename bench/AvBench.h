@@ -0,0 +1,151 @@
+/*
+* avbench.h
+* Copyright (C) 2024  T. Radde
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _AVBENCH_H_
+#define _AVBENCH_H_
+
+
+// ===============================================================================
+//									class CBenchException
+// ===============================================================================
+class CBenchException : public exception
+{
+protected:
+	string	m_strMessage;
+
+public:
+	CBenchException(const string &message)
+		: m_strMessage(message)
+	{
+	}
+
+	const char *what() const noexcept override { return m_strMessage.c_str(); }
+};
+
+
+// ===============================================================================
+//									class CTreeGenerator
+//
+// Writes a synthetic tree of target files and a Control File for it. Each
+// file gets the same "m_nRules" replacements; every what-string occurs
+// "m_nMatches" times, spread evenly over filler text of about "m_nFileSize"
+// bytes. The filler is lower case only, the what-strings contain upper case
+// letters, so there are no other matches. The rules of a file are nested in
+// "m_nNesting" %if blocks, each with a skipped %if branch next to it.
+// The tree only depends on the options and the seed, so it can be written
+// again before each measurement.
+// ===============================================================================
+class CTreeGenerator
+{
+public:
+	size_t		m_nFiles;			// number of target files
+	size_t		m_nFileSize;		// approximate size of a target file
+	size_t		m_nRules;			// replacements per file
+	size_t		m_nMatches;			// occurrences of each what-string per file
+	size_t		m_nNesting;			// %if nesting depth around the rules of a file
+	size_t		m_nRegex;			// how many of the rules are regular expressions (~)
+	size_t		m_nFilesPerDir;		// files per directory
+	bool		m_bBinary;			// $ rules instead of &, they keep the length
+	bool		m_bSameLength;		// the replacements keep the length of the file
+	bool		m_bUnchanged;		// the constants are the what-strings, a run only checks the files
+	unsigned	m_nSeed;
+
+	CTreeGenerator()
+	{
+		m_nFiles		= 1000;
+		m_nFileSize		= 4096;
+		m_nRules		= 4;
+		m_nMatches		= 1;
+		m_nNesting		= 0;
+		m_nRegex		= 0;
+		m_nFilesPerDir	= 1000;
+		m_bBinary		= false;
+		m_bSameLength	= false;
+		m_bUnchanged	= false;
+		m_nSeed			= 1;
+	}
+
+	bool	ParseOption(const char *arg);			// true if "arg" is an option of the generator
+	void	Generate(const string &dir) const;		// writes the tree and dir/control.txt
+	string	GetFileName(size_t index) const;		// relative to the base path
+	string	ToJson() const;							// the options, for the results
+
+	static string	GetControlFile(const string &dir);
+
+protected:
+	string	GetWhat(size_t rule) const;
+	string	GetWith(size_t rule) const;
+	void	WriteControlFile(const string &dir) const;
+	void	WriteTarget(const string &file_name, size_t index) const;
+};
+
+
+// ===============================================================================
+//									class CHarness
+//
+// Runs an autoversion executable on a generated tree and measures each run:
+// wall time, CPU time and peak RSS of the process, and the durations of the
+// phases, which the tool writes with -t. A repetition writes the tree again
+// and runs replace, rollback, replace and clean on it, or the steps given.
+// Each run is appended to the results as one JSON object per line.
+// ===============================================================================
+class CHarness
+{
+public:
+	string			m_strExecutable;	// the autoversion to measure
+	string			m_strDir;			// the tree
+	string			m_strResults;		// JSON lines are appended here, stdout if empty
+	string			m_strLabel;			// names the build in the results
+	vector<string>	m_vecArgs;			// passed to every run, e.g. -j4
+	vector<string>	m_vecSteps;			// the operations of a repetition
+	size_t			m_nRepetitions;
+	bool			m_bTimings;			// pass -t, false for builds which do not know it
+	bool			m_bKeepTree;		// the tree exists already, it is not written before the first repetition
+	bool			m_bColdCache;		// the page cache is dropped before each run
+
+	CHarness()
+	{
+		m_vecSteps		= { "replace", "rollback", "replace", "clean" };
+		m_nRepetitions	= 3;
+		m_bTimings		= true;
+		m_bKeepTree		= false;
+		m_bColdCache	= false;
+	}
+
+	bool	SetSteps(const string &steps);
+	void	Run(const CTreeGenerator &generator);
+
+protected:
+	struct SRun
+	{
+		string	m_strOperation;
+		int		m_nExitCode;
+		double	m_dWall;				// s
+		double	m_dCpu;					// s, user and system
+		unsigned long long	m_nPeakRss;	// bytes
+		unsigned long long	m_nWritten;	// bytes written to files, as far as the OS counts them
+		string	m_strTimings;			// the line written by -t, empty if none
+	};
+
+	SRun	Execute(const char *operation, const vector<string> &args);
+	void	Report(const vector<SRun> &runs, const CTreeGenerator &generator);
+	void	Summary(const vector<SRun> &runs);
+};
+
+
+#endif	// _AVBENCH_H_
@@ -0,0 +1,79 @@
+/*
+* ParseBench.cpp
+* Copyright (C) 2024  T. Radde
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Times ParseControlFile alone, without the check of the files, on a Control
+// File written by "avbench generate". Prints the median and the minimum of
+// the calls and the throughput:
+//
+//		g++ -std=c++17 -O2 -pthread bench/ParseBench.cpp -o parsebench
+//		parsebench /tmp/tree/control.txt [runs]
+//
+// Older sources are measured by copying this file into bench/ of their
+// checkout; if they have no AV_NO_MAIN, their main is renamed.
+
+#define AV_NO_MAIN
+#define main av_main
+#include "../AutoVersion.cpp"
+#undef main
+
+#include <chrono>
+
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2)
+	{
+		printf("usage: parsebench ControlFile [runs]\n");
+		return 1;
+	}
+
+	int runs = argc > 2 ? atoi(argv[2]) : 7;
+	if (runs < 1)
+		runs = 1;
+
+	struct stat st;
+	if (stat(argv[1], &st) != 0)
+	{
+		printf("cannot open \"%s\"\n", argv[1]);
+		return 1;
+	}
+
+	vector<double> times;
+	try
+	{
+		for (int i = 0; i < runs; i++)
+		{
+			unique_ptr<CAutoVersion> av(new CAutoVersion);
+			av->SetControlFile(argv[1]);
+			auto start = chrono::steady_clock::now();
+			av->ParseControlFile();
+			times.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+		}
+	}
+	catch (CException &e)
+	{
+		printf("Error: %s\n", e.what());
+		return 1;
+	}
+
+	sort(times.begin(), times.end());
+	double median = times[times.size() / 2];
+	double mb = st.st_size / (1024.0 * 1024.0);
+	printf("%.1f MB, %d runs: median %.4f s, min %.4f s, %.0f MB/s\n", mb, runs, median, times[0], mb / median);
+	return 0;
+}
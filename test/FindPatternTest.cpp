@@ -0,0 +1,258 @@
+/*
+* FindPatternTest.cpp
+* Copyright (C) 2024  T. Radde
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Unit test of the FindPattern variants: every variant the CPU supports must
+// return the same match set as a naive search, on random and on adversarial
+// inputs. Returns 0 if all checks pass.
+//
+//		g++ -std=c++17 -O2 -pthread test/FindPatternTest.cpp -o FindPatternTest
+
+#define AV_NO_MAIN
+#include "../AutoVersion.cpp"
+
+#include <random>
+
+
+static size_t g_nChecks = 0;
+static size_t g_nFailures = 0;
+
+
+// ========================================================================
+//                            NaiveMatches
+//
+// all positions of "pattern" in "buf", overlapping ones included
+// ========================================================================
+static vector<size_t> NaiveMatches(const char *buf, size_t size, const string &pattern)
+{
+	vector<size_t> matches;
+	for (size_t i = 0; i + pattern.length() <= size; i++)
+	{
+		if (memcmp(buf + i, pattern.data(), pattern.length()) == 0)
+			matches.push_back(i);
+	}
+
+	return matches;
+}
+
+
+// ========================================================================
+//                            VariantMatches
+//
+// all positions of "pattern" in "buf", found by calling the variant again
+// behind each match, as DoReplace and CheckReplacements do
+// ========================================================================
+static vector<size_t> VariantMatches(FindPatternFunc find, const char *buf, size_t size, const string &pattern)
+{
+	vector<size_t> matches;
+	size_t pos = 0;
+	while (pos + pattern.length() <= size)
+	{
+		const char *match = find(buf + pos, size - pos, pattern.data(), pattern.length());
+		if (!match)
+			break;
+
+		matches.push_back(match - buf);
+		pos = match - buf + 1;
+	}
+
+	return matches;
+}
+
+
+// ========================================================================
+//                            Check
+//
+// The text is copied to the end of a buffer of its own size, so a read
+// behind it is seen by a memory checker. "shift" moves the text against the
+// alignment of the buffer.
+// ========================================================================
+static void Check(const vector<SFindPatternVariant> &variants, const string &text, const string &pattern, size_t shift, const char *what)
+{
+	vector<char> storage(text.length() + shift + 1);
+	char *buf = storage.data() + shift;
+	memcpy(buf, text.data(), text.length());
+
+	vector<size_t> expected = NaiveMatches(buf, text.length(), pattern);
+	for (auto &variant : variants)
+	{
+		g_nChecks++;
+		if (pattern.empty())
+		{
+			// an empty pattern is found at the start
+			if (variant.m_pFunc(buf, text.length(), pattern.data(), 0) != buf)
+			{
+				printf("FAILED: %s, %s: empty pattern\n", variant.m_pName, what);
+				g_nFailures++;
+			}
+			continue;
+		}
+
+		if (VariantMatches(variant.m_pFunc, buf, text.length(), pattern) != expected)
+		{
+			printf("FAILED: %s, %s: text length %d, pattern length %d, shift %d\n",
+				variant.m_pName, what, (int)text.length(), (int)pattern.length(), (int)shift);
+			g_nFailures++;
+		}
+	}
+}
+
+
+// ========================================================================
+//                            RandomText
+// ========================================================================
+static string RandomText(mt19937 &rng, size_t len, int alphabet)
+{
+	string text(len, 0);
+	for (auto &c : text)
+		c = (char)('a' + rng() % alphabet);
+	return text;
+}
+
+
+// ========================================================================
+//                            TestRandom
+//
+// Small alphabets give many candidates, whose first and last bytes match.
+// The patterns are taken from the text or made up.
+// ========================================================================
+static void TestRandom(const vector<SFindPatternVariant> &variants)
+{
+	mt19937 rng(4711);
+	for (int round = 0; round < 20000; round++)
+	{
+		int alphabet = 1 + rng() % 4;
+		string text = RandomText(rng, rng() % 300, alphabet);
+
+		size_t len = 1 + rng() % 70;
+		string pattern;
+		if (rng() % 2 && len <= text.length())
+			pattern = text.substr(rng() % (text.length() - len + 1), len);
+		else
+			pattern = RandomText(rng, len, alphabet);
+
+		Check(variants, text, pattern, rng() % 64, "random");
+	}
+
+	// all 256 byte values, including 0 and the bytes above 127
+	for (int round = 0; round < 2000; round++)
+	{
+		string text(rng() % 200, 0);
+		for (auto &c : text)
+			c = (char)(rng() % 256);
+
+		size_t len = 1 + rng() % 4;
+		string pattern = len <= text.length() ? text.substr(rng() % (text.length() - len + 1), len) : string(len, (char)0xff);
+		Check(variants, text, pattern, rng() % 64, "binary");
+	}
+}
+
+
+// ========================================================================
+//                            TestAdversarial
+//
+// matches at the start and the end of the buffer and at both sides of each
+// 16, 32 and 64 byte block, repeated prefixes and patterns which only differ
+// in the middle
+// ========================================================================
+static void TestAdversarial(const vector<SFindPatternVariant> &variants)
+{
+	const size_t block_sizes[] = { 16, 32, 64, 128 };
+	const size_t pattern_lengths[] = { 1, 2, 3, 15, 16, 17, 31, 32, 33, 63, 64, 65 };
+
+	for (size_t len : pattern_lengths)
+	{
+		string pattern(len, 'x');
+		pattern[0] = 'p';
+		pattern[len - 1] = 'q';
+
+		for (size_t block : block_sizes)
+		{
+			for (size_t size = len; size <= block * 2 + len + 2; size++)
+			{
+				// the pattern at every position near a block boundary and at the end
+				for (size_t pos : { (size_t)0, block - 1, block, block + 1, size - len })
+				{
+					if (pos + len > size)
+						continue;
+
+					string text(size, 'x');
+					text.replace(pos, len, pattern);
+					for (size_t shift : { (size_t)0, (size_t)1, (size_t)31 })
+						Check(variants, text, pattern, shift, "boundary");
+				}
+			}
+		}
+
+		// first and last byte everywhere, the middle never matches
+		if (len >= 3)
+		{
+			string text;
+			while (text.length() < 300)
+				text += "p" + string(len - 2, 'y') + "q";
+			Check(variants, text, pattern, 0, "first and last byte");
+			Check(variants, text, pattern, 7, "first and last byte");
+		}
+	}
+
+	// repeated prefixes: "aaa...ab" in "aaa...a", with and without a match at the end
+	for (size_t len = 1; len <= 70; len++)
+	{
+		string pattern = string(len - 1, 'a') + "b";
+		for (size_t size : { len, (size_t)64, (size_t)65, (size_t)200 })
+		{
+			if (size < len)
+				continue;
+
+			string text(size, 'a');
+			Check(variants, text, pattern, 0, "repeated prefix");
+
+			text[size - 1] = 'b';
+			Check(variants, text, pattern, 0, "repeated prefix");
+			Check(variants, text, pattern, 3, "repeated prefix");
+		}
+
+		// overlapping matches
+		string text(150, 'a');
+		Check(variants, text, string(len, 'a'), 0, "overlapping");
+	}
+
+	// pattern longer than the text, empty text, empty pattern
+	Check(variants, "abc", "abcd", 0, "too long");
+	Check(variants, "", "a", 0, "empty text");
+	Check(variants, "abc", "", 0, "empty pattern");
+}
+
+
+// ===============================================================================
+//										main
+// ===============================================================================
+int main()
+{
+	vector<SFindPatternVariant> variants = GetFindPatternVariants();
+
+	printf("variants:");
+	for (auto &variant : variants)
+		printf(" %s", variant.m_pName);
+	printf("\n");
+
+	TestRandom(variants);
+	TestAdversarial(variants);
+
+	printf("%d checks, %d failed\n", (int)g_nChecks, (int)g_nFailures);
+	return g_nFailures == 0 ? 0 : 1;
+}
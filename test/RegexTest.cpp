@@ -0,0 +1,556 @@
+/*
+* RegexTest.cpp
+* Copyright (C) 2024  T. Radde
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Unit test of CRegex: the match and the groups must be the ones of a naive
+// backtracking matcher with the rules of Perl, on random expressions and
+// texts, and the ones Perl reports for a list of expressions. Returns 0 if
+// all checks pass.
+//
+//		g++ -std=c++17 -O2 -pthread test/RegexTest.cpp -o RegexTest
+
+#define AV_NO_MAIN
+#include "../AutoVersion.cpp"
+
+#include <functional>
+#include <random>
+
+
+static size_t g_nChecks = 0;
+static size_t g_nFailures = 0;
+static size_t g_nSkipped = 0;
+
+
+// ========================================================================
+//                            SRefNode
+//
+// an expression for the backtracking matcher, the random expressions are
+// built as a tree and written as a pattern for CRegex
+// ========================================================================
+struct SRefNode
+{
+	enum EType { enSet, enCat, enAlt, enRepeat, enGroup, enAssert };
+
+	EType				m_enType;
+	vector<bool>		m_vecSet;		// enSet: the bytes matched
+	char				m_cAssert;		// enAssert: ^ $ b B
+	int					m_nGroup;		// enGroup: the group, 0 for (?:)
+	int					m_nMin;			// enRepeat
+	int					m_nMax;			// enRepeat, -1 for no limit
+	bool				m_bGreedy;		// enRepeat
+	vector<SRefNode>	m_vecChildren;
+
+	SRefNode(EType type = enCat)
+	{
+		m_enType	= type;
+		m_cAssert	= 0;
+		m_nGroup	= 0;
+		m_nMin		= 0;
+		m_nMax		= 0;
+		m_bGreedy	= true;
+	}
+};
+
+
+// ========================================================================
+//                            CRefMatcher
+//
+// Backtracking, the alternatives are tried in the order of their priority.
+// As in Perl, an empty iteration ends a loop, once the minimum count is
+// reached. The matcher gives up after MaxSteps, for expressions which take
+// exponential time.
+// ========================================================================
+class CRefMatcher
+{
+protected:
+	enum { MaxSteps = 200000 };
+
+	typedef function<bool(size_t)> Cont;
+
+	const string	&m_strText;
+	vector<size_t>	m_vecCaps;
+	size_t			m_nSteps;
+
+	bool	Match(const SRefNode &node, size_t pos, const Cont &next);
+	bool	MatchCat(const SRefNode &node, size_t index, size_t pos, const Cont &next);
+	bool	MatchRepeat(const SRefNode &node, int count, size_t pos, const Cont &next);
+	bool	MatchAssert(char op, size_t pos) const;
+
+public:
+	bool	m_bGaveUp;
+
+	CRefMatcher(const string &text) : m_strText(text)
+	{
+		m_nSteps	= 0;
+		m_bGaveUp	= false;
+	}
+
+	// the leftmost match, "caps" as CRegex::Search returns them
+	bool	Search(const SRefNode &root, int groups, vector<size_t> &caps);
+};
+
+
+// ========================================================================
+//                            CRefMatcher::Search
+// ========================================================================
+bool CRefMatcher::Search(const SRefNode &root, int groups, vector<size_t> &caps)
+{
+	for (size_t start = 0; start <= m_strText.length(); start++)
+	{
+		m_vecCaps.assign(2 * (groups + 1), string::npos);
+		m_vecCaps[0] = start;
+		bool found = Match(root, start, [&](size_t pos) { m_vecCaps[1] = pos; return true; });
+		if (m_bGaveUp)
+			return false;
+
+		if (found)
+		{
+			caps = m_vecCaps;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+// ========================================================================
+//                            CRefMatcher::MatchAssert
+// ========================================================================
+bool CRefMatcher::MatchAssert(char op, size_t pos) const
+{
+	int prev = pos > 0 ? (unsigned char)m_strText[pos - 1] : -1;
+	int next = pos < m_strText.length() ? (unsigned char)m_strText[pos] : -1;
+
+	switch (op)
+	{
+	case '^':	return prev < 0 || prev == '\n';
+	case '$':	return next < 0 || next == '\n' || next == '\r';
+	case 'b':	return IsWordByte(prev) != IsWordByte(next);
+	default:	return IsWordByte(prev) == IsWordByte(next);
+	}
+}
+
+
+// ========================================================================
+//                            CRefMatcher::Match
+// ========================================================================
+bool CRefMatcher::Match(const SRefNode &node, size_t pos, const Cont &next)
+{
+	if (++m_nSteps > MaxSteps)
+	{
+		m_bGaveUp = true;
+		return false;
+	}
+
+	switch (node.m_enType)
+	{
+	case SRefNode::enSet:
+		return pos < m_strText.length() && node.m_vecSet[(unsigned char)m_strText[pos]] && next(pos + 1);
+
+	case SRefNode::enAssert:
+		return MatchAssert(node.m_cAssert, pos) && next(pos);
+
+	case SRefNode::enCat:
+		return MatchCat(node, 0, pos, next);
+
+	case SRefNode::enAlt:
+		for (auto &it : node.m_vecChildren)
+		{
+			if (Match(it, pos, next))
+				return true;
+		}
+		return false;
+
+	case SRefNode::enGroup:
+	{
+		if (node.m_nGroup == 0)
+			return Match(node.m_vecChildren[0], pos, next);
+
+		// the groups are restored, when the match fails behind them
+		size_t &start = m_vecCaps[2 * node.m_nGroup];
+		size_t &end = m_vecCaps[2 * node.m_nGroup + 1];
+		size_t old_start = start;
+		size_t old_end = end;
+
+		start = pos;
+		bool found = Match(node.m_vecChildren[0], pos, [&](size_t p)
+		{
+			size_t inner_end = end;
+			end = p;
+			if (next(p))
+				return true;
+			end = inner_end;
+			return false;
+		});
+
+		if (!found)
+		{
+			start = old_start;
+			end = old_end;
+		}
+		return found;
+	}
+
+	case SRefNode::enRepeat:
+		return MatchRepeat(node, 0, pos, next);
+	}
+
+	return false;
+}
+
+
+// ========================================================================
+//                            CRefMatcher::MatchCat
+//
+// matches the children of "node" from "index" on
+// ========================================================================
+bool CRefMatcher::MatchCat(const SRefNode &node, size_t index, size_t pos, const Cont &next)
+{
+	if (index == node.m_vecChildren.size())
+		return next(pos);
+
+	return Match(node.m_vecChildren[index], pos, [&](size_t p) { return MatchCat(node, index + 1, p, next); });
+}
+
+
+// ========================================================================
+//                            CRefMatcher::MatchRepeat
+//
+// "count" iterations are done, "pos" is the end of the last one
+// ========================================================================
+bool CRefMatcher::MatchRepeat(const SRefNode &node, int count, size_t pos, const Cont &next)
+{
+	auto iterate = [&]()
+	{
+		if (node.m_nMax >= 0 && count >= node.m_nMax)
+			return false;
+
+		return Match(node.m_vecChildren[0], pos, [&](size_t p)
+		{
+			// an empty iteration ends the loop from the minimum on
+			if (p == pos && count + 1 >= node.m_nMin)
+				return next(p);
+			return MatchRepeat(node, count + 1, p, next);
+		});
+	};
+
+	if (count < node.m_nMin)
+		return iterate();
+
+	if (node.m_bGreedy)
+		return iterate() || next(pos);
+	return next(pos) || iterate();
+}
+
+
+// ========================================================================
+//                            CRandomRegex
+//
+// random expressions over the bytes of the random texts, written as a
+// pattern at the same time
+// ========================================================================
+class CRandomRegex
+{
+protected:
+	mt19937	&m_Rng;
+	int		m_nGroups;
+
+	SRefNode	Alternative(int depth, string &pattern);
+	SRefNode	Sequence(int depth, string &pattern);
+	SRefNode	Repeat(int depth, string &pattern);
+	SRefNode	Atom(int depth, string &pattern);
+
+public:
+	CRandomRegex(mt19937 &rng) : m_Rng(rng)
+	{
+		m_nGroups = 0;
+	}
+
+	int			GetGroups() const { return m_nGroups; }
+	SRefNode	Generate(string &pattern) { m_nGroups = 0; return Alternative(0, pattern); }
+};
+
+
+// ========================================================================
+//                            CRandomRegex::Alternative
+// ========================================================================
+SRefNode CRandomRegex::Alternative(int depth, string &pattern)
+{
+	int count = 1 + m_Rng() % 3;
+	if (count == 1)
+		return Sequence(depth, pattern);
+
+	SRefNode node(SRefNode::enAlt);
+	for (int i = 0; i < count; i++)
+	{
+		if (i > 0)
+			pattern += '|';
+		node.m_vecChildren.push_back(Sequence(depth, pattern));
+	}
+	return node;
+}
+
+
+// ========================================================================
+//                            CRandomRegex::Sequence
+// ========================================================================
+SRefNode CRandomRegex::Sequence(int depth, string &pattern)
+{
+	SRefNode node(SRefNode::enCat);
+	int count = m_Rng() % 4;
+	for (int i = 0; i < count; i++)
+		node.m_vecChildren.push_back(Repeat(depth, pattern));
+	return node;
+}
+
+
+// ========================================================================
+//                            CRandomRegex::Repeat
+//
+// an atom, mostly with a quantifier, greedy or lazy
+// ========================================================================
+SRefNode CRandomRegex::Repeat(int depth, string &pattern)
+{
+	SRefNode atom = Atom(depth, pattern);
+	if (atom.m_enType == SRefNode::enAssert || m_Rng() % 3 == 0)
+		return atom;
+
+	static const struct { const char *m_pText; int m_nMin; int m_nMax; } quantifiers[] =
+	{
+		{ "*", 0, -1 }, { "+", 1, -1 }, { "?", 0, 1 }, { "{2}", 2, 2 }, { "{0,2}", 0, 2 },
+		{ "{1,3}", 1, 3 }, { "{2,3}", 2, 3 }, { "{1,}", 1, -1 }, { "{2,}", 2, -1 },
+	};
+	auto &q = quantifiers[m_Rng() % (sizeof(quantifiers) / sizeof(quantifiers[0]))];
+
+	SRefNode node(SRefNode::enRepeat);
+	node.m_nMin		= q.m_nMin;
+	node.m_nMax		= q.m_nMax;
+	node.m_bGreedy	= m_Rng() % 3 != 0;
+	node.m_vecChildren.push_back(std::move(atom));
+
+	pattern += q.m_pText;
+	if (!node.m_bGreedy)
+		pattern += '?';
+	return node;
+}
+
+
+// ========================================================================
+//                            CRandomRegex::Atom
+//
+// a group, an assertion or a set of bytes
+// ========================================================================
+SRefNode CRandomRegex::Atom(int depth, string &pattern)
+{
+	if (depth < 3 && m_Rng() % 3 == 0)
+	{
+		SRefNode node(SRefNode::enGroup);
+		if (m_Rng() % 3 == 0)
+			pattern += "(?:";
+		else
+		{
+			pattern += '(';
+			node.m_nGroup = ++m_nGroups;
+		}
+		node.m_vecChildren.push_back(Alternative(depth + 1, pattern));
+		pattern += ')';
+		return node;
+	}
+
+	static const char *assertions[] = { "^", "$", "\\b", "\\B" };
+	if (m_Rng() % 8 == 0)
+	{
+		const char *text = assertions[m_Rng() % 4];
+		SRefNode node(SRefNode::enAssert);
+		node.m_cAssert = text[1] ? text[1] : text[0];
+		pattern += text;
+		return node;
+	}
+
+	static const char *sets[] = { "a", "b", "1", ".", "[ab]", "[^a]", "\\d", "\\w", "\\s", "\\n" };
+	const char *text = sets[m_Rng() % (sizeof(sets) / sizeof(sets[0]))];
+
+	SRefNode node(SRefNode::enSet);
+	node.m_vecSet.assign(256, false);
+	for (int c = 0; c < 256; c++)
+	{
+		bool in;
+		if (!strcmp(text, "."))
+			in = c != '\n';
+		else if (!strcmp(text, "[ab]"))
+			in = c == 'a' || c == 'b';
+		else if (!strcmp(text, "[^a]"))
+			in = c != 'a';
+		else if (!strcmp(text, "\\d"))
+			in = c >= '0' && c <= '9';
+		else if (!strcmp(text, "\\w"))
+			in = IsWordByte(c);
+		else if (!strcmp(text, "\\s"))
+			in = c == ' ' || (c >= '\t' && c <= '\r');
+		else if (!strcmp(text, "\\n"))
+			in = c == '\n';
+		else
+			in = c == text[0];
+		node.m_vecSet[c] = in;
+	}
+
+	pattern += text;
+	return node;
+}
+
+
+// ========================================================================
+//                            FormatCaps
+// ========================================================================
+static string FormatCaps(bool found, const vector<size_t> &caps)
+{
+	if (!found)
+		return "none";
+
+	string text;
+	for (size_t i = 0; i + 1 < caps.size(); i += 2)
+	{
+		char buf[64];
+		if (caps[i] == string::npos || caps[i + 1] == string::npos)
+			snprintf(buf, sizeof(buf), "(-)");
+		else
+			snprintf(buf, sizeof(buf), "(%d,%d)", (int)caps[i], (int)caps[i + 1]);
+
+		if (!text.empty())
+			text += ' ';
+		text += buf;
+	}
+	return text;
+}
+
+
+// ========================================================================
+//                            Search
+//
+// the first match of "regex" in "text", formatted as by FormatCaps
+// ========================================================================
+static string Search(const CRegex &regex, const string &text)
+{
+	CRegex::SWorkspace work;
+	vector<size_t> caps;
+	size_t keep;
+	bool found = regex.Search(text.c_str(), text.length(), 0, true, work, caps, keep) == CRegex::enSrFound;
+	return FormatCaps(found, caps);
+}
+
+
+// ========================================================================
+//                            TestRandom
+// ========================================================================
+static void TestRandom()
+{
+	mt19937 rng(4711);
+	CRandomRegex generator(rng);
+	const char alphabet[] = "ab1 \n";
+
+	for (int round = 0; round < 20000; round++)
+	{
+		string pattern;
+		SRefNode root = generator.Generate(pattern);
+		CRegex regex(pattern);
+
+		for (int i = 0; i < 5; i++)
+		{
+			string text(rng() % 9, 0);
+			for (auto &c : text)
+				c = alphabet[rng() % (sizeof(alphabet) - 1)];
+
+			CRefMatcher matcher(text);
+			vector<size_t> caps;
+			bool found = matcher.Search(root, generator.GetGroups(), caps);
+			if (matcher.m_bGaveUp)
+			{
+				g_nSkipped++;
+				continue;
+			}
+
+			g_nChecks++;
+			string expected = FormatCaps(found, caps);
+			string result = Search(regex, text);
+			if (result != expected)
+			{
+				printf("FAILED: '%s' on \"%s\": %s, expected %s\n", pattern.c_str(), text.c_str(), result.c_str(), expected.c_str());
+				g_nFailures++;
+			}
+		}
+	}
+}
+
+
+// ========================================================================
+//                            TestPerl
+//
+// The results of Perl, where Python reports the same. Most are empty
+// iterations of a loop: they end the loop, their groups are kept.
+// ========================================================================
+static void TestPerl()
+{
+	static const struct { const char *m_pPattern; const char *m_pText; const char *m_pExpected; } cases[] =
+	{
+		{ "(?:\\d*?)*",			"12",	"(0,0)" },
+		{ "(x|\\d*?)+",			"12",	"(0,0) (0,0)" },
+		{ "(x|\\d*?)*",			"12",	"(0,0) (0,0)" },
+		{ "(a|)*",				"aab",	"(0,2) (2,2)" },
+		{ "(a|)+b",				"aab",	"(0,3) (2,2)" },
+		{ "(a|){2,}b",			"aab",	"(0,3) (2,2)" },
+		{ "(?:a|b?)+",			"aab",	"(0,3)" },
+		{ "(a*)+b",				"aab",	"(0,3) (2,2)" },
+		{ "((a)|b)*",			"aab",	"(0,3) (2,3) (1,2)" },
+		{ "(a|b)*?b",			"aab",	"(0,3) (1,2)" },
+		{ "^(?:(a)|()){2,3}$",	"a",	"(0,1) (0,1) (1,1)" },
+		{ "(|a){1,3}",			"a",	"(0,0) (0,0)" },
+		{ "(?:()|a)*b",			"aab",	"(0,3) (2,2)" },
+		{ "(a?)+?a",			"aab",	"(0,2) (0,1)" },
+		{ "\\b(\\w*)*",			" ab",	"(1,3) (3,3)" },
+		{ "(?:a?\?)*b",			"aab",	"(0,3)" },
+		{ "(a{0,2}?){2,}",		"aaa",	"(0,0) (0,0)" },
+		{ "a(b|c)*d",			"abcbd","(0,5) (3,4)" },
+		{ "x*",					"ab",	"(0,0)" },
+		{ "b+|a",				"abb",	"(0,1)" },
+		{ "(a|ab)(c|bcd)",		"abcd",	"(0,4) (0,1) (1,4)" },
+	};
+
+	for (auto &it : cases)
+	{
+		g_nChecks++;
+		string result = Search(CRegex(it.m_pPattern), it.m_pText);
+		if (result != it.m_pExpected)
+		{
+			printf("FAILED: '%s' on \"%s\": %s, Perl: %s\n", it.m_pPattern, it.m_pText, result.c_str(), it.m_pExpected);
+			g_nFailures++;
+		}
+	}
+}
+
+
+// ===============================================================================
+//										main
+// ===============================================================================
+int main()
+{
+	TestPerl();
+	TestRandom();
+
+	printf("%d checks, %d failed, %d skipped\n", (int)g_nChecks, (int)g_nFailures, (int)g_nSkipped);
+	return g_nFailures == 0 ? 0 : 1;
+}